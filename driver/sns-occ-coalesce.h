@@ -0,0 +1,141 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Adaptive interrupt coalescing controller.
+ *
+ * Coalescing value n makes OCC interrupt at least every n data packets.
+ * Time between interrupts is an upper bound for added latency, while the
+ * interrupt rate is what costs CPU. Controller is therefore given a window
+ * of acceptable interrupt rates: at least 1e6/latency_us and at most
+ * max_irqs per second. Once per period it takes the number of RX
+ * interrupts and scales n so that the same traffic would fall into the
+ * window. CPU budget wins when the two budgets conflict. Value shrinks
+ * faster than it grows, since too few interrupts after a rate drop delay
+ * data while too many only cost CPU for a period. RX rate reported by
+ * OCC covers the same second as the interrupt count, so it adds no
+ * prediction and is only kept in history to explain decisions.
+ *
+ * Firmware also interrupts at the end of every train regardless of the
+ * coalescing value. Driver can't tell those apart, so scaling the total
+ * count underestimates how much n must change. Controller therefore aims
+ * below the CPU budget, and when latency budget is exceeded it shrinks
+ * by the full step straight away rather than trusting the count.
+ *
+ * Kept free of kernel dependencies so that tools/coalesce can replay
+ * recorded rate traces through the very same code.
+ */
+
+#ifndef __SNS_OCC_COALESCE_H
+#define __SNS_OCC_COALESCE_H
+
+#ifdef __KERNEL__
+#include <linux/math64.h>
+#define OCC_COALESCE_DIV(a, b)		div64_u64(a, b)
+#else
+#include <stdint.h>
+#define OCC_COALESCE_DIV(a, b)		((a) / (b))
+#endif
+
+#include "sns-occ.h"
+
+#define OCC_COALESCE_MIN		1	// Interrupt on every packet
+#define OCC_COALESCE_MAX		1024	// Don't go further, bursts with EOP interrupts don't scale with n
+#define OCC_COALESCE_STEP_UP		4	// Maximum growth factor per period
+#define OCC_COALESCE_STEP_DOWN		16	// Maximum shrink factor per period
+#define OCC_COALESCE_HEADROOM		8	// Aim 1/8 below CPU budget
+#define OCC_COALESCE_HISTORY		16	// Number of decisions remembered
+
+struct occ_coalesce_sample {
+	u32 rx_rate;	// RX rate in B/s as reported by OCC, 0 if not available
+	u32 irq_rate;	// Measured RX interrupts per second
+	u32 value;	// Coalescing value selected for next period
+};
+
+struct occ_coalesce {
+	u32 latency_us;		// Latency budget, maximum time between interrupts
+	u32 max_irqs;		// CPU budget, maximum interrupts per second
+	u32 value;		// Current coalescing value
+	u32 history_cnt;	// Total number of decisions
+	struct occ_coalesce_sample history[OCC_COALESCE_HISTORY];
+};
+
+static inline void occ_coalesce_init(struct occ_coalesce *c, u32 latency_us, u32 max_irqs)
+{
+	u32 i;
+
+	c->latency_us = latency_us;
+	c->max_irqs = max_irqs;
+	c->value = OCC_COALESCE_MIN;
+	c->history_cnt = 0;
+	for (i = 0; i < OCC_COALESCE_HISTORY; i++) {
+		c->history[i].rx_rate = 0;
+		c->history[i].irq_rate = 0;
+		c->history[i].value = 0;
+	}
+}
+
+/**
+ * Take measurements of the last period and return coalescing value for the next one.
+ *
+ * @param[in] rx_rate RX rate in B/s at the end of period, 0 when not available
+ * @param[in] irqs Number of RX interrupts during the period
+ * @param[in] period_ms Length of the period
+ */
+static inline u32 occ_coalesce_update(struct occ_coalesce *c, u32 rx_rate, u32 irqs, u32 period_ms)
+{
+	struct occ_coalesce_sample *sample;
+	u64 irq_rate, target, value;
+	u64 lo, hi;
+
+	if (period_ms == 0)
+		period_ms = 1;
+	irq_rate = OCC_COALESCE_DIV((u64)irqs * 1000, period_ms);
+
+	if (irq_rate == 0) {
+		/* Idle, first packets after the pause get lowest latency */
+		value = OCC_COALESCE_MIN;
+	} else {
+		hi = c->max_irqs;
+		lo = (c->latency_us > 0 ? OCC_COALESCE_DIV(1000000ULL, c->latency_us) : 0);
+		if (lo > hi)
+			lo = hi;
+
+		target = irq_rate;
+		if (irq_rate > hi)
+			target = hi - hi / OCC_COALESCE_HEADROOM;
+		else if (irq_rate < lo)
+			target = lo;
+		if (target < lo)
+			target = lo;
+
+		/* Interrupt rate is inversely proportional to coalescing value */
+		value = c->value;
+		if (target != irq_rate && target > 0) {
+			value = OCC_COALESCE_DIV((u64)c->value * irq_rate + target - 1, target);
+			if (value > (u64)c->value * OCC_COALESCE_STEP_UP)
+				value = (u64)c->value * OCC_COALESCE_STEP_UP;
+			if (value < c->value / OCC_COALESCE_STEP_DOWN)
+				value = c->value / OCC_COALESCE_STEP_DOWN;
+		}
+		if (irq_rate < lo && value > c->value / OCC_COALESCE_STEP_DOWN)
+			value = c->value / OCC_COALESCE_STEP_DOWN;
+		if (value < OCC_COALESCE_MIN)
+			value = OCC_COALESCE_MIN;
+		if (value > OCC_COALESCE_MAX)
+			value = OCC_COALESCE_MAX;
+	}
+
+	c->value = value;
+
+	sample = &c->history[c->history_cnt % OCC_COALESCE_HISTORY];
+	sample->rx_rate = rx_rate;
+	sample->irq_rate = (irq_rate > 0xFFFFFFFF ? 0xFFFFFFFF : irq_rate);
+	sample->value = c->value;
+	c->history_cnt++;
+
+	return c->value;
+}
+
+#endif /* __SNS_OCC_COALESCE_H */
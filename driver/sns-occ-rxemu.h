@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Unified DQ emulation for firmware that splits optical RX path into
+ * three queues. Incoming Message Queue describes every packet, payload
+ * is either in hardware DQ or CQ depending on the packet type. Packets
+ * are copied to the unified DQ as IMQ entry followed by payload, which
+ * is the format user space expects from newer firmware.
+ *
+ * Copying works on a snapshot of all indexes and processes a batch of
+ * packets at once, so that caller can take the lock and access the
+ * registers once per batch rather than once per packet. Kept free of
+ * kernel dependencies so that tools/rxemu can benchmark the very same
+ * code in user space.
+ */
+
+#ifndef __SNS_OCC_RXEMU_H
+#define __SNS_OCC_RXEMU_H
+
+#ifdef __KERNEL__
+#include <linux/errno.h>
+#include <linux/string.h>
+#else
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#endif
+
+#include "sns-occ.h"
+
+#define IMQ_TYPE_COMMAND	0x80000000
+
+/* Layout of the actual used data in the IMQ */
+struct sw_imq {
+	u32 dest;
+	u32 src;
+	u32 type;
+	u32 length;
+	u32 info[2];
+};
+
+struct occ_rxemu_ring {
+	char *base;
+	u32 size;
+	u32 prod;
+	u32 cons;
+};
+
+struct occ_rxemu {
+	struct sw_imq *imq;		// Software copy of IMQ
+	u32 imq_size;			// Number of entries in imq
+	u32 imq_prod;
+	u32 imq_cons;
+	struct occ_rxemu_ring hwdq;	// Hardware data queue
+	struct occ_rxemu_ring hwcq;	// Hardware command queue
+	struct occ_rxemu_ring dq;	// Unified DQ, only prod is used
+	u32 dq_room;			// Free space in unified DQ
+};
+
+static inline u32 occ_rxemu_used(const struct occ_rxemu_ring *ring)
+{
+	return (ring->prod - ring->cons + ring->size) % ring->size;
+}
+
+static inline void occ_rxemu_copy(struct occ_rxemu_ring *dst, const char *src, u32 len)
+{
+	/* Caller must make sure there's room for the entire length */
+	u32 head = dst->size - dst->prod;
+
+	if (head > len)
+		head = len;
+	memcpy(dst->base + dst->prod, src, head);
+	if (len > head)
+		memcpy(dst->base, src + head, len - head);
+	dst->prod = (dst->prod + len) % dst->size;
+}
+
+/**
+ * Copy up to budget packets described by IMQ to unified DQ.
+ *
+ * All indexes in the struct are advanced as packets are copied. Packet
+ * that can't be copied is consumed from IMQ leaving its payload in the
+ * hardware queue, which is then out of sync and needs a reset.
+ *
+ * @return Number of packets copied, -EPROTO when IMQ describes more
+ *         data than available in hardware queue, -ENOSPC when unified
+ *         DQ is full.
+ */
+static inline int occ_rxemu_batch(struct occ_rxemu *e, u32 budget)
+{
+	int n = 0;
+
+	while (e->imq_cons != e->imq_prod && (u32)n < budget) {
+		struct sw_imq *imq = &e->imq[e->imq_cons];
+		struct occ_rxemu_ring *src = (imq->type & IMQ_TYPE_COMMAND ? &e->hwcq : &e->hwdq);
+		/* OCC consumes the queues in 4 byte increments */
+		u32 length = (imq->length + 3) & ~3;
+		u32 head;
+
+		e->imq_cons = (e->imq_cons + 1) % e->imq_size;
+
+		if (length > occ_rxemu_used(src))
+			return -EPROTO;
+		if (sizeof(struct sw_imq) + length > e->dq_room)
+			return -ENOSPC;
+
+		occ_rxemu_copy(&e->dq, (const char *)imq, sizeof(struct sw_imq));
+
+		head = src->size - src->cons;
+		if (head > length)
+			head = length;
+		occ_rxemu_copy(&e->dq, src->base + src->cons, head);
+		if (length > head)
+			occ_rxemu_copy(&e->dq, src->base, length - head);
+		src->cons = (src->cons + length) % src->size;
+
+		e->dq_room -= sizeof(struct sw_imq) + length;
+		n++;
+	}
+
+	return n;
+}
+
+#endif /* __SNS_OCC_RXEMU_H */
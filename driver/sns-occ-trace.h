@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Tracepoints for SNS OCC driver, available in ftrace and perf under
+ * snsocc subsystem, ie.
+ *
+ *   perf record -e 'snsocc:*' -e sched:sched_wakeup -a
+ *   echo 1 > /sys/kernel/tracing/events/snsocc/enable
+ *
+ * Every event carries device minor number so that multiple boards can
+ * be told apart.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM snsocc
+
+#if !defined(_SNS_OCC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _SNS_OCC_TRACE_H
+
+#include <linux/device.h>
+#include <linux/tracepoint.h>
+
+/* Interrupt handler entry, before status is cleared */
+TRACE_EVENT(snsocc_irq,
+	TP_PROTO(struct device *dev, u32 intr_status),
+	TP_ARGS(dev, intr_status),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, intr_status)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->intr_status = intr_status;
+	),
+	TP_printk("snsocc%u intr_status=0x%08x",
+		  __entry->minor, __entry->intr_status)
+);
+
+/* New data published to user space, readers are about to be woken up */
+TRACE_EVENT(snsocc_dq_prod,
+	TP_PROTO(struct device *dev, u32 dq_prod, u32 dq_cons),
+	TP_ARGS(dev, dq_prod, dq_cons),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, dq_prod)
+		__field(u32, dq_cons)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->dq_prod = dq_prod;
+		__entry->dq_cons = dq_cons;
+	),
+	TP_printk("snsocc%u dq_prod=0x%08x dq_cons=0x%08x",
+		  __entry->minor, __entry->dq_prod, __entry->dq_cons)
+);
+
+/* Consumer acknowledged data, through OCC_CMD_ADVANCE_DQ or OCC_CMD_RX_ACK */
+TRACE_EVENT(snsocc_advance_dq,
+	TP_PROTO(struct device *dev, bool subscriber, u32 val, u32 dq_cons, int ret),
+	TP_ARGS(dev, subscriber, val, dq_cons, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(bool, subscriber)
+		__field(u32, val)
+		__field(u32, dq_cons)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->subscriber = subscriber;
+		__entry->val = val;
+		__entry->dq_cons = dq_cons;
+		__entry->ret = ret;
+	),
+	TP_printk("snsocc%u%s val=%u dq_cons=0x%08x ret=%d",
+		  __entry->minor, __entry->subscriber ? " subscriber" : "",
+		  __entry->val, __entry->dq_cons, __entry->ret)
+);
+
+/* Read of RX state returns to user space */
+TRACE_EVENT(snsocc_rx,
+	TP_PROTO(struct device *dev, u32 dq_prod, u32 dq_cons, u32 status, int ret),
+	TP_ARGS(dev, dq_prod, dq_cons, status, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, dq_prod)
+		__field(u32, dq_cons)
+		__field(u32, status)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->dq_prod = dq_prod;
+		__entry->dq_cons = dq_cons;
+		__entry->status = status;
+		__entry->ret = ret;
+	),
+	TP_printk("snsocc%u dq_prod=0x%08x dq_cons=0x%08x status=0x%08x ret=%d",
+		  __entry->minor, __entry->dq_prod, __entry->dq_cons,
+		  __entry->status, __entry->ret)
+);
+
+/* Stall or overflow state changed, 0 when cleared by reset */
+TRACE_EVENT(snsocc_stall,
+	TP_PROTO(struct device *dev, int old, int new),
+	TP_ARGS(dev, old, new),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(int, old)
+		__field(int, new)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->old = old;
+		__entry->new = new;
+	),
+	TP_printk("snsocc%u stalled 0x%x -> 0x%x",
+		  __entry->minor, __entry->old, __entry->new)
+);
+
+/* TX work picked up a message from software queue */
+TRACE_EVENT(snsocc_tx_start,
+	TP_PROTO(struct device *dev, u32 len),
+	TP_ARGS(dev, len),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, len)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->len = len;
+	),
+	TP_printk("snsocc%u len=%u", __entry->minor, __entry->len)
+);
+
+/* Message left TX FIFO or failed, duration includes waiting for room */
+TRACE_EVENT(snsocc_tx_done,
+	TP_PROTO(struct device *dev, u32 len, int ret, u64 duration_ns),
+	TP_ARGS(dev, len, ret, duration_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, len)
+		__field(int, ret)
+		__field(u64, duration_ns)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->len = len;
+		__entry->ret = ret;
+		__entry->duration_ns = duration_ns;
+	),
+	TP_printk("snsocc%u len=%u ret=%d duration=%lluns",
+		  __entry->minor, __entry->len, __entry->ret,
+		  (unsigned long long)__entry->duration_ns)
+);
+
+/* Emulated DQ copied a batch of packets, ret is number of packets or error */
+TRACE_EVENT(snsocc_rxbatch,
+	TP_PROTO(struct device *dev, u32 budget, int ret, u32 dq_prod),
+	TP_ARGS(dev, budget, ret, dq_prod),
+	TP_STRUCT__entry(
+		__field(unsigned int, minor)
+		__field(u32, budget)
+		__field(int, ret)
+		__field(u32, dq_prod)
+	),
+	TP_fast_assign(
+		__entry->minor = MINOR(dev->devt);
+		__entry->budget = budget;
+		__entry->ret = ret;
+		__entry->dq_prod = dq_prod;
+	),
+	TP_printk("snsocc%u budget=%u ret=%d dq_prod=0x%08x",
+		  __entry->minor, __entry->budget, __entry->ret,
+		  __entry->dq_prod)
+);
+
+#endif /* _SNS_OCC_TRACE_H */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE sns-occ-trace
+#include <trace/define_trace.h>
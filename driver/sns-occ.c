@@ -12,6 +12,7 @@
 #include <linux/pci.h>
 #include <linux/io.h>
 #include <linux/interrupt.h>
+#include <linux/list.h>
 #include <linux/device.h>
 #include <linux/dma-mapping.h>
 #include <linux/fs.h>
@@ -23,6 +24,12 @@
 #include <linux/poll.h>
 #include <linux/delay.h>
 #include <linux/version.h>
+#include <linux/timer.h>
+#include <linux/hrtimer.h>
+#include <linux/uio.h>
+#include <linux/workqueue.h>
+#include <linux/debugfs.h>
+#include <linux/kref.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
 #include <linux/sched/signal.h>
@@ -31,6 +38,11 @@
 #endif
 
 #include "sns-occ.h"
+#include "sns-occ-coalesce.h"
+#include "sns-occ-rxemu.h"
+
+#define CREATE_TRACE_POINTS
+#include "sns-occ-trace.h"
 
 #define OCC_VER_STR __stringify(OCC_VER_MAJ) "." __stringify(OCC_VER_MIN) "." __stringify(OCC_VER_BUILD)
 
@@ -70,6 +82,18 @@ do {									\
 #define __devexit
 #endif // LINUX_VERSION_CODE
 
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,2,0)
+#define timer_delete_sync del_timer_sync
+#endif // LINUX_VERSION_CODE
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,13,0)
+#define hrtimer_setup(timer, fn, clock, mode)				\
+	do {								\
+		hrtimer_init(timer, clock, mode);			\
+		(timer)->function = fn;					\
+	} while (0)
+#endif // LINUX_VERSION_CODE
+
 /* Only really need one while on PCI-X, but hope to support multiple
  * cards easily on PCIe with the same driver.
  */
@@ -82,6 +106,11 @@ do {									\
  */
 #define OCC_DQ_SIZE			(2 * 1024 * 1024)
 
+/* Data queues allocated at runtime can be much larger, but OCC and
+ * struct occ_status only take 32-bit size.
+ */
+#define OCC_DQ_MAX_SIZE			(2UL * 1024 * 1024 * 1024)
+
 /* For cards that split the Optical data into three queues -- we have
  * an inbound message queue of 64 entries, each 32 bytes and a command
  * queue, which we'll ask for 64 KB.
@@ -90,6 +119,13 @@ do {									\
 #define OCC_IMQ_SIZE		(OCC_IMQ_ENTRIES * 8 * sizeof(u32))
 #define OCC_CQ_SIZE		(64 * 1024)
 
+/* Software TX queue; messages are queued by write() and sent to the
+ * TX FIFO one at a time from a work item. Each message is prefixed by
+ * a header holding its length, both are aligned to 8 bytes.
+ */
+#define OCC_TXQ_SIZE		(64 * 1024)
+#define OCC_TXQ_HDR_LEN		8
+
 #define OCC_MMIO_BAR		0
 #define OCC_TXFIFO_BAR		1
 #define OCC_DDR_BAR		2
@@ -104,6 +140,17 @@ do {									\
  */
 #define OCC_IRQ_LAT_BUF_SIZE	500
 
+/* How new RX data is picked up from the hardware, selected through
+ * rx_mode sysfs attribute. In hybrid mode RX interrupts are masked when
+ * they come faster than the polling period and unmasked once the ring
+ * goes idle. Polling only applies to the unified DQ, emulated DQ always
+ * uses interrupts.
+ */
+#define OCC_RX_MODE_INTERRUPT	0
+#define OCC_RX_MODE_HYBRID	1
+#define OCC_RX_MODE_POLL	2
+#define OCC_RX_POLL_PERIOD_US	50
+
 /* Old versions of the firmware had more configuration options, but
  * these are all that are used in the version we support for this driver.
  */
@@ -196,7 +243,11 @@ do {									\
  * need to check the packet type to find the rest of the data.
  */
 #define SW_IMQ_RING_SIZE	4096
-#define IMQ_TYPE_COMMAND	0x80000000
+
+/* How many packets the IRQ thread copies to the emulated DQ before
+ * making them visible to readers.
+ */
+#define OCC_RX_BATCH		64
 
 /* Interrupt types supported
  * Matches PCI_IRQ_(LEGACY|MSI|MSIX) macros in kernel 4.8.
@@ -208,12 +259,20 @@ do {									\
 /* Forward declaration of functions used in the structs */
 static ssize_t snsocc_sysfs_show_irq_coallesce(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t snsocc_sysfs_store_irq_coallesce(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t snsocc_sysfs_show_irq_coalesce_adaptive(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t snsocc_sysfs_store_irq_coalesce_adaptive(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 static ssize_t snsocc_sysfs_show_dma_big_mem(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t snsocc_sysfs_store_dma_big_mem(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t snsocc_sysfs_show_dma_sg_mem(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t snsocc_sysfs_store_dma_sg_mem(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t snsocc_sysfs_show_dma_size(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t snsocc_sysfs_store_dma_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 static ssize_t snsocc_sysfs_show_serial_number(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t snsocc_sysfs_show_firmware_date(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t snsocc_sysfs_show_irq_latency(struct device *dev, struct device_attribute *attr, char *buf);
 static ssize_t snsocc_sysfs_store_irq_latency(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+static ssize_t snsocc_sysfs_show_rx_mode(struct device *dev, struct device_attribute *attr, char *buf);
+static ssize_t snsocc_sysfs_store_rx_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
 
 /* Layout of the hardware Incoming Message Queue */
 struct hw_imq {
@@ -225,13 +284,16 @@ struct hw_imq {
 	u32	unused[2];
 };
 
-/* Layout of the actual used data in the IMQ */
-struct sw_imq {
-	u32	dest;
-	u32	src;
-	u32	type;
-	u32	length;
-	u32	info[2];
+/* RX buffer from dma_alloc_coherent(), which takes large ones from CMA.
+ * Referenced by the device while in use and by every user mapping, so
+ * that a buffer replaced on reset outlives mappings of the old one.
+ */
+struct occ_dq_buf {
+	struct kref ref;
+	struct device *dev;
+	void *vaddr;
+	dma_addr_t dma;
+	unsigned long size;
 };
 
 /* Board capabilities description structure */
@@ -242,6 +304,7 @@ struct occ_board_desc {
 	u32 unified_que;
 	u32 reset_errcnt;	// Does board have support for resetting error counters?
 	u8 late_rx_enable;  // Does board support late RX enable?
+	u8 irq_timestamps;  // Does board timestamp interrupts?
 	u8 interrupts;      // Supported interrupt types, see OCC_IRQ_*
 	struct attribute_group sysfs;
 };
@@ -271,6 +334,11 @@ struct occ {
 	u32 conf;
 	u32 irqs;
 
+	/* Consumer index last released to the hardware, the oldest of
+	 * dq_cons and the required subscribers' indexes.
+	 */
+	u32 dq_hw_cons;
+
 	bool emulate_dq;
 	bool reset_in_progress;
 	bool reset_occurred;
@@ -286,14 +354,73 @@ struct occ {
 	struct mutex tx_lock;
 	void *tx_buffer;
 	u32 tx_prod;
+
+	/* Software TX queue, indexes are protected by occ->lock. Writers
+	 * serialize on txq_lock, tx_work drains the queue holding tx_lock
+	 * for each message. It sleeps waiting for the link, so it runs on
+	 * its own workqueue rather than holding up the system one. TX
+	 * errors are reported by the next write.
+	 */
+	struct mutex txq_lock;
+	void *txq;
+	u32 txq_prod;
+	u32 txq_cons;
+	int tx_error;
+	struct workqueue_struct *tx_workq;
+	struct work_struct tx_work;
 	struct irq_latency irq_latency;
 
-	struct tasklet_struct rxtask;
+	/* Latency histograms collected on every interrupt when board
+	 * timestamps them, protected by occ->lock. Exported through debugfs.
+	 */
+	struct occ_irq_hist irq_hist;
+	struct dentry *debugfs;
+
+	/* Adaptive interrupt coalescing, coalesce is protected by
+	 * occ->lock. Work runs once a second while enabled.
+	 */
+	struct occ_coalesce coalesce;
+	bool coalesce_adaptive;
+	struct delayed_work coalesce_work;
+	unsigned long coalesce_last;
+	u32 coalesce_irqs;
+	u32 rx_irqs;
+
+	/* Page shared read-only with user space, mirrors RX ring state */
+	struct occ_ctrl *ctrl;
+
+	/* RX wakeup watermark set by the exclusive file handle. Readers
+	 * are woken up when there's at least rx_watermark bytes in the
+	 * queue, or when rx_timer expires rx_latency jiffies after the
+	 * data first arrived.
+	 */
+	u32 rx_watermark;
+	unsigned long rx_latency;
+	bool rx_expired;
+	struct timer_list rx_timer;
+
+	/* RX mode, one of OCC_RX_MODE_*. While rx_polling is set RX
+	 * interrupts are masked and new data is picked up by rx_poll_timer
+	 * every rx_poll_period microseconds, or by readers themselves.
+	 * Protected by occ->lock.
+	 */
+	int rx_mode;
+	bool rx_polling;
+	u32 rx_poll_period;
+	ktime_t rx_poll_last;
+	struct hrtimer rx_poll_timer;
+
 	struct device dev;
 	struct cdev cdev;
 
 	bool in_use;
 	bool use_optical;
+
+	/* Non-exclusive connections subscribed to RX ring, each with its
+	 * own consumer index. Protected by occ->lock.
+	 */
+	struct list_head subscribers;
+
 	int minor;
 	unsigned int msi_enabled;
 
@@ -307,6 +434,21 @@ struct occ {
 	unsigned long dq_big_addr;
 	char dq_big_cnf[64];
 
+	/* Data queue allocated as individual pages and mapped into one
+	 * contiguous device address range by IOMMU, used instead of
+	 * dq_page when set.
+	 */
+	struct sg_table *dq_sgt;
+
+	/* Resizable data queue, used instead of dq_page when set. Resize
+	 * prepares dq_next which replaces dq_buf on the next reset,
+	 * dq_next_size is 0 when nothing is pending and OCC_DQ_SIZE with
+	 * dq_next NULL to go back to dq_page. Protected by occ->lock.
+	 */
+	struct occ_dq_buf *dq_buf;
+	struct occ_dq_buf *dq_next;
+	unsigned long dq_next_size;
+
 	/* These are used to emulate the combined DQ from later firmware
 	 * on the SNS PCI-X card and SNS PCIe card.
 	 */
@@ -339,6 +481,15 @@ struct occ {
 struct file_ctx {
 	struct occ *occ;
 	bool debug_mode;
+
+	/* RX subscription of a non-exclusive connection, all protected
+	 * by occ->lock.
+	 */
+	struct list_head list;
+	u32 subscribe;		// 0 or one of OCC_SUBSCRIBE_*
+	u32 dq_cons;		// Consumer index while subscribed
+	bool overrun;		// Lossy subscriber was moved forward
+	bool remap;		// Dropped when DMA buffer was replaced
 };
 
 static const char *snsocc_name[] = {
@@ -355,6 +506,7 @@ static struct occ_board_desc boards[] = {
 		.unified_que = 1,
 		.reset_errcnt = 0,
 		.late_rx_enable = 0,
+		.irq_timestamps = 0,
 		.interrupts = OCC_IRQ_LEGACY,
 	},
 	{
@@ -364,6 +516,7 @@ static struct occ_board_desc boards[] = {
 		.unified_que = 0,
 		.reset_errcnt = 0,
 		.late_rx_enable = 0,
+		.irq_timestamps = 0,
 		.interrupts = OCC_IRQ_LEGACY,
 	},
 	{
@@ -373,6 +526,7 @@ static struct occ_board_desc boards[] = {
 		.unified_que = 1,
 		.reset_errcnt = 1,
 		.late_rx_enable = 1,
+		.irq_timestamps = 0,
 		.interrupts = OCC_IRQ_LEGACY,
 	},
 	{
@@ -382,12 +536,17 @@ static struct occ_board_desc boards[] = {
 		.unified_que = 1,
 		.reset_errcnt = 1,
 		.late_rx_enable = 1,
+		.irq_timestamps = 0,
 		.interrupts = OCC_IRQ_LEGACY,
 		.sysfs.attrs = (struct attribute **) (struct device_attribute *[]){
 			SNSOCC_DEVICE_ATTR("irq_coalescing", 0644, snsocc_sysfs_show_irq_coallesce, snsocc_sysfs_store_irq_coallesce),
+			SNSOCC_DEVICE_ATTR("irq_coalescing_adaptive", 0644, snsocc_sysfs_show_irq_coalesce_adaptive, snsocc_sysfs_store_irq_coalesce_adaptive),
 			SNSOCC_DEVICE_ATTR("dma_big_mem", 0644, snsocc_sysfs_show_dma_big_mem, snsocc_sysfs_store_dma_big_mem),
+			SNSOCC_DEVICE_ATTR("dma_sg_mem", 0644, snsocc_sysfs_show_dma_sg_mem, snsocc_sysfs_store_dma_sg_mem),
+			SNSOCC_DEVICE_ATTR("dma_size", 0644, snsocc_sysfs_show_dma_size, snsocc_sysfs_store_dma_size),
 			SNSOCC_DEVICE_ATTR("serial_number", 0444, snsocc_sysfs_show_serial_number, NULL),
 			SNSOCC_DEVICE_ATTR("firmware_date", 0444, snsocc_sysfs_show_firmware_date, NULL),
+			SNSOCC_DEVICE_ATTR("rx_mode", 0644, snsocc_sysfs_show_rx_mode, snsocc_sysfs_store_rx_mode),
 			NULL,
 		},
 	},
@@ -398,13 +557,18 @@ static struct occ_board_desc boards[] = {
 		.unified_que = 1,
 		.reset_errcnt = 1,
 		.late_rx_enable = 1,
+		.irq_timestamps = 1,
 		.interrupts = OCC_IRQ_LEGACY | OCC_IRQ_MSI,
 		.sysfs.attrs = (struct attribute **) (struct device_attribute *[]){
 			SNSOCC_DEVICE_ATTR("irq_coalescing", 0644, snsocc_sysfs_show_irq_coallesce, snsocc_sysfs_store_irq_coallesce),
+			SNSOCC_DEVICE_ATTR("irq_coalescing_adaptive", 0644, snsocc_sysfs_show_irq_coalesce_adaptive, snsocc_sysfs_store_irq_coalesce_adaptive),
 			SNSOCC_DEVICE_ATTR("dma_big_mem", 0644, snsocc_sysfs_show_dma_big_mem, snsocc_sysfs_store_dma_big_mem),
+			SNSOCC_DEVICE_ATTR("dma_sg_mem", 0644, snsocc_sysfs_show_dma_sg_mem, snsocc_sysfs_store_dma_sg_mem),
+			SNSOCC_DEVICE_ATTR("dma_size", 0644, snsocc_sysfs_show_dma_size, snsocc_sysfs_store_dma_size),
 			SNSOCC_DEVICE_ATTR("serial_number", 0444, snsocc_sysfs_show_serial_number, NULL),
 			SNSOCC_DEVICE_ATTR("firmware_date", 0444, snsocc_sysfs_show_firmware_date, NULL),
 			SNSOCC_DEVICE_ATTR("irq_latency", 0644, snsocc_sysfs_show_irq_latency, snsocc_sysfs_store_irq_latency),
+			SNSOCC_DEVICE_ATTR("rx_mode", 0644, snsocc_sysfs_show_rx_mode, snsocc_sysfs_store_rx_mode),
 			NULL,
 		},
 	},
@@ -416,6 +580,27 @@ static struct class *snsocc_class;
 static dev_t snsocc_basedev;
 static struct occ *snsocc_devs[OCC_MAX_DEVS];
 
+static void __snsocc_ctrl_update(struct occ *occ)
+{
+	/* Publish RX ring state to the shared page.
+	 *
+	 * Caller must hold occ->lock.
+	 */
+	struct occ_ctrl *ctrl = occ->ctrl;
+	u32 status = occ->stalled;
+
+	if (occ->reset_occurred || occ->reset_in_progress)
+		status |= OCC_RESET_OCCURRED;
+
+	ctrl->generation++;
+	smp_wmb();
+	ctrl->dq_prod = occ->dq_prod;
+	ctrl->dq_cons = occ->dq_cons;
+	ctrl->status = status;
+	smp_wmb();
+	ctrl->generation++;
+}
+
 static void __snsocc_stalled(struct occ *occ, int type)
 {
 	/* We've stalled for some reason; disable RX, as it appears the GE
@@ -423,11 +608,14 @@ static void __snsocc_stalled(struct occ *occ, int type)
 	 *
 	 * Caller must hold occ->lock.
 	 */
+	if (occ->stalled != type)
+		trace_snsocc_stall(&occ->dev, occ->stalled, type);
 	occ->stalled = type;
 	// Must change occ->conf otherwise RX might get re-enabled automatically in TX thread
 	if (occ->board->late_rx_enable)
 		occ->conf &= ~OCC_CONF_RX_ENABLE;
 	iowrite32(occ->conf, occ->ioaddr + REG_CONFIG);
+	__snsocc_ctrl_update(occ);
 	wake_up(&occ->rx_wq);
 }
 
@@ -509,51 +697,36 @@ static u32 __snsocc_tx_room(struct occ *occ)
 	return room % occ->board->tx_fifo_len;
 }
 
-static ssize_t snsocc_tx(struct file *file, struct occ *occ,
-			 const char __user *buf, size_t count)
+static int __snsocc_tx_wait_room(struct occ *occ, size_t count)
 {
-	u32 dwords, head, tail, conf;
-	DEFINE_WAIT(wait);
-	int timeout, ret = 0;
-
-	if (count < 1 || count > occ->board->tx_fifo_len)
-		return -EINVAL;
-
-	mutex_lock(&occ->tx_lock);
-	for (;;) {
-		prepare_to_wait(&occ->tx_wq, &wait, TASK_INTERRUPTIBLE);
-		if (occ->reset_in_progress) {
-			ret = -ECONNRESET;
-			break;
-		}
-		conf = ioread32(occ->ioaddr + REG_CONFIG);
-		if (!(conf & OCC_CONF_TX_ENABLE) &&
-					count < __snsocc_tx_room(occ))
-			break;
-		if (file->f_flags & O_NONBLOCK) {
-			ret = -EAGAIN;
-			break;
-		}
-		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
-			break;
+	/* Wait for previous message to be sent and enough room in FIFO.
+	 *
+	 * Caller must hold occ->tx_lock.
+	 */
+	int timeout = 5000;
+
+	while ((ioread32(occ->ioaddr + REG_CONFIG) & OCC_CONF_TX_ENABLE) ||
+	       count >= __snsocc_tx_room(occ)) {
+		if (READ_ONCE(occ->reset_in_progress))
+			return -ECONNRESET;
+		if (!--timeout) {
+			dev_err(&occ->dev, "TX FIFO full\n");
+			return -EIO;
 		}
-		mutex_unlock(&occ->tx_lock);
-		schedule();
-		mutex_lock(&occ->tx_lock);
+		msleep(1);
 	}
-	finish_wait(&occ->tx_wq, &wait);
-
-	if (ret)
-		goto out;
+	return 0;
+}
 
-	/* We don't have a nice function to copy from user space to
-	 * the MMIO/FIFO, so we bounce through a buffer. This isn't a
-	 * terrible problem, as the TX side is not performance critical.
+static ssize_t __snsocc_tx_send(struct occ *occ, size_t count)
+{
+	/* Send count bytes from tx_buffer and wait for completion.
+	 *
+	 * Caller must hold occ->tx_lock.
 	 */
-	ret = -EFAULT;
-	if (copy_from_user(occ->tx_buffer, buf, count))
-		goto out;
+	u32 dwords, head, tail, conf;
+	int timeout;
+	ssize_t ret;
 
 	if (count % 8)
 		memset(occ->tx_buffer + count, 0, 8 - (count % 8));
@@ -597,8 +770,9 @@ static ssize_t snsocc_tx(struct file *file, struct occ *occ,
 	 * the common probe packets, but not spin the CPU waiting for the
 	 * larger config packets.
 	 *
-	 * Note that we hold the tx_lock for this entire time; this is how
-	 * we serialize multiple threads that wish to send a message.
+	 * Note that we hold the tx_lock for this entire time; this is only
+	 * done from the TX work item, writers don't wait for us. Reset
+	 * doesn't either, we give up as soon as it starts.
 	 */
 	timeout = 20;
 	do {
@@ -610,6 +784,8 @@ static ssize_t snsocc_tx(struct file *file, struct occ *occ,
 		timeout = 5000;
 		do {
 			msleep(1);
+			if (READ_ONCE(occ->reset_in_progress))
+				return -ECONNRESET;
 			conf = ioread32(occ->ioaddr + REG_CONFIG);
 		} while ((conf & OCC_CONF_TX_ENABLE) && --timeout);
 	}
@@ -619,55 +795,473 @@ static ssize_t snsocc_tx(struct file *file, struct occ *occ,
 		ret = -EIO;
 	}
 
-out:
-	mutex_unlock(&occ->tx_lock);
+	return ret;
+}
+
+static u32 __snsocc_txq_room(struct occ *occ)
+{
+	/* Caller must hold occ->lock */
+	u32 used = occ->txq_prod - occ->txq_cons + OCC_TXQ_SIZE;
+	used %= OCC_TXQ_SIZE;
+	return OCC_TXQ_SIZE - used - OCC_TXQ_HDR_LEN;
+}
+
+static void snsocc_tx_work(struct work_struct *work)
+{
+	struct occ *occ = container_of(work, struct occ, tx_work);
+	u32 cons, len, head;
+	ssize_t ret;
+	u64 start;
+
+	for (;;) {
+		/* Reset waits for us to give up, and flushes the queue
+		 * once it's done.
+		 */
+		mutex_lock(&occ->tx_lock);
+		spin_lock_irq(&occ->lock);
+		if (occ->reset_in_progress || occ->txq_cons == occ->txq_prod) {
+			spin_unlock_irq(&occ->lock);
+			mutex_unlock(&occ->tx_lock);
+			break;
+		}
+		cons = occ->txq_cons;
+		spin_unlock_irq(&occ->lock);
+
+		len = *(u32 *)(occ->txq + cons);
+		cons = (cons + OCC_TXQ_HDR_LEN) % OCC_TXQ_SIZE;
+		head = min_t(u32, len, OCC_TXQ_SIZE - cons);
+		memcpy(occ->tx_buffer, occ->txq + cons, head);
+		memcpy(occ->tx_buffer + head, occ->txq, len - head);
+
+		trace_snsocc_tx_start(&occ->dev, len);
+		start = ktime_to_ns(ktime_get());
+		ret = __snsocc_tx_wait_room(occ, len);
+		if (ret == 0)
+			ret = __snsocc_tx_send(occ, len);
+		trace_snsocc_tx_done(&occ->dev, len, ret < 0 ? ret : 0,
+				     ktime_to_ns(ktime_get()) - start);
+
+		spin_lock_irq(&occ->lock);
+		occ->txq_cons = (cons + ALIGN(len, 8)) % OCC_TXQ_SIZE;
+		if (ret < 0)
+			occ->tx_error = ret;
+		spin_unlock_irq(&occ->lock);
+		mutex_unlock(&occ->tx_lock);
 
-	/* Wake up anyone else trying to send */
-	wake_up(&occ->tx_wq);
+		/* Wake up anyone waiting for room in the queue */
+		wake_up(&occ->tx_wq);
+	}
+}
+
+static int snsocc_txq_lock(struct file *file, struct occ *occ, size_t count)
+{
+	/* Wait until there's room for count bytes in the software TX
+	 * queue. Returns offset of message data with txq_lock held.
+	 */
+	DEFINE_WAIT(wait);
+	bool room;
+	int ret;
+
+	if (count < 1 || count >= occ->board->tx_fifo_len - 8)
+		return -EINVAL;
+
+	mutex_lock(&occ->txq_lock);
+	for (;;) {
+		prepare_to_wait(&occ->tx_wq, &wait, TASK_INTERRUPTIBLE);
+		spin_lock_irq(&occ->lock);
+		ret = 0;
+		room = false;
+		if (occ->reset_in_progress) {
+			ret = -ECONNRESET;
+		} else if (occ->tx_error) {
+			/* Report error from previously queued message */
+			ret = occ->tx_error;
+			occ->tx_error = 0;
+		} else if (ALIGN(count, 8) + OCC_TXQ_HDR_LEN <= __snsocc_txq_room(occ)) {
+			room = true;
+			ret = (occ->txq_prod + OCC_TXQ_HDR_LEN) % OCC_TXQ_SIZE;
+		}
+		spin_unlock_irq(&occ->lock);
+		if (ret < 0 || room)
+			break;
+
+		if (file->f_flags & O_NONBLOCK) {
+			ret = -EAGAIN;
+			break;
+		}
+		if (signal_pending(current)) {
+			ret = -ERESTARTSYS;
+			break;
+		}
+		mutex_unlock(&occ->txq_lock);
+		schedule();
+		mutex_lock(&occ->txq_lock);
+	}
+	finish_wait(&occ->tx_wq, &wait);
+
+	if (ret < 0)
+		mutex_unlock(&occ->txq_lock);
 	return ret;
 }
 
-static ssize_t snsocc_rx(struct file *file, char __user *buf, size_t count)
+static void snsocc_txq_unlock(struct occ *occ, size_t count)
+{
+	/* Publish the message copied into the queue and let the work
+	 * item send it. Count 0 discards the message.
+	 */
+	if (count) {
+		*(u32 *)(occ->txq + occ->txq_prod) = count;
+
+		spin_lock_irq(&occ->lock);
+		occ->txq_prod += OCC_TXQ_HDR_LEN + ALIGN(count, 8);
+		occ->txq_prod %= OCC_TXQ_SIZE;
+		spin_unlock_irq(&occ->lock);
+
+		queue_work(occ->tx_workq, &occ->tx_work);
+	}
+	mutex_unlock(&occ->txq_lock);
+}
+
+static ssize_t snsocc_tx(struct file *file, struct occ *occ,
+			 const char __user *buf, size_t count)
+{
+	u32 head;
+	int off;
+
+	off = snsocc_txq_lock(file, occ, count);
+	if (off < 0)
+		return off;
+
+	head = min_t(u32, count, OCC_TXQ_SIZE - off);
+	if (copy_from_user(occ->txq + off, buf, head) ||
+	    copy_from_user(occ->txq, buf + head, count - head)) {
+		snsocc_txq_unlock(occ, 0);
+		return -EFAULT;
+	}
+
+	snsocc_txq_unlock(occ, count);
+	return count;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+static ssize_t snsocc_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	/* Gathering write, only supported for OCC_CMD_TX. Data from all
+	 * segments is sent as a single message, so that a batch of
+	 * packets costs one TX kick and one completion wait.
+	 */
+	struct file *file = iocb->ki_filp;
+	struct file_ctx *file_ctx = file->private_data;
+	struct occ *occ = file_ctx->occ;
+	size_t count = iov_iter_count(from);
+	u32 head;
+	int off;
+
+	if (file_ctx->debug_mode || iocb->ki_pos != OCC_CMD_TX)
+		return -EINVAL;
+
+	off = snsocc_txq_lock(file, occ, count);
+	if (off < 0)
+		return off;
+
+	head = min_t(u32, count, OCC_TXQ_SIZE - off);
+	if (copy_from_iter(occ->txq + off, head, from) != head ||
+	    copy_from_iter(occ->txq, count - head, from) != count - head) {
+		snsocc_txq_unlock(occ, 0);
+		return -EFAULT;
+	}
+
+	snsocc_txq_unlock(occ, count);
+	return count;
+}
+#endif // LINUX_VERSION_CODE
+
+static u32 __snsocc_rxused(struct occ *occ)
+{
+	/* Caller must hold occ->lock */
+	return (occ->dq_size + occ->dq_prod - occ->dq_cons) % occ->dq_size;
+}
+
+static u32 __snsocc_rxused_from(struct occ *occ, u32 cons)
+{
+	/* Caller must hold occ->lock */
+	return (occ->dq_size + occ->dq_prod - cons) % occ->dq_size;
+}
+
+static void __snsocc_release_dq(struct occ *occ)
+{
+	/* Let the hardware reuse data that the exclusive connection and
+	 * all required subscribers have consumed. Lossy subscribers that
+	 * are further behind are moved forward, hardware may overwrite
+	 * their data now.
+	 *
+	 * Caller must hold occ->lock.
+	 */
+	struct file_ctx *sub;
+	u32 cons = occ->dq_cons;
+	u32 used = __snsocc_rxused(occ);
+
+	list_for_each_entry(sub, &occ->subscribers, list) {
+		if (sub->subscribe == OCC_SUBSCRIBE_REQUIRED &&
+		    __snsocc_rxused_from(occ, sub->dq_cons) > used) {
+			cons = sub->dq_cons;
+			used = __snsocc_rxused_from(occ, cons);
+		}
+	}
+
+	list_for_each_entry(sub, &occ->subscribers, list) {
+		if (sub->subscribe == OCC_SUBSCRIBE_LOSSY &&
+		    __snsocc_rxused_from(occ, sub->dq_cons) > used) {
+			sub->dq_cons = cons;
+			sub->overrun = true;
+		}
+	}
+
+	if (cons != occ->dq_hw_cons) {
+		occ->dq_hw_cons = cons;
+		if (!occ->emulate_dq)
+			iowrite32(cons, occ->ioaddr + REG_DQ_CONS_INDEX);
+	}
+}
+
+static bool __snsocc_rx_ready(struct occ *occ, struct file_ctx *file_ctx)
+{
+	/* Caller must hold occ->lock */
+	if (file_ctx->subscribe)
+		return occ->dq_prod != file_ctx->dq_cons;
+
+	if (occ->dq_prod == occ->dq_cons)
+		return false;
+
+	/* Watermark only applies to the exclusive handle */
+	if (file_ctx->debug_mode || occ->rx_watermark == 0)
+		return true;
+
+	return occ->rx_expired || __snsocc_rxused(occ) >= occ->rx_watermark;
+}
+
+static void __snsocc_rx_wake(struct occ *occ)
+{
+	/* Wake up readers when new data arrives, or defer it until the
+	 * watermark is reached or latency timer expires.
+	 *
+	 * Caller must hold occ->lock.
+	 */
+	if (occ->rx_watermark && !occ->rx_expired &&
+	    __snsocc_rxused(occ) < occ->rx_watermark) {
+		if (occ->dq_prod != occ->dq_cons && !timer_pending(&occ->rx_timer))
+			mod_timer(&occ->rx_timer, jiffies + occ->rx_latency);
+
+		/* Watermark doesn't apply to subscribers */
+		if (list_empty(&occ->subscribers))
+			return;
+	}
+
+	wake_up(&occ->rx_wq);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+static void snsocc_rx_timeout(struct timer_list *t)
+{
+	struct occ *occ = container_of(t, struct occ, rx_timer);
+#else
+static void snsocc_rx_timeout(unsigned long data)
+{
+	struct occ *occ = (struct occ *) data;
+#endif
+	unsigned long flags;
+
+	spin_lock_irqsave(&occ->lock, flags);
+	if (occ->dq_prod != occ->dq_cons) {
+		occ->rx_expired = true;
+		wake_up(&occ->rx_wq);
+	}
+	spin_unlock_irqrestore(&occ->lock, flags);
+}
+
+static bool __snsocc_rx_refresh(struct occ *occ)
+{
+	/* Pick up new data from the unified DQ and wake up readers,
+	 * returns whether hardware produced anything.
+	 *
+	 * Caller must hold occ->lock.
+	 */
+	u32 prod = ioread32(occ->ioaddr + REG_DQ_PROD_INDEX);
+
+	if (prod == occ->dq_prod)
+		return false;
+
+	occ->dq_prod = prod;
+	trace_snsocc_dq_prod(&occ->dev, occ->dq_prod, occ->dq_cons);
+	__snsocc_ctrl_update(occ);
+	__snsocc_rx_wake(occ);
+	return true;
+}
+
+static void __snsocc_rx_poll_start(struct occ *occ)
+{
+	/* Mask RX interrupts and let the timer pick up data instead.
+	 * Error interrupts stay enabled.
+	 *
+	 * Caller must hold occ->lock.
+	 */
+	if (occ->rx_polling || occ->emulate_dq || occ->reset_in_progress)
+		return;
+
+	occ->rx_polling = true;
+	iowrite32(occ->irqs & ~OCC_IRQ_RX_DONE, occ->ioaddr + REG_IRQ_ENABLE);
+	hrtimer_start(&occ->rx_poll_timer, ns_to_ktime(occ->rx_poll_period * NSEC_PER_USEC),
+		      HRTIMER_MODE_REL);
+}
+
+static void __snsocc_rx_poll_stop(struct occ *occ)
+{
+	/* Unmask RX interrupts, timer stops on its next expiry. Data
+	 * that arrived while masked may not raise an interrupt, check
+	 * once more after unmasking.
+	 *
+	 * Caller must hold occ->lock.
+	 */
+	if (!occ->rx_polling)
+		return;
+
+	occ->rx_polling = false;
+	iowrite32(occ->irqs, occ->ioaddr + REG_IRQ_ENABLE);
+	ioread32(occ->ioaddr + REG_IRQ_ENABLE); // iowrite32() is posted, make sure register gets to the board
+	__snsocc_rx_refresh(occ);
+}
+
+static enum hrtimer_restart snsocc_rx_poll(struct hrtimer *timer)
+{
+	struct occ *occ = container_of(timer, struct occ, rx_poll_timer);
+	enum hrtimer_restart ret = HRTIMER_NORESTART;
+	unsigned long flags;
+
+	spin_lock_irqsave(&occ->lock, flags);
+	if (occ->rx_polling && !occ->reset_in_progress) {
+		if (!__snsocc_rx_refresh(occ) && occ->rx_mode == OCC_RX_MODE_HYBRID) {
+			__snsocc_rx_poll_stop(occ);
+		} else {
+			hrtimer_forward_now(timer, ns_to_ktime(occ->rx_poll_period * NSEC_PER_USEC));
+			ret = HRTIMER_RESTART;
+		}
+	}
+	spin_unlock_irqrestore(&occ->lock, flags);
+
+	return ret;
+}
+
+static int __snsocc_advance_dq(struct occ *occ, struct file_ctx *file_ctx, u32 val)
+{
+	/* Caller must hold occ->lock */
+	u32 *dq_cons = (file_ctx->subscribe ? &file_ctx->dq_cons : &occ->dq_cons);
+	u32 cons;
+
+	if (occ->reset_in_progress)
+		return -ECONNRESET;
+
+	if (!occ_dq_advance(occ->dq_size, occ->dq_prod, *dq_cons, val, &cons)) {
+		trace_snsocc_advance_dq(&occ->dev, file_ctx->subscribe, val, *dq_cons, -EOVERFLOW);
+		return -EOVERFLOW;
+	}
+
+	*dq_cons = cons;
+	trace_snsocc_advance_dq(&occ->dev, file_ctx->subscribe, val, cons, 0);
+	__snsocc_release_dq(occ);
+	__snsocc_ctrl_update(occ);
+
+	if (file_ctx->subscribe)
+		return 0;
+
+	/* Restart latency timer for any data left in the queue */
+	if (occ->rx_watermark) {
+		occ->rx_expired = false;
+		if (occ->dq_prod != occ->dq_cons)
+			mod_timer(&occ->rx_timer, jiffies + occ->rx_latency);
+	}
+	return 0;
+}
+
+static ssize_t snsocc_rx(struct file *file, char __user *buf, size_t count,
+			 bool ack)
 {
 	struct file_ctx *file_ctx = file->private_data;
 	struct occ *occ = file_ctx->occ;
 	DEFINE_WAIT(wait);
+	long remaining = MAX_SCHEDULE_TIMEOUT;
 	int ret = 0;
-	u32 info[2];
+	u32 info[3];
+	u32 cons;
 
-	if (count != sizeof(info))
+	/* Consumer index is optional */
+	if (count != 2 * sizeof(u32) && count != sizeof(info))
 		return -EINVAL;
 
+	if (ack) {
+		/* Debug connection is not allowed to consume data */
+		if (file_ctx->debug_mode && !file_ctx->subscribe)
+			return (file_ctx->remap ? -ECONNRESET : -EINVAL);
+
+		if (copy_from_user(info, buf, 2 * sizeof(u32)))
+			return -EFAULT;
+
+		if (info[1] != 0)
+			remaining = msecs_to_jiffies(info[1]);
+	}
+
 	spin_lock_irq(&occ->lock);
+	if (ack && info[0] != 0) {
+		ret = __snsocc_advance_dq(occ, file_ctx, info[0]);
+		if (ret) {
+			spin_unlock_irq(&occ->lock);
+			return ret;
+		}
+	}
 	for (;;) {
 		prepare_to_wait(&occ->rx_wq, &wait, TASK_INTERRUPTIBLE);
-		if (occ->reset_in_progress) {
+		if (occ->reset_in_progress || file_ctx->remap) {
 			ret = -ECONNRESET;
 			break;
 		}
 		if (occ->stalled)
 			break;
-		if (occ->dq_prod != occ->dq_cons)
+		/* Busy-poll from reader's context while interrupts are masked */
+		if (occ->rx_polling)
+			__snsocc_rx_refresh(occ);
+		if (__snsocc_rx_ready(occ, file_ctx))
 			break;
 
 		if (file->f_flags & O_NONBLOCK) {
 			ret = -EAGAIN;
 			break;
 		}
+		if (remaining == 0)
+			break;
 		if (signal_pending(current)) {
-			ret = -ERESTARTSYS;
+			/* Restarting would advance consumer index again,
+			 * report no data instead.
+			 */
+			if (!ack)
+				ret = -ERESTARTSYS;
 			break;
 		}
 		spin_unlock_irq(&occ->lock);
-		schedule();
+		remaining = schedule_timeout(remaining);
 		spin_lock_irq(&occ->lock);
 	}
 	finish_wait(&occ->rx_wq, &wait);
 
+	cons = (file_ctx->subscribe ? file_ctx->dq_cons : occ->dq_cons);
 	info[0] = occ->dq_prod;
 	info[1] = __snsocc_status(occ);
-	if (occ->dq_prod != occ->dq_cons)
+	info[2] = cons;
+	if (occ->dq_prod != cons)
 		info[1] |= OCC_RX_MSG;
+	if (!ret && file_ctx->overrun) {
+		info[1] |= OCC_RX_OVERRUN;
+		file_ctx->overrun = false;
+	}
+	trace_snsocc_rx(&occ->dev, info[0], cons, info[1], ret);
 
 	spin_unlock_irq(&occ->lock);
 
@@ -675,10 +1269,10 @@ static ssize_t snsocc_rx(struct file *file, char __user *buf, size_t count)
 		goto out;
 
 	ret = -EFAULT;
-	if (copy_to_user(buf, info, sizeof(info)))
+	if (copy_to_user(buf, info, count))
 		goto out;
 
-	ret = sizeof(info);
+	ret = count;
 
 out:
 	return ret;
@@ -687,156 +1281,98 @@ out:
 static u32 __snsocc_rxroom(struct occ *occ)
 {
 	/* Caller must hold occ->lock */
-	u32 used = occ->dq_prod - occ->dq_cons + OCC_DQ_SIZE;
+	u32 used = occ->dq_prod - occ->dq_hw_cons + OCC_DQ_SIZE;
 	used %= OCC_DQ_SIZE;
 	return OCC_DQ_SIZE - used - 1;
 }
 
-static u32 snsocc_rxcopy(struct occ *occ, u32 prod, void *src, u32 len)
-{
-	if (len > 0) {
-		/* __snsocc_rxroom() must indicate there is enough room
-		 * for the entire packet before calling here.
-		 */
-		void *dst = page_address(occ->dq_page);
-		u32 head, tail;
-
-		/* We know there is room for the packet, so just
-		 * check for any wrapping on the ring buffer.
-		 */
-		head = OCC_DQ_SIZE - prod;
-		head = min(head, len);
-		tail = len - head;
-
-		memcpy(dst + prod, src, head);
-		memcpy(dst, src + head, tail);
-	}
-
-	return (prod + len) % OCC_DQ_SIZE;
-}
-
-static int snsocc_rxone(struct occ *occ)
+static int snsocc_rxbatch(struct occ *occ, u32 budget)
 {
-	/* Called by the RX interrupt to implement the software
-	 * emulated data ring.
+	/* Copy a batch of packets from split hardware queues to the
+	 * software emulated data ring. Indexes are taken and published
+	 * under the lock once per batch, copying is done without it.
+	 * Readers only see complete packets at the end.
 	 */
-	u32 room_needed, length, head, tail, size;
-	u32 creg, prod, dq_prod, cons, imq_cons, hwcq_cons, hwdq_cons, used_room;
-	struct sw_imq *imq;
-	void *src;
+	struct occ_rxemu e;
+	int ret;
 
 	spin_lock_irq(&occ->lock);
-	imq_cons = occ->imq_cons;
-	hwcq_cons = occ->hwcq_cons;
-	hwdq_cons = occ->hwdq_cons;
-	dq_prod = occ->dq_prod;
-	used_room = __snsocc_rxroom(occ);
-
 	if (occ->imq_prod == occ->imq_cons || occ->stalled) {
 		spin_unlock_irq(&occ->lock);
-		return 1;
+		return 0;
 	}
+	e.imq = occ->imq;
+	e.imq_size = SW_IMQ_RING_SIZE;
+	e.imq_prod = occ->imq_prod;
+	e.imq_cons = occ->imq_cons;
+	e.hwdq.base = page_address(occ->hwdq_page);
+	e.hwdq.size = OCC_DQ_SIZE;
+	e.hwdq.cons = occ->hwdq_cons;
+	e.hwcq.base = page_address(occ->hwcq_page);
+	e.hwcq.size = OCC_CQ_SIZE;
+	e.hwcq.cons = occ->hwcq_cons;
+	e.dq.base = page_address(occ->dq_page);
+	e.dq.size = OCC_DQ_SIZE;
+	e.dq.prod = occ->dq_prod;
+	e.dq_room = __snsocc_rxroom(occ);
 	spin_unlock_irq(&occ->lock);
 
-	/* We need room for the split header, and the payload. */
-	imq = &occ->imq[imq_cons];
-	length = ALIGN(imq->length, 4);
-	room_needed = sizeof(struct sw_imq);
-	room_needed += length;
-
-	/* TODO given the glitches on the index updates in the PCI-X unified
-	 * firmware versions, we may wish to handle the index update and
-	 * validation in the interrupt handler for the CQ/DQ rings. This does
-	 * not seem to be a problem on the GE card, and should not be on issue
-	 * on the SNS PCIe card, so we'll hold off on the change for now.
+	/* IMQ entries are only saved after their payload arrived, hardware
+	 * producer indexes read now cover the entire batch.
 	 */
-	if (imq->type & IMQ_TYPE_COMMAND) {
-		src = page_address(occ->hwcq_page);
-		prod = ioread32(occ->ioaddr + REG_CQ_PROD_INDEX);
-		cons = hwcq_cons;
-		creg = REG_CQ_CONS_INDEX;
-		size = OCC_CQ_SIZE;
-	} else {
-		src = page_address(occ->hwdq_page);
-		prod = ioread32(occ->ioaddr + REG_DQ_PROD_INDEX);
-		cons = hwdq_cons;
-		creg = REG_DQ_CONS_INDEX;
-		size = OCC_DQ_SIZE;
-	}
-
-	/* Make sure we have enough data in the source queue */
-	if (length > ((prod - cons + size) % size)) {
-		dev_err_ratelimited(&occ->dev,
-				    "IMQ too-long length (reg %x)\n", creg);
-		spin_lock_irq(&occ->lock);
-		__snsocc_stalled(occ, OCC_DMA_STALLED);
-		goto consume_queue;
-	}
-
-	/* How much can we copy from the source before we wrap? */
-	if (cons > prod) {
-		head = size - cons;
-		head = min(head, length);
-		tail = length - head;
-	} else {
-		head = length;
-		tail = 0;
-	}
+	e.hwdq.prod = ioread32(occ->ioaddr + REG_DQ_PROD_INDEX);
+	e.hwcq.prod = ioread32(occ->ioaddr + REG_CQ_PROD_INDEX);
 
-	if (room_needed > used_room) {
+	ret = occ_rxemu_batch(&e, budget);
+	if (ret == -EPROTO)
+		dev_err_ratelimited(&occ->dev, "IMQ too-long length\n");
+	else if (ret == -ENOSPC)
 		dev_warn_ratelimited(&occ->dev, "userspace stalled RX\n");
-		spin_lock_irq(&occ->lock);
-		__snsocc_stalled(occ, OCC_DMA_STALLED);
-		goto consume_queue;
-	}
 
-	/* We do our updates against a local copy of the userspace DQ
-	 * producer index; this drops the lock during the copies, and
-	 * ensures users only see a complete packet at the end.
+	/* Only this thread and snsocc_reset() write consumer registers,
+	 * the latter synchronizes with the IRQ thread first.
 	 */
-	dq_prod = snsocc_rxcopy(occ, dq_prod, imq, sizeof(struct sw_imq));
-	dq_prod = snsocc_rxcopy(occ, dq_prod, src + cons, head);
-	dq_prod = snsocc_rxcopy(occ, dq_prod, src, tail);
-
-	/* The OCC card consumes the queues in 4 byte incremenets */
-	cons += ALIGN(length, 4);
-	cons %= size;
+	if (e.hwdq.cons != occ->hwdq_cons)
+		iowrite32(e.hwdq.cons, occ->ioaddr + REG_DQ_CONS_INDEX);
+	if (e.hwcq.cons != occ->hwcq_cons)
+		iowrite32(e.hwcq.cons, occ->ioaddr + REG_CQ_CONS_INDEX);
 
 	spin_lock_irq(&occ->lock);
-	occ->dq_prod = dq_prod;
-
-consume_queue:
-	if (imq->type & IMQ_TYPE_COMMAND)
-		occ->hwcq_cons = cons;
-	else
-		occ->hwdq_cons = cons;
-	iowrite32(cons, occ->ioaddr + creg);
-	occ->imq_cons++;
-	occ->imq_cons %= SW_IMQ_RING_SIZE;
-	wake_up(&occ->rx_wq);
-
+	occ->hwdq_cons = e.hwdq.cons;
+	occ->hwcq_cons = e.hwcq.cons;
+	occ->imq_cons = e.imq_cons;
+	if (occ->dq_prod != e.dq.prod) {
+		occ->dq_prod = e.dq.prod;
+		trace_snsocc_dq_prod(&occ->dev, occ->dq_prod, occ->dq_cons);
+	}
+	trace_snsocc_rxbatch(&occ->dev, budget, ret, occ->dq_prod);
+	if (ret < 0)
+		__snsocc_stalled(occ, OCC_DMA_STALLED);
+	__snsocc_ctrl_update(occ);
+	__snsocc_rx_wake(occ);
 	spin_unlock_irq(&occ->lock);
 
-	return 0;
+	return ret;
 }
 
-static void snsocc_rxtask(unsigned long data)
+static irqreturn_t snsocc_rx_thread(int irq, void *data)
 {
-	struct occ *occ = (void *)data;
-	int budget = 32;
+	/* Woken up by snsocc_interrupt() after it saved new IMQ entries.
+	 * Thread follows the interrupt affinity, which can be changed
+	 * through /proc/irq/<n>/smp_affinity.
+	 */
+	struct occ *occ = data;
 
-	while (--budget) {
-		if (snsocc_rxone(occ))
-			return;
-	}
+	while (snsocc_rxbatch(occ, OCC_RX_BATCH) > 0)
+		cond_resched();
 
-	tasklet_hi_schedule(&occ->rxtask);
+	return IRQ_HANDLED;
 }
 
 static int snsocc_saveimqs(struct occ *occ)
 {
 	/* Copy packet headers from the limited hardware queue to our larger
-	 * one to cover the latency of tasklet packet copy.
+	 * one to cover the latency of packet copy in IRQ thread.
 	 * New packet headers become avaialbe only when the function completes,
 	 * but the device is not locked during copying.
 	 */
@@ -891,16 +1427,30 @@ out_update:
 	return rc;
 }
 
+static void __snsocc_irq_hist_add(struct occ *occ, int cause, u32 delay, u32 proctime)
+{
+	/* Caller must hold occ->lock */
+	typeof(occ->irq_hist.cause[0]) *hist = &occ->irq_hist.cause[cause];
+
+	hist->count++;
+	hist->delay[min(fls(delay), OCC_IRQ_HIST_BINS - 1)]++;
+	hist->proctime[min(fls(proctime), OCC_IRQ_HIST_BINS - 1)]++;
+	hist->delay_max = max(hist->delay_max, delay);
+	hist->proctime_max = max(hist->proctime_max, proctime);
+}
+
 static irqreturn_t snsocc_interrupt(int irq, void *data)
 {
 	struct occ *occ = data;
 	u32 intr_status;
 
+	irqreturn_t ret = IRQ_HANDLED;
 	u32 scheduled = 0;
 	u32 start = 0;
-	u8 irq_latency_capture = occ->irq_latency.capture;
+	int cause = OCC_IRQ_CAUSE_RX;
+	u8 irq_timestamps = occ->board->irq_timestamps;
 
-	if (irq_latency_capture)
+	if (irq_timestamps)
 		start = ioread32(occ->ioaddr + REG_TIME_COUNTER);
 
 	intr_status = ioread32(occ->ioaddr + REG_IRQ_STATUS);
@@ -919,13 +1469,18 @@ static irqreturn_t snsocc_interrupt(int irq, void *data)
 		return IRQ_NONE;
 	}
 
-	if (irq_latency_capture) {
-		if (intr_status & OCC_IRQ_RX_DONE)
+	trace_snsocc_irq(&occ->dev, intr_status);
+
+	if (irq_timestamps) {
+		if (intr_status & OCC_IRQ_RX_DONE) {
 			scheduled = ioread32(occ->ioaddr + REG_TIME_IRQ_DQ);
-		else if (intr_status & OCC_IRQ_DMA_STALL)
+		} else if (intr_status & OCC_IRQ_DMA_STALL) {
 			scheduled = ioread32(occ->ioaddr + REG_TIME_IRQ_DMA_STALL);
-		else if (intr_status & OCC_IRQ_FIFO_OVERFLOW)
+			cause = OCC_IRQ_CAUSE_STALL;
+		} else if (intr_status & OCC_IRQ_FIFO_OVERFLOW) {
 			scheduled = ioread32(occ->ioaddr + REG_TIME_IRQ_FIF_OVRFLW);
+			cause = OCC_IRQ_CAUSE_OVERFLOW;
+		}
 	}
 
 	/* Clearing interrupt to minimize propagation time to OCC. With non-MSI
@@ -939,15 +1494,24 @@ static irqreturn_t snsocc_interrupt(int irq, void *data)
 	ioread32(occ->ioaddr + REG_IRQ_STATUS); // iowrite32() is posted, make sure register gets to the board
 
 	if (likely(intr_status & OCC_IRQ_RX_DONE)) {
+		occ->rx_irqs++;
 		if (unlikely(occ->emulate_dq)) {
 			if (snsocc_saveimqs(occ))
 				snsocc_stalled(occ, OCC_DMA_STALLED);
 			else
-				tasklet_hi_schedule(&occ->rxtask);
+				ret = IRQ_WAKE_THREAD;
 		} else {
 			spin_lock(&occ->lock);
-			occ->dq_prod = ioread32(occ->ioaddr + REG_DQ_PROD_INDEX);
-			wake_up(&occ->rx_wq);
+			if (occ->rx_mode == OCC_RX_MODE_HYBRID) {
+				/* Interrupts coming faster than the timer
+				 * would poll are cheaper served by polling.
+				 */
+				ktime_t now = ktime_get();
+				if (ktime_us_delta(now, occ->rx_poll_last) < occ->rx_poll_period)
+					__snsocc_rx_poll_start(occ);
+				occ->rx_poll_last = now;
+			}
+			__snsocc_rx_refresh(occ);
 			spin_unlock(&occ->lock);
 		}
 	}
@@ -966,32 +1530,44 @@ static irqreturn_t snsocc_interrupt(int irq, void *data)
 		u32 end = ioread32(occ->ioaddr + REG_TIME_COUNTER);
 
 		spin_lock(&occ->lock);
-		occ->irq_latency.abs_min = min(occ->irq_latency.abs_min, latency);
-		occ->irq_latency.abs_max = max(occ->irq_latency.abs_max, latency);
+		if (occ->irq_latency.capture) {
+			occ->irq_latency.abs_min = min(occ->irq_latency.abs_min, latency);
+			occ->irq_latency.abs_max = max(occ->irq_latency.abs_max, latency);
 
-		occ->irq_latency.end = (occ->irq_latency.end + 1) % occ->irq_latency.size;
-		occ->irq_latency.isr_delay[occ->irq_latency.end] = latency;
-		occ->irq_latency.isr_proctime[occ->irq_latency.end] = end - start;
+			occ->irq_latency.end = (occ->irq_latency.end + 1) % occ->irq_latency.size;
+			occ->irq_latency.isr_delay[occ->irq_latency.end] = latency;
+			occ->irq_latency.isr_proctime[occ->irq_latency.end] = end - start;
+		}
+		__snsocc_irq_hist_add(occ, cause, latency, end - start);
 		spin_unlock(&occ->lock);
 	}
 
-	return IRQ_HANDLED;
+	return ret;
 }
 
+static void snsocc_dq_buf_swap(struct occ *occ);
+
 static void snsocc_reset(struct occ *occ)
 {
 	void __iomem *ioaddr = occ->ioaddr;
+	struct file_ctx *sub;
 
-	/* Kick out anybody blocked in read() or trying to send data */
-	mutex_lock(&occ->tx_lock);
+	/* Kick out anybody blocked in read() or trying to send data, TX
+	 * work notices the flag while waiting for the link.
+	 */
+	spin_lock_irq(&occ->lock);
 	occ->reset_in_progress = true;
+	spin_unlock_irq(&occ->lock);
 	wake_up_all(&occ->tx_wq);
-	mutex_unlock(&occ->tx_lock);
+	cancel_work_sync(&occ->tx_work);
 
 	spin_lock_irq(&occ->lock);
 	occ->reset_occurred = true;
+	occ->rx_polling = false;
+	__snsocc_ctrl_update(occ);
 	wake_up_all(&occ->rx_wq);
 	spin_unlock_irq(&occ->lock);
+	hrtimer_cancel(&occ->rx_poll_timer);
 
 	/* XXX should wait for everyone to leave */
 
@@ -1000,12 +1576,11 @@ static void snsocc_reset(struct occ *occ)
 	 */
 	if (ioread32(ioaddr + REG_IRQ_ENABLE)) {
 		iowrite32(0, ioaddr + REG_IRQ_ENABLE);
-		synchronize_irq(occ->pdev->irq);
 
-		/* Make sure we aren't still accessing the card for DQ
-		 * emulation.
+		/* Also waits for IRQ thread, make sure we aren't still
+		 * accessing the card for DQ emulation.
 		 */
-		tasklet_kill(&occ->rxtask);
+		synchronize_irq(occ->pdev->irq);
 	}
 
 	/* Disable the DMA first and give it some time to settle down.
@@ -1024,6 +1599,9 @@ static void snsocc_reset(struct occ *occ)
 	/* Post our writes; RESET will self-clear on the next PCI cycle. */
 	ioread32(ioaddr + REG_CONFIG);
 
+	/* DMA is quiet, good time to replace the buffer */
+	snsocc_dq_buf_swap(occ);
+
 	if (occ->use_optical && occ->hwdq_page) {
 		/* We're using a board/firmware that splits the optical
 		 * RX path into three queues, so we need to point the
@@ -1046,7 +1624,13 @@ static void snsocc_reset(struct occ *occ)
 		/* This board uses an unified DQ, or we're using the LVDS
 		 * so directly map it onto the buffer the user maps.
 		 */
-		u64 addr = (occ->dq_big_addr ? virt_to_bus(phys_to_virt(occ->dq_big_addr)) : occ->dq_dma);
+		u64 addr = occ->dq_dma;
+		if (occ->dq_big_addr)
+			addr = virt_to_bus(phys_to_virt(occ->dq_big_addr));
+		else if (occ->dq_sgt)
+			addr = sg_dma_address(occ->dq_sgt->sgl);
+		else if (occ->dq_buf)
+			addr = occ->dq_buf->dma;
 		occ->emulate_dq = 0;
 		iowrite32(addr & 0xFFFFFFFF, ioaddr + REG_DQ_ADDR);
 		iowrite32((addr >> 32) & 0xFFFFFFFF, ioaddr + REG_DQ_ADDRHI);
@@ -1067,8 +1651,10 @@ static void snsocc_reset(struct occ *occ)
 		occ->conf |= OCC_CONF_RX_ENABLE;
 
 	iowrite32(occ->conf, occ->ioaddr + REG_CONFIG);
+	occ->rx_expired = false;
 	if (occ->emulate_dq) {
 		occ->dq_prod = occ->dq_cons = 0;
+		occ->dq_hw_cons = 0;
 		occ->imq_cons = occ->imq_prod = 0;
 		occ->hwdq_cons = ioread32(occ->ioaddr + REG_DQ_CONS_INDEX);
 		occ->hwdq_prod = ioread32(occ->ioaddr + REG_DQ_PROD_INDEX);
@@ -1077,10 +1663,21 @@ static void snsocc_reset(struct occ *occ)
 	} else {
 		occ->dq_cons = ioread32(occ->ioaddr + REG_DQ_CONS_INDEX);
 		occ->dq_prod = ioread32(occ->ioaddr + REG_DQ_PROD_INDEX);
+		occ->dq_hw_cons = occ->dq_cons;
 	}
 	occ->tx_prod = ioread32(occ->ioaddr + REG_TX_PROD_INDEX);
 	iowrite32(occ->irqs, occ->ioaddr + REG_IRQ_ENABLE);
 
+	/* Drop messages queued before reset, tx_work doesn't touch
+	 * the queue while reset is in progress.
+	 */
+	mutex_lock(&occ->txq_lock);
+	spin_lock_irq(&occ->lock);
+	occ->txq_prod = occ->txq_cons = 0;
+	occ->tx_error = 0;
+	spin_unlock_irq(&occ->lock);
+	mutex_unlock(&occ->txq_lock);
+
 	/* Give the optical module some time to bring up the TX laser, and
 	 * lock on to any RX signal to prevent spurious reports of lost
 	 * signal.
@@ -1097,8 +1694,19 @@ static void snsocc_reset(struct occ *occ)
 	memset(occ->irq_latency.isr_delay, 0, sizeof(u32) * OCC_IRQ_LAT_BUF_SIZE);
 	memset(occ->irq_latency.isr_proctime, 0, sizeof(u32) * OCC_IRQ_LAT_BUF_SIZE);
 
+	/* Subscribers start over together with the exclusive connection */
+	list_for_each_entry(sub, &occ->subscribers, list) {
+		sub->dq_cons = occ->dq_cons;
+		sub->overrun = false;
+	}
+
 	occ->reset_in_progress = false;
+	if (occ->stalled)
+		trace_snsocc_stall(&occ->dev, occ->stalled, 0);
 	occ->stalled = false;
+	__snsocc_ctrl_update(occ);
+	if (occ->rx_mode == OCC_RX_MODE_POLL)
+		__snsocc_rx_poll_start(occ);
 	spin_unlock_irq(&occ->lock);
 }
 
@@ -1170,6 +1778,151 @@ static void snsocc_free_big_queue(struct occ *occ)
 	}
 }
 
+static int snsocc_alloc_sg_queue(struct occ *occ, unsigned long size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	struct device *dev = &occ->pdev->dev;
+	struct sg_table *sgt;
+	void *vaddr;
+
+	sgt = dma_alloc_noncontiguous(dev, size, DMA_FROM_DEVICE, GFP_KERNEL | __GFP_NOWARN, 0);
+	if (!sgt)
+		return -ENOMEM;
+
+	/* OCC only takes single address, pages must have been merged
+	 * into one range by IOMMU.
+	 */
+	if (sgt->nents != 1) {
+		dev_err(dev, "scatter-gather DMA buffer needs IOMMU, got %u segments", sgt->nents);
+		dma_free_noncontiguous(dev, size, sgt, DMA_FROM_DEVICE);
+		return -EOPNOTSUPP;
+	}
+
+	/* Prevent information leaks to user-space */
+	vaddr = dma_vmap_noncontiguous(dev, size, sgt);
+	if (!vaddr) {
+		dma_free_noncontiguous(dev, size, sgt, DMA_FROM_DEVICE);
+		return -ENOMEM;
+	}
+	memset(vaddr, 0, size);
+	dma_vunmap_noncontiguous(dev, vaddr);
+	dma_sync_sgtable_for_device(dev, sgt, DMA_FROM_DEVICE);
+
+	occ->dq_sgt = sgt;
+	occ->dq_size = size;
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif // LINUX_VERSION_CODE
+}
+
+static void snsocc_free_sg_queue(struct occ *occ)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+	if (occ->dq_sgt) {
+		dma_free_noncontiguous(&occ->pdev->dev, occ->dq_size, occ->dq_sgt, DMA_FROM_DEVICE);
+		occ->dq_sgt = NULL;
+		// Revert to the kmalloc-ed page memory
+		occ->dq_size = OCC_DQ_SIZE;
+	}
+#endif // LINUX_VERSION_CODE
+}
+
+static struct occ_dq_buf *snsocc_dq_buf_alloc(struct device *dev, unsigned long size)
+{
+	struct occ_dq_buf *buf;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return NULL;
+
+	/* Memory comes zeroed, no information leaks to user-space */
+	buf->vaddr = dma_alloc_coherent(dev, size, &buf->dma, GFP_KERNEL | __GFP_NOWARN);
+	if (!buf->vaddr) {
+		kfree(buf);
+		return NULL;
+	}
+	kref_init(&buf->ref);
+	buf->dev = dev;
+	buf->size = size;
+
+	return buf;
+}
+
+static void snsocc_dq_buf_release(struct kref *ref)
+{
+	struct occ_dq_buf *buf = container_of(ref, struct occ_dq_buf, ref);
+
+	dma_free_coherent(buf->dev, buf->size, buf->vaddr, buf->dma);
+	kfree(buf);
+}
+
+static void snsocc_dq_buf_put(struct occ_dq_buf *buf)
+{
+	/* Might free the buffer, don't call with spinlock held */
+	if (buf)
+		kref_put(&buf->ref, snsocc_dq_buf_release);
+}
+
+static void snsocc_dq_buf_swap(struct occ *occ)
+{
+	/* Apply pending resize, called from snsocc_reset() while DMA
+	 * is disabled.
+	 */
+	struct occ_dq_buf *old;
+	struct file_ctx *sub, *tmp;
+
+	spin_lock_irq(&occ->lock);
+	if (occ->dq_next_size == 0) {
+		spin_unlock_irq(&occ->lock);
+		return;
+	}
+	spin_unlock_irq(&occ->lock);
+
+	/* Pending resize overrides other buffer configurations */
+	snsocc_free_sg_queue(occ);
+	snsocc_free_big_queue(occ);
+
+	spin_lock_irq(&occ->lock);
+	strncpy(occ->dq_big_cnf, "0$0", sizeof(occ->dq_big_cnf));
+	old = occ->dq_buf;
+	occ->dq_buf = occ->dq_next;
+	occ->dq_size = occ->dq_next_size;
+	occ->dq_next = NULL;
+	occ->dq_next_size = 0;
+
+	/* Subscribers still map the old buffer, they need to remap and
+	 * subscribe again. Meanwhile they must not hold back hardware.
+	 */
+	list_for_each_entry_safe(sub, tmp, &occ->subscribers, list) {
+		list_del(&sub->list);
+		sub->subscribe = 0;
+		sub->remap = true;
+	}
+	spin_unlock_irq(&occ->lock);
+
+	snsocc_dq_buf_put(old);
+}
+
+static void snsocc_dq_buf_drop(struct occ *occ)
+{
+	/* Forget current and pending buffer, revert to dq_page */
+	struct occ_dq_buf *buf, *next;
+
+	spin_lock_irq(&occ->lock);
+	buf = occ->dq_buf;
+	next = occ->dq_next;
+	occ->dq_buf = NULL;
+	occ->dq_next = NULL;
+	occ->dq_next_size = 0;
+	if (buf)
+		occ->dq_size = OCC_DQ_SIZE;
+	spin_unlock_irq(&occ->lock);
+
+	snsocc_dq_buf_put(buf);
+	snsocc_dq_buf_put(next);
+}
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4,17,0)
 static vm_fault_t snsocc_vm_fault(struct vm_fault *vmf)
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(4,11,0)
@@ -1187,25 +1940,78 @@ static int snsocc_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	unsigned long offset;
 	struct page *page;
 
-	if (!occ)
-		return VM_FAULT_SIGBUS;
+	if (!occ)
+		return VM_FAULT_SIGBUS;
+
+	page = occ->dq_page;
+	if (vmf->pgoff >= (1 << get_order(occ->dq_size)))
+		return VM_FAULT_SIGBUS;
+
+	offset >>= PAGE_SHIFT;
+	page += offset;
+	get_page(page);
+	vmf->page = page;
+
+	return 0;
+}
+
+static const struct vm_operations_struct snsocc_vm_ops = {
+	.fault = snsocc_vm_fault,
+};
+
+static void snsocc_dq_buf_vm_open(struct vm_area_struct *vma)
+{
+	struct occ_dq_buf *buf = vma->vm_private_data;
+
+	kref_get(&buf->ref);
+}
+
+static void snsocc_dq_buf_vm_close(struct vm_area_struct *vma)
+{
+	snsocc_dq_buf_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct snsocc_dq_buf_vm_ops = {
+	.open = snsocc_dq_buf_vm_open,
+	.close = snsocc_dq_buf_vm_close,
+};
+
+static int snsocc_mmap_dq_buf(struct occ *occ, struct vm_area_struct *vma)
+{
+	/* Mapping keeps its own reference to the buffer, which may be
+	 * replaced on reset while still mapped.
+	 */
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct occ_dq_buf *buf;
+	int ret;
+
+	spin_lock_irq(&occ->lock);
+	buf = occ->dq_buf;
+	if (buf)
+		kref_get(&buf->ref);
+	spin_unlock_irq(&occ->lock);
 
-	page = occ->dq_page;
-	if (vmf->pgoff >= (1 << get_order(occ->dq_size)))
-		return VM_FAULT_SIGBUS;
+	if (!buf)
+		return -EAGAIN;
+	if (size != buf->size) {
+		snsocc_dq_buf_put(buf);
+		return -EINVAL;
+	}
 
-	offset >>= PAGE_SHIFT;
-	page += offset;
-	get_page(page);
-	vmf->page = page;
+	/* Offset selects the buffer, not the page within it */
+	vma->vm_pgoff = 0;
+	vma->vm_flags |= VM_DONTEXPAND;
+	ret = dma_mmap_coherent(buf->dev, vma, buf->vaddr, buf->dma, size);
+	if (ret) {
+		snsocc_dq_buf_put(buf);
+		return ret;
+	}
+	vma->vm_private_data = buf;
+	vma->vm_ops = &snsocc_dq_buf_vm_ops;
 
 	return 0;
 }
 
-static const struct vm_operations_struct snsocc_vm_ops = {
-	.fault = snsocc_vm_fault,
-};
-
 static int snsocc_mmap(struct file *file, struct vm_area_struct *vma)
 {
 	struct file_ctx *file_ctx = file->private_data;
@@ -1224,14 +2030,36 @@ static int snsocc_mmap(struct file *file, struct vm_area_struct *vma)
 		vma->vm_flags |= VM_IO;
 		break;
 	case OCC_MMAP_RX_DMA:
+		if (occ->dq_buf)
+			return snsocc_mmap_dq_buf(occ, vma);
 		if (size != occ->dq_size)
 			return -EINVAL;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5,15,0)
+		if (occ->dq_sgt) {
+			/* Pages are not physically contiguous, but user
+			 * space still gets them in one piece. Offset
+			 * selects the buffer, not the page within it.
+			 */
+			vma->vm_pgoff = 0;
+			vma->vm_flags |= VM_DONTEXPAND;
+			return dma_mmap_noncontiguous(&occ->pdev->dev, vma, size, occ->dq_sgt);
+		}
+#endif // LINUX_VERSION_CODE
 		if (occ->dq_big_addr)
 			pfn = virt_to_phys(bus_to_virt(occ->dq_big_addr)) >> PAGE_SHIFT;
 		else
 			pfn = page_to_pfn(occ->dq_page);
 		vma->vm_flags |= VM_IO | VM_DONTEXPAND;
 		break;
+	case OCC_MMAP_CTRL:
+		if (size != PAGE_SIZE)
+			return -EINVAL;
+		if (vma->vm_flags & VM_WRITE)
+			return -EPERM;
+		pfn = virt_to_phys(occ->ctrl) >> PAGE_SHIFT;
+		vma->vm_flags &= ~VM_MAYWRITE;
+		vma->vm_flags |= VM_DONTEXPAND;
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -1250,15 +2078,14 @@ static unsigned int snsocc_poll(struct file *file,
 	poll_wait(file, &occ->rx_wq, wait);
 	poll_wait(file, &occ->tx_wq, wait);
 
-	mutex_lock(&occ->tx_lock);
-	if (!(ioread32(occ->ioaddr + REG_CONFIG) & OCC_CONF_TX_ENABLE))
-		mask |= POLLOUT | POLLWRNORM;
-	mutex_unlock(&occ->tx_lock);
-
 	spin_lock_irqsave(&occ->lock, flags);
-	if (occ->dq_prod != occ->dq_cons)
+	if (__snsocc_txq_room(occ) >= OCC_TXQ_HDR_LEN + occ->board->tx_fifo_len)
+		mask |= POLLOUT | POLLWRNORM;
+	if (occ->rx_polling && !occ->reset_in_progress)
+		__snsocc_rx_refresh(occ);
+	if (__snsocc_rx_ready(occ, file_ctx))
 		mask |= POLLIN | POLLRDNORM;
- 	if (occ->reset_occurred || occ->reset_in_progress)
+ 	if (occ->reset_occurred || occ->reset_in_progress || file_ctx->remap)
 		mask |= POLLERR;
 	if (occ->stalled)
 		mask |= POLLHUP;
@@ -1291,13 +2118,21 @@ static ssize_t snsocc_read(struct file *file, char __user *buf,
 			info.firmware_ver = (occ->board->type == BOARD_SNS_PCIE ? (occ->version & 0xFFFF) : occ->version);
 			info.firmware_date = occ->firmware_date;
 			info.fpga_serial = occ->fpga_serial;
-			info.dq_used = (occ->dq_size + occ->dq_prod - occ->dq_cons) % occ->dq_size;
+			if (file_ctx->subscribe)
+				info.dq_used = __snsocc_rxused_from(occ, file_ctx->dq_cons);
+			else
+				info.dq_used = __snsocc_rxused(occ);
 			info.dq_size = occ->dq_size;
 			info.bars[0] = occ->bars[0];
 			info.bars[1] = occ->bars[1];
 			info.bars[2] = occ->bars[2];
-			occ->reset_occurred = occ->reset_in_progress;
+			/* Reset notification belongs to the exclusive connection */
+			if (!file_ctx->debug_mode)
+				occ->reset_occurred = occ->reset_in_progress;
+			__snsocc_ctrl_update(occ);
 			info.status = __snsocc_status(occ);
+			if (file_ctx->remap)
+				info.status |= OCC_RESET_OCCURRED;
 			info.rx_rate = __snsocc_rxrate(occ);
 			__snsocc_errcounters(occ, &info.err_crc, &info.err_length, &info.err_frame);
 			__snsocc_fpgainfo(occ, &info.fpga_temp, &info.fpga_core_volt, &info.fpga_aux_volt);
@@ -1311,7 +2146,10 @@ static ssize_t snsocc_read(struct file *file, char __user *buf,
 			return -EFAULT;
 		break;
 	case OCC_CMD_RX:
-		count = snsocc_rx(file, buf, count);
+		count = snsocc_rx(file, buf, count, false);
+		break;
+	case OCC_CMD_RX_ACK:
+		count = snsocc_rx(file, buf, count, true);
 		break;
 	case OCC_CMD_VERSION:
 		ver.major = OCC_VER_MAJ;
@@ -1333,12 +2171,15 @@ static ssize_t snsocc_write(struct file *file, const char __user *buf,
 {
 	struct file_ctx *file_ctx = file->private_data;
 	struct occ *occ = file_ctx->occ;
-	u32 val, prod;
+	u32 val, watermark[2];
 	ssize_t ret = 0;
 
-	/* Debug connection is limited to reset only */
-	if (file_ctx->debug_mode && *pos != OCC_CMD_RESET)
-		return -EINVAL;
+	/* Debug connection is limited to reset and subscribing, and
+	 * consuming data once subscribed.
+	 */
+	if (file_ctx->debug_mode && *pos != OCC_CMD_RESET && *pos != OCC_CMD_SUBSCRIBE &&
+	    !(file_ctx->subscribe && *pos == OCC_CMD_ADVANCE_DQ))
+		return (file_ctx->remap && *pos == OCC_CMD_ADVANCE_DQ ? -ECONNRESET : -EINVAL);
 
 	switch (*pos) {
 	case OCC_CMD_ADVANCE_DQ:
@@ -1351,33 +2192,8 @@ static ssize_t snsocc_write(struct file *file, const char __user *buf,
 		if (val == 0)
 			break;
 
-		/* We only deal with packets that are multiples of 4 bytes */
-		val = ALIGN(val, 4);
-
-		if (val >= occ->dq_size)
-			return -EOVERFLOW;
-
-		/* Validate that the new consumer index is within the range
-		 * of valid data.
-		 */
 		spin_lock_irq(&occ->lock);
-		if (occ->reset_in_progress) {
-			ret = -ECONNRESET;
-		} else {
-			val += occ->dq_cons;
-			prod = occ->dq_prod;
-			if (occ->dq_prod < occ->dq_cons)
-				prod += occ->dq_size;
-			if (val > occ->dq_cons && val <= prod) {
-				occ->dq_cons = val % occ->dq_size;
-				if (!occ->emulate_dq) {
-					iowrite32(occ->dq_cons,
-						  occ->ioaddr + REG_DQ_CONS_INDEX);
-				}
-			} else {
-				ret = -EOVERFLOW;
-			}
-		}
+		ret = __snsocc_advance_dq(occ, file_ctx, val);
 		spin_unlock_irq(&occ->lock);
 
 		if (ret != 0)
@@ -1511,6 +2327,52 @@ static ssize_t snsocc_write(struct file *file, const char __user *buf,
 		iowrite32(val, occ->ioaddr + REG_CONFIG);
 		ioread32(occ->ioaddr + REG_CONFIG); // post write
 
+		break;
+	case OCC_CMD_RX_WATERMARK:
+		if (count != sizeof(watermark))
+			return -EINVAL;
+
+		if (copy_from_user(watermark, buf, sizeof(watermark)))
+			return -EFAULT;
+
+		/* Watermark can't be reached in full queue, and some latency
+		 * is required to eventually deliver data below watermark.
+		 */
+		if (watermark[0] >= occ->dq_size ||
+		    (watermark[0] != 0 && watermark[1] == 0))
+			return -EINVAL;
+
+		spin_lock_irq(&occ->lock);
+		occ->rx_watermark = ALIGN(watermark[0], 4);
+		occ->rx_latency = usecs_to_jiffies(watermark[1]);
+		occ->rx_expired = false;
+		/* Readers may be waiting for previous watermark */
+		wake_up(&occ->rx_wq);
+		spin_unlock_irq(&occ->lock);
+		break;
+	case OCC_CMD_SUBSCRIBE:
+		if (count != sizeof(u32))
+			return -EINVAL;
+
+		if (copy_from_user(&val, buf, sizeof(u32)))
+			return -EFAULT;
+
+		/* Exclusive connection is always consuming */
+		if (!file_ctx->debug_mode || val > OCC_SUBSCRIBE_LOSSY)
+			return -EINVAL;
+
+		spin_lock_irq(&occ->lock);
+		file_ctx->remap = false;
+		if (val && !file_ctx->subscribe) {
+			file_ctx->dq_cons = occ->dq_prod;
+			file_ctx->overrun = false;
+			list_add_tail(&file_ctx->list, &occ->subscribers);
+		} else if (!val && file_ctx->subscribe) {
+			list_del(&file_ctx->list);
+		}
+		file_ctx->subscribe = val;
+		__snsocc_release_dq(occ);
+		spin_unlock_irq(&occ->lock);
 		break;
 	default:
 		return -EINVAL;
@@ -1560,6 +2422,8 @@ static int snsocc_open(struct inode *inode, struct file *file)
 		//occ->conf |= OCC_CONF_OLD_PKTS_DISABLE;
 	}
 	occ->irqs = OCC_IRQ_ENABLE | OCC_IRQ_RX_DONE | OCC_IRQ_DMA_STALL | OCC_IRQ_FIFO_OVERFLOW;
+	occ->rx_watermark = 0;
+	occ->rx_latency = 0;
 	snsocc_reset(occ);
 
 	return err;
@@ -1574,11 +2438,28 @@ static int snsocc_release(struct inode *inode, struct file *file)
 			struct occ *occ = file_ctx->occ;
 			void __iomem *ioaddr = occ->ioaddr;
 
+			/* Let queued TX data go out before disabling */
+			flush_work(&occ->tx_work);
+
 			/* Disable DMA only, no need to send more data since noone is listening */
 			iowrite32(0, ioaddr + REG_CONFIG);
 
 			spin_lock_irq(&occ->lock);
 			occ->in_use = false;
+			occ->rx_watermark = 0;
+			occ->rx_polling = false;
+			spin_unlock_irq(&occ->lock);
+
+			timer_delete_sync(&occ->rx_timer);
+			hrtimer_cancel(&occ->rx_poll_timer);
+		} else if (file_ctx->subscribe) {
+			struct occ *occ = file_ctx->occ;
+
+			/* Required subscriber may be holding back hardware */
+			spin_lock_irq(&occ->lock);
+			list_del(&file_ctx->list);
+			file_ctx->subscribe = 0;
+			__snsocc_release_dq(occ);
 			spin_unlock_irq(&occ->lock);
 		}
 
@@ -1596,6 +2477,39 @@ static void snsocc_free(struct device *dev)
 	kfree(occ);
 }
 
+static void snsocc_coalesce_work(struct work_struct *work)
+{
+	/* Feed last second's interrupt count and OCC RX rate to the
+	 * adaptive controller and apply its decision.
+	 */
+	struct occ *occ = container_of(to_delayed_work(work), struct occ, coalesce_work);
+	unsigned long now = jiffies;
+	u32 irqs = occ->rx_irqs;
+	u32 rate, value, old;
+
+	rate = __snsocc_rxrate(occ);
+
+	spin_lock_irq(&occ->lock);
+	old = occ->coalesce.value;
+	value = occ_coalesce_update(&occ->coalesce, rate, irqs - occ->coalesce_irqs,
+				    jiffies_to_msecs(now - occ->coalesce_last));
+	spin_unlock_irq(&occ->lock);
+	occ->coalesce_irqs = irqs;
+	occ->coalesce_last = now;
+
+	if (value != old)
+		iowrite32(value | OCC_COALESCING_ENABLE, occ->ioaddr + REG_IRQ_CNTL);
+
+	if (occ->coalesce_adaptive)
+		schedule_delayed_work(&occ->coalesce_work, HZ);
+}
+
+static void snsocc_coalesce_stop(struct occ *occ)
+{
+	occ->coalesce_adaptive = false;
+	cancel_delayed_work_sync(&occ->coalesce_work);
+}
+
 static ssize_t snsocc_sysfs_show_irq_coallesce(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct occ *occ = dev_get_drvdata(dev);
@@ -1608,6 +2522,8 @@ static ssize_t snsocc_sysfs_store_irq_coallesce(struct device *dev, struct devic
 	struct occ *occ = dev_get_drvdata(dev);
 	u32 val;
 	if (sscanf(buf, "%u", &val) == 1) {
+		/* Static value overrides adaptive mode */
+		snsocc_coalesce_stop(occ);
 		val &= 0xFFFF;
 		if (val > 0) val |= OCC_COALESCING_ENABLE;
 		iowrite32(val, occ->ioaddr + REG_IRQ_CNTL);
@@ -1616,6 +2532,71 @@ static ssize_t snsocc_sysfs_store_irq_coallesce(struct device *dev, struct devic
 	return -EINVAL;
 }
 
+static ssize_t snsocc_sysfs_show_irq_coalesce_adaptive(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct occ *occ = dev_get_drvdata(dev);
+	struct occ_coalesce *c;
+	ssize_t len;
+	u32 i, n;
+
+	/* Copy under lock, format without it */
+	c = kmalloc(sizeof(*c), GFP_KERNEL);
+	if (!c)
+		return -ENOMEM;
+	spin_lock_irq(&occ->lock);
+	memcpy(c, &occ->coalesce, sizeof(*c));
+	spin_unlock_irq(&occ->lock);
+
+	if (!occ->coalesce_adaptive) {
+		len = scnprintf(buf, PAGE_SIZE, "disabled\n");
+	} else {
+		len = scnprintf(buf, PAGE_SIZE, "latency_us=%u max_irqs=%u value=%u\n"
+						"rx_rate irq_rate value\n",
+				c->latency_us, c->max_irqs, c->value);
+		n = min_t(u32, c->history_cnt, OCC_COALESCE_HISTORY);
+		for (i = 0; i < n; i++) {
+			struct occ_coalesce_sample *sample = &c->history[(c->history_cnt - 1 - i) % OCC_COALESCE_HISTORY];
+			len += scnprintf(buf + len, PAGE_SIZE - len, "%u %u %u\n",
+					 sample->rx_rate, sample->irq_rate, sample->value);
+		}
+	}
+
+	kfree(c);
+	return len;
+}
+
+static ssize_t snsocc_sysfs_store_irq_coalesce_adaptive(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	/* Accepts "<latency_us> <max_irqs>" to enable, "0" to disable
+	 * leaving the last selected value in effect.
+	 */
+	struct occ *occ = dev_get_drvdata(dev);
+	u32 latency_us, max_irqs;
+	int n;
+
+	n = sscanf(buf, "%u %u", &latency_us, &max_irqs);
+	if (n == 1 && latency_us == 0) {
+		snsocc_coalesce_stop(occ);
+		return count;
+	}
+	if (n != 2 || max_irqs == 0)
+		return -EINVAL;
+
+	snsocc_coalesce_stop(occ);
+
+	spin_lock_irq(&occ->lock);
+	occ_coalesce_init(&occ->coalesce, latency_us, max_irqs);
+	spin_unlock_irq(&occ->lock);
+	occ->coalesce_irqs = occ->rx_irqs;
+	occ->coalesce_last = jiffies;
+	occ->coalesce_adaptive = true;
+
+	iowrite32(occ->coalesce.value | OCC_COALESCING_ENABLE, occ->ioaddr + REG_IRQ_CNTL);
+	schedule_delayed_work(&occ->coalesce_work, HZ);
+
+	return count;
+}
+
 static ssize_t snsocc_sysfs_show_dma_big_mem(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct occ *occ = dev_get_drvdata(dev);
@@ -1669,6 +2650,8 @@ static ssize_t snsocc_sysfs_store_dma_big_mem(struct device *dev, struct device_
 	if (err)
 		return err;
 
+	snsocc_dq_buf_drop(occ);
+	snsocc_free_sg_queue(occ);
 	snsocc_free_big_queue(occ);
 	snsocc_alloc_big_queue(occ, offset, size);
 
@@ -1680,6 +2663,147 @@ static ssize_t snsocc_sysfs_store_dma_big_mem(struct device *dev, struct device_
 	return count;
 }
 
+static ssize_t snsocc_sysfs_show_dma_sg_mem(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct occ *occ = dev_get_drvdata(dev);
+	int ret = 0;
+
+	spin_lock_irq(&occ->lock);
+	ret = scnprintf(buf, PAGE_SIZE, "%luM\n", (occ->dq_sgt ? occ->dq_size >> 20 : 0));
+	spin_unlock_irq(&occ->lock);
+
+	return ret;
+}
+
+static ssize_t snsocc_sysfs_store_dma_sg_mem(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	/* Accepts size with M or G suffix, 0 reverts to default buffer */
+	struct occ *occ = dev_get_drvdata(dev);
+	int err = 0;
+	unsigned long size;
+	char size_mod = 0;
+
+	if (sscanf(buf, "%lu%c", &size, &size_mod) < 1)
+		return -EINVAL;
+	if (size != 0) {
+		if (size_mod == 'M')
+			size *= 1024*1024;
+		else if (size_mod == 'G')
+			size *= 1024*1024*1024;
+		else
+			return -EINVAL;
+		if (size & (size - 1)) // must be power of two
+			return -EINVAL;
+		if (size <= OCC_DQ_SIZE || size > OCC_DQ_MAX_SIZE)
+			return -ENOMEM;
+	}
+
+	/* Emulated DQ of split queue firmware has fixed size */
+	if (occ->hwdq_page)
+		return -EINVAL;
+
+	spin_lock_irq(&occ->lock);
+	if (occ->in_use) {
+		err = -EBUSY;
+	} else {
+		occ->in_use = true;
+	}
+	spin_unlock_irq(&occ->lock);
+
+	if (err)
+		return err;
+
+	snsocc_dq_buf_drop(occ);
+	snsocc_free_sg_queue(occ);
+	snsocc_free_big_queue(occ);
+	if (size != 0)
+		err = snsocc_alloc_sg_queue(occ, size);
+
+	spin_lock_irq(&occ->lock);
+	strncpy(occ->dq_big_cnf, "0$0", sizeof(occ->dq_big_cnf));
+	occ->in_use = false;
+	spin_unlock_irq(&occ->lock);
+
+	return (err ? err : count);
+}
+
+static ssize_t snsocc_sysfs_show_dma_size(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct occ *occ = dev_get_drvdata(dev);
+	int ret = 0;
+
+	spin_lock_irq(&occ->lock);
+	if (occ->dq_next_size)
+		ret = scnprintf(buf, PAGE_SIZE, "%luM next=%luM\n", occ->dq_size >> 20, occ->dq_next_size >> 20);
+	else
+		ret = scnprintf(buf, PAGE_SIZE, "%luM\n", occ->dq_size >> 20);
+	spin_unlock_irq(&occ->lock);
+
+	return ret;
+}
+
+static ssize_t snsocc_sysfs_store_dma_size(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	/* Accepts size with M or G suffix. New buffer is allocated right
+	 * away and replaces the current one on the next reset, which is
+	 * also when the device is opened.
+	 */
+	struct occ *occ = dev_get_drvdata(dev);
+	struct occ_dq_buf *next = NULL;
+	unsigned long size;
+	char size_mod = 0;
+	bool same;
+
+	if (sscanf(buf, "%lu%c", &size, &size_mod) < 2)
+		return -EINVAL;
+	if (size_mod == 'M')
+		size *= 1024*1024;
+	else if (size_mod == 'G')
+		size *= 1024*1024*1024;
+	else
+		return -EINVAL;
+	if (size & (size - 1)) // must be power of two
+		return -EINVAL;
+	if (size < OCC_DQ_SIZE || size > OCC_DQ_MAX_SIZE)
+		return -ENOMEM;
+
+	/* Emulated DQ of split queue firmware has fixed size */
+	if (occ->hwdq_page)
+		return -EINVAL;
+
+	// Same size cancels pending resize, clients only remap on change
+	spin_lock_irq(&occ->lock);
+	same = (size == occ->dq_size);
+	if (same) {
+		swap(occ->dq_next, next);
+		occ->dq_next_size = 0;
+	}
+	spin_unlock_irq(&occ->lock);
+	if (same) {
+		snsocc_dq_buf_put(next);
+		return count;
+	}
+
+	// Default size uses the buffer allocated at probe time
+	if (size > OCC_DQ_SIZE) {
+		next = snsocc_dq_buf_alloc(&occ->pdev->dev, size);
+		if (!next) {
+			dev_err(dev, "unable to allocate %luM data queue", size >> 20);
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock_irq(&occ->lock);
+	swap(occ->dq_next, next);
+	occ->dq_next_size = size;
+	spin_unlock_irq(&occ->lock);
+
+	// Drop previously pending buffer
+	snsocc_dq_buf_put(next);
+
+	return count;
+}
+
 static ssize_t snsocc_sysfs_show_serial_number(struct device *dev, struct device_attribute *attr, char *buf)
 {
 	struct occ *occ = dev_get_drvdata(dev);
@@ -1753,6 +2877,115 @@ static ssize_t snsocc_sysfs_store_irq_latency(struct device *dev, struct device_
 	return count;
 }
 
+static const char *snsocc_rx_mode_name[] = {
+	[OCC_RX_MODE_INTERRUPT] = "interrupt",
+	[OCC_RX_MODE_HYBRID] = "hybrid",
+	[OCC_RX_MODE_POLL] = "poll",
+};
+
+static ssize_t snsocc_sysfs_show_rx_mode(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct occ *occ = dev_get_drvdata(dev);
+	ssize_t len;
+
+	spin_lock_irq(&occ->lock);
+	len = scnprintf(buf, PAGE_SIZE, "%s period_us=%u polling=%d\n",
+			snsocc_rx_mode_name[occ->rx_mode], occ->rx_poll_period,
+			occ->rx_polling);
+	spin_unlock_irq(&occ->lock);
+
+	return len;
+}
+
+static ssize_t snsocc_sysfs_store_rx_mode(struct device *dev, struct device_attribute *attr, const char *buf, size_t count)
+{
+	/* Accepts "interrupt", "hybrid [<period_us>]" or "poll [<period_us>]" */
+	struct occ *occ = dev_get_drvdata(dev);
+	char name[16];
+	u32 period;
+	int mode, n;
+
+	n = sscanf(buf, "%15s %u", name, &period);
+	if (n < 1)
+		return -EINVAL;
+	for (mode = 0; mode < ARRAY_SIZE(snsocc_rx_mode_name); mode++) {
+		if (strcmp(name, snsocc_rx_mode_name[mode]) == 0)
+			break;
+	}
+	if (mode == ARRAY_SIZE(snsocc_rx_mode_name))
+		return -EINVAL;
+	if (n == 2 && (period == 0 || period > USEC_PER_SEC))
+		return -EINVAL;
+
+	spin_lock_irq(&occ->lock);
+	occ->rx_mode = mode;
+	if (n == 2)
+		occ->rx_poll_period = period;
+	if (mode == OCC_RX_MODE_INTERRUPT)
+		__snsocc_rx_poll_stop(occ);
+	else if (mode == OCC_RX_MODE_POLL && occ->in_use)
+		__snsocc_rx_poll_start(occ);
+	spin_unlock_irq(&occ->lock);
+
+	return count;
+}
+
+static int snsocc_irq_hist_open(struct inode *inode, struct file *file)
+{
+	/* Take a snapshot so that reader gets consistent data even when
+	 * reading in chunks, and no lock is held while copying to user.
+	 */
+	struct occ *occ = inode->i_private;
+	struct occ_irq_hist *snapshot;
+
+	snapshot = kmalloc(sizeof(*snapshot), GFP_KERNEL);
+	if (!snapshot)
+		return -ENOMEM;
+
+	spin_lock_irq(&occ->lock);
+	memcpy(snapshot, &occ->irq_hist, sizeof(*snapshot));
+	spin_unlock_irq(&occ->lock);
+
+	file->private_data = snapshot;
+	return 0;
+}
+
+static int snsocc_irq_hist_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t snsocc_irq_hist_read(struct file *file, char __user *buf, size_t count, loff_t *pos)
+{
+	return simple_read_from_buffer(buf, count, pos, file->private_data, sizeof(struct occ_irq_hist));
+}
+
+static ssize_t snsocc_irq_hist_write(struct file *file, const char __user *buf, size_t count, loff_t *pos)
+{
+	/* Any write clears histograms */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,9,0)
+	struct occ *occ = file_inode(file)->i_private;
+#else
+	struct occ *occ = file->f_path.dentry->d_inode->i_private;
+#endif
+
+	spin_lock_irq(&occ->lock);
+	memset(occ->irq_hist.cause, 0, sizeof(occ->irq_hist.cause));
+	spin_unlock_irq(&occ->lock);
+
+	return count;
+}
+
+static const struct file_operations snsocc_irq_hist_fops = {
+	.owner	 = THIS_MODULE,
+	.open	 = snsocc_irq_hist_open,
+	.release = snsocc_irq_hist_release,
+	.read	 = snsocc_irq_hist_read,
+	.write	 = snsocc_irq_hist_write,
+	.llseek	 = default_llseek,
+};
+
 static struct file_operations snsocc_fops = {
 	.owner	 = THIS_MODULE,
 	.open	 = snsocc_open,
@@ -1760,6 +2993,9 @@ static struct file_operations snsocc_fops = {
 	.mmap	 = snsocc_mmap,
 	.poll	 = snsocc_poll,
 	.write	 = snsocc_write,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3,16,0)
+	.write_iter = snsocc_write_iter,
+#endif
 	.read	 = snsocc_read,
 };
 
@@ -1834,9 +3070,20 @@ static int __devexit snsocc_probe(struct pci_dev *pdev,
 	cdev_init(&occ->cdev, &snsocc_fops);
 	spin_lock_init(&occ->lock);
 	mutex_init(&occ->tx_lock);
+	mutex_init(&occ->txq_lock);
+	INIT_WORK(&occ->tx_work, snsocc_tx_work);
+	INIT_DELAYED_WORK(&occ->coalesce_work, snsocc_coalesce_work);
 	init_waitqueue_head(&occ->tx_wq);
 	init_waitqueue_head(&occ->rx_wq);
-	tasklet_init(&occ->rxtask, snsocc_rxtask, (unsigned long) occ);
+	INIT_LIST_HEAD(&occ->subscribers);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+	timer_setup(&occ->rx_timer, snsocc_rx_timeout, 0);
+#else
+	setup_timer(&occ->rx_timer, snsocc_rx_timeout, (unsigned long) occ);
+#endif
+	hrtimer_setup(&occ->rx_poll_timer, snsocc_rx_poll, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	occ->rx_mode = OCC_RX_MODE_INTERRUPT;
+	occ->rx_poll_period = OCC_RX_POLL_PERIOD_US;
 	occ->cdev.owner = THIS_MODULE;
 	occ->pdev = pdev;
 	occ->minor = minor;
@@ -1859,6 +3106,11 @@ static int __devexit snsocc_probe(struct pci_dev *pdev,
 		dev_err(dev, "unable to allocate interrupt latency queues, aborting");
 		goto error_stat;
 	}
+	memset(&occ->irq_hist, 0, sizeof(occ->irq_hist));
+	occ->irq_hist.version = OCC_IRQ_HIST_VERSION;
+	occ->irq_hist.tick_ns = 8;
+	occ->irq_hist.bins = OCC_IRQ_HIST_BINS;
+	occ->irq_hist.causes = OCC_IRQ_CAUSES;
 
 	err = pci_set_dma_mask(pdev, DMA_BIT_MASK(64));
 	if (err) {
@@ -1923,7 +3175,16 @@ static int __devexit snsocc_probe(struct pci_dev *pdev,
 	}
 #endif
 
-	err = request_irq(pdev->irq, snsocc_interrupt, IRQF_SHARED, KBUILD_MODNAME, occ);
+	/* Interrupt handler publishes RX state through it */
+	err = -ENOMEM;
+	occ->ctrl = (struct occ_ctrl *)get_zeroed_page(GFP_KERNEL);
+	if (!occ->ctrl) {
+		dev_err(dev, "unable to allocate control page, aborting");
+		goto error_dev;
+	}
+
+	err = request_threaded_irq(pdev->irq, snsocc_interrupt, snsocc_rx_thread,
+				   IRQF_SHARED, KBUILD_MODNAME, occ);
 	if (err) {
 		dev_err(dev, "unable to request interrupt, aborting");
 		goto error_dev;
@@ -1968,7 +3229,9 @@ static int __devexit snsocc_probe(struct pci_dev *pdev,
 	}
 
 	occ->tx_buffer = kmalloc(occ->board->tx_fifo_len, GFP_KERNEL);
-	if (!occ->tx_buffer) {
+	occ->txq = kmalloc(OCC_TXQ_SIZE, GFP_KERNEL);
+	occ->tx_workq = alloc_workqueue("%s_tx", WQ_UNBOUND, 1, dev_name(&occ->dev));
+	if (!occ->tx_buffer || !occ->txq || !occ->tx_workq) {
 		dev_err(dev, "unable to allocate TX buffer, aborting");
 		goto error_dq;
 	}
@@ -1997,6 +3260,11 @@ static int __devexit snsocc_probe(struct pci_dev *pdev,
 
 	dev_set_drvdata(dev, occ);
 
+	/* Debugfs is optional, failures are not fatal */
+	occ->debugfs = debugfs_create_dir(dev_name(&occ->dev), NULL);
+	if (!IS_ERR_OR_NULL(occ->debugfs) && occ->board->irq_timestamps)
+		debugfs_create_file("irq_hist", 0600, occ->debugfs, occ, &snsocc_irq_hist_fops);
+
 	dev_info(dev, "snsocc%d: %s OCC version %08x, datecode %08x (%s IRQ: %u)\n",
 		 minor, snsocc_name[board_id],
 		 occ->version,
@@ -2010,13 +3278,17 @@ static int __devexit snsocc_probe(struct pci_dev *pdev,
 error_cdev:
 	cdev_del(&occ->cdev);
 error_dq:
+	if (occ->tx_workq)
+		destroy_workqueue(occ->tx_workq);
 	kfree(occ->tx_buffer);
+	kfree(occ->txq);
 	kfree(occ->imq);
 	snsocc_free_queue(dev, occ->dq_page, occ->dq_dma, OCC_DQ_SIZE);
 	snsocc_free_queue(dev, occ->hwcq_page, occ->hwcq_dma, OCC_CQ_SIZE);
 	snsocc_free_queue(dev, occ->hwimq_page, occ->hwimq_dma, OCC_IMQ_SIZE);
 	snsocc_free_queue(dev, occ->hwdq_page, occ->hwdq_dma, OCC_DQ_SIZE);
 error_dev:
+	free_page((unsigned long)occ->ctrl);
 	if (occ && occ->board && occ->board->sysfs.attrs)
 		sysfs_remove_group(&dev->kobj, &occ->board->sysfs);
 	put_device(&occ->dev);
@@ -2040,6 +3312,7 @@ static void __devexit snsocc_remove(struct pci_dev *pdev)
 
 	if (occ && occ->board && occ->board->sysfs.attrs)
 		sysfs_remove_group(&dev->kobj, &occ->board->sysfs);
+	debugfs_remove_recursive(occ->debugfs);
 
 	iowrite32(0, occ->ioaddr + REG_IRQ_ENABLE);
 	iowrite32(OCC_CONF_RESET, occ->ioaddr + REG_CONFIG);
@@ -2050,16 +3323,27 @@ static void __devexit snsocc_remove(struct pci_dev *pdev)
 	if (occ->msi_enabled != 0)
 		pci_disable_msi(pdev);
 #endif
+	timer_delete_sync(&occ->rx_timer);
+	occ->rx_polling = false;
+	hrtimer_cancel(&occ->rx_poll_timer);
+	cancel_work_sync(&occ->tx_work);
+	destroy_workqueue(occ->tx_workq);
+	occ->coalesce_adaptive = false;
+	cancel_delayed_work_sync(&occ->coalesce_work);
 
 	device_del(&occ->dev);
 	cdev_del(&occ->cdev);
 
+	snsocc_dq_buf_drop(occ);
+	snsocc_free_sg_queue(occ);
 	snsocc_free_big_queue(occ);
 	snsocc_free_queue(dev, occ->dq_page, occ->dq_dma, OCC_DQ_SIZE);
 	snsocc_free_queue(dev, occ->hwcq_page, occ->hwcq_dma, OCC_CQ_SIZE);
 	snsocc_free_queue(dev, occ->hwimq_page, occ->hwimq_dma, OCC_IMQ_SIZE);
 	snsocc_free_queue(dev, occ->hwdq_page, occ->hwdq_dma, OCC_DQ_SIZE);
+	free_page((unsigned long)occ->ctrl);
 	kfree(occ->tx_buffer);
+	kfree(occ->txq);
 	kfree(occ->imq);
 
 	kfree(occ->irq_latency.isr_delay);
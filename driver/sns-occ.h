@@ -20,7 +20,7 @@ typedef uint64_t u64;
 /**
  * OCC minor version, changed when interface changes.
  */
-#define OCC_VER_MIN 9
+#define OCC_VER_MIN 15
 
 /**
  * OCC build version, not enforced to the client.
@@ -39,13 +39,28 @@ typedef uint64_t u64;
  * Reading sizeof(struct occ_status) bytes at offset OCC_CMD_GET_STATUS
  * gives information about the driver and current status of the hardware.
  * Check the struct occ_status for details.
+ *
+ * Reading 8 bytes at offset OCC_CMD_RX_ACK combines OCC_CMD_ADVANCE_DQ and
+ * OCC_CMD_RX in a single call. Before the call, the first 4 bytes of the
+ * buffer must contain the number of bytes consumed and the second 4 bytes
+ * timeout in milliseconds, 0 means wait forever. Consumer index is advanced
+ * first, any error doing so is returned without waiting. Buffer is then
+ * populated the same way as with OCC_CMD_RX. When the timeout expires or
+ * a signal is caught after the consumer index was advanced, the call
+ * succeeds but OCC_RX_MSG is not set in the status.
+ *
+ * Both OCC_CMD_RX and OCC_CMD_RX_ACK also accept a 12 byte buffer, in which
+ * case the third 4 bytes are populated with the consumer index of the
+ * caller. Subscribers need it to follow their cursor, see OCC_CMD_SUBSCRIBE.
  */
 #define OCC_CMD_RX                  1
 #define OCC_CMD_VERSION             2
 #define OCC_CMD_GET_STATUS          3
 #define OCC_CMD_OLD_PKTS_EN         4
+#define OCC_CMD_RX_ACK              5
 
 /* Status flags returned in status member of occ_status struct */
+#define OCC_RX_OVERRUN			(1 << 10)
 #define OCC_OPTICAL_FAULT			(1 << 9)
 #define OCC_FIFO_OVERFLOW		(1 << 8)
 #define OCC_RX_ERR_PKTS_ENABLED		(1 << 7)
@@ -68,15 +83,45 @@ typedef uint64_t u64;
  * commands, and should not be a multiple of 4. This will help catch
  * incorrect use of the driver interface.
  *
- * TX calls can be interrupted by a signal, in which case they may leave
- * EINTR in errno. If the card is reset while the call is queued to send a
- * packet, it may use ECONNRESET. EIO indicates a timeout during the TX
+ * TX calls queue the data and return without waiting for it to be sent.
+ * They block when the queue is full, poll() reports POLLOUT when there's
+ * room for at least OCC_MAX_TX_LEN bytes. TX calls can be interrupted by
+ * a signal, in which case they may leave EINTR in errno. If the card is
+ * reset while the call is waiting, it may use ECONNRESET, and any queued
+ * data is discarded. EIO indicates a timeout while sending previously
+ * queued data and is returned by the next TX call.
+ *
+ * Gathering write (pwritev()) at offset OCC_CMD_TX sends data from all
+ * segments as a single message, with a single TX completion wait. Total
+ * length must be less than OCC_MAX_TX_LEN, same as with the regular write.
  *
  * Writing 4 bytes at offset OCC_CMD_RX_ENABLE with a non-zero value will
  * enable the RX. 0 will disable it.
  *
  * Writing 4 bytes at offset OCC_CMD_ERR_PKTS_ENABLE with a non-zero value will
  * enable receiving error packets. 0 will disable it.
+ *
+ * Writing 8 bytes at offset OCC_CMD_RX_WATERMARK sets the RX wakeup
+ * watermark. The first 4 bytes is the number of bytes that must be in the
+ * ring buffer before OCC_CMD_RX returns or poll() reports POLLIN, the
+ * second 4 bytes is maximum latency in microseconds after which any
+ * available data is reported regardless of watermark. Latency must be
+ * non-zero when watermark is set. Watermark 0 disables the feature. Only
+ * applies to the exclusive connection and is cleared when it's closed.
+ *
+ * Writing 4 bytes at offset OCC_CMD_SUBSCRIBE turns a non-exclusive
+ * connection into an RX subscriber with its own consumer index, starting
+ * at the current producer index. Subscriber can mmap the RX ring and use
+ * OCC_CMD_RX, OCC_CMD_RX_ACK and OCC_CMD_ADVANCE_DQ just like the exclusive
+ * connection. With OCC_SUBSCRIBE_REQUIRED the hardware doesn't overwrite
+ * data until subscriber consumes it, same as exclusive connection. With
+ * OCC_SUBSCRIBE_LOSSY the subscriber never holds back the hardware, its
+ * consumer index is moved forward when the data it was about to consume
+ * is released to hardware, and OCC_RX_OVERRUN is reported once by the
+ * next OCC_CMD_RX. Writing 0 unsubscribes. Subscriber is dropped when
+ * DMA buffer is replaced, OCC_CMD_GET_STATUS reports OCC_RESET_OCCURRED
+ * and OCC_CMD_RX fails with ECONNRESET until it maps the new buffer and
+ * subscribes again.
  */
 #define OCC_CMD_TX			9
 #define OCC_CMD_ADVANCE_DQ		10
@@ -85,6 +130,36 @@ typedef uint64_t u64;
 #define 	OCC_SELECT_OPTICAL	1
 #define OCC_CMD_RX_ENABLE		12
 #define OCC_CMD_ERR_PKTS_ENABLE		13
+#define OCC_CMD_RX_WATERMARK		14
+#define OCC_CMD_SUBSCRIBE		15
+#define 	OCC_SUBSCRIBE_REQUIRED	1
+#define 	OCC_SUBSCRIBE_LOSSY	2
+
+/* Calculate new DMA queue consumer index after consuming len bytes.
+ * Returns 0 when len is outside of the valid data range, 1 otherwise.
+ * Shared by the driver and userspace so that index handling can be
+ * exercised outside of kernel.
+ */
+static inline int occ_dq_advance(u32 size, u32 prod, u32 cons, u32 len, u32 *new_cons)
+{
+	/* We only deal with packets that are multiples of 4 bytes */
+	len = (len + 3) & ~3;
+
+	if (len == 0 || len >= size)
+		return 0;
+
+	/* Validate that the new consumer index is within the range
+	 * of valid data.
+	 */
+	len += cons;
+	if (prod < cons)
+		prod += size;
+	if (len <= cons || len > prod)
+		return 0;
+
+	*new_cons = len % size;
+	return 1;
+}
 
 /* Not a full 8k as we have to avoid prod_idx == cons_idx (empty) */
 // TODO: PCIe queue size is 32*1024, it can't just yet roll-over properly at lower sizes
@@ -98,6 +173,7 @@ typedef uint64_t u64;
 #define OCC_MMAP_BAR1           	1
 #define OCC_MMAP_BAR2           	2
 #define OCC_MMAP_RX_DMA         	6
+#define OCC_MMAP_CTRL           	7
 
 /* Boards supported by the driver.
  */
@@ -125,9 +201,55 @@ struct occ_status {
     u32 fpga_aux_volt;      // FPGA aug voltage raw value, conv: ((3.0/4096.0) * (X/16)) V
 };
 
+/* Read-only page mapped at OCC_MMAP_CTRL offset, exposing the RX ring
+ * state without a system call. Driver increments generation before and
+ * after updating the rest of the fields. Reader should retry when the
+ * generation is odd or has changed while reading other fields.
+ * The status field contains OCC_DMA_STALLED, OCC_FIFO_OVERFLOW and
+ * OCC_RESET_OCCURRED flags.
+ */
+struct occ_ctrl {
+    u32 generation;			// Update counter, odd while update in progress
+    u32 dq_prod;			// RX DMA producer index
+    u32 dq_cons;			// RX DMA consumer index
+    u32 status;				// Error flags
+};
+
 struct occ_version {
     u32 major;				// Major driver version
     u32 minor;				// Minor version
 };
 
+/* Interrupt latency histograms, read as binary blob from debugfs file
+ * snsoccN/irq_hist. Collected on every interrupt regardless of irq_latency
+ * sysfs capture, only by boards that timestamp interrupts. Writing anything
+ * to the file clears histograms. Bin 0 counts zero values, bin i counts
+ * values in range [2^(i-1), 2^i) ticks, the last bin also counts all
+ * larger values. Delay is time from firmware asserting interrupt to
+ * ISR start, proctime is time spent in ISR.
+ */
+#define OCC_IRQ_HIST_VERSION		1
+#define OCC_IRQ_HIST_BINS		32
+
+enum occ_irq_cause {
+    OCC_IRQ_CAUSE_RX		= 0,	// RX DMA done
+    OCC_IRQ_CAUSE_STALL		= 1,	// DMA stalled
+    OCC_IRQ_CAUSE_OVERFLOW	= 2,	// FIFO overflow
+    OCC_IRQ_CAUSES		= 3,
+};
+
+struct occ_irq_hist {
+    u32 version;			// OCC_IRQ_HIST_VERSION
+    u32 tick_ns;			// Duration of one tick in ns
+    u32 bins;				// OCC_IRQ_HIST_BINS
+    u32 causes;				// OCC_IRQ_CAUSES
+    struct {
+        u64 count;			// Number of interrupts measured
+        u32 delay_max;			// Maximum delay in ticks
+        u32 proctime_max;		// Maximum ISR processing time in ticks
+        u64 delay[OCC_IRQ_HIST_BINS];
+        u64 proctime[OCC_IRQ_HIST_BINS];
+    } cause[OCC_IRQ_CAUSES];
+};
+
 #endif /* __SNS_DAS_H */
@@ -16,6 +16,9 @@
 #include "occlib_hw.h"
 #include "occlib_drv.h"
 #include "occlib_sock.h"
+#include "occlib_file.h"
+#include "occlib_sim.h"
+#include "occlib_shm.h"
 
 #include <sns-occ.h> // For OCC_VER_* only
 
@@ -23,6 +26,8 @@
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <sys/stat.h>
 
 #define OCC_HANDLE_MAGIC        0x0cc0cc
@@ -32,51 +37,82 @@ struct occ_handle {
     struct {
         int (*open)(const char *, occ_interface_type, struct occ_handle **);
         int (*open_debug)(const char *, occ_interface_type, struct occ_handle **);
+        int (*open_monitor)(const char *, occ_interface_type, bool, struct occ_handle **);
         int (*close)(struct occ_handle *handle);
         int (*enable_rx)(struct occ_handle *handle, bool enable);
         int (*enable_old_packets)(struct occ_handle *handle, bool enable);
         int (*enable_error_packets)(struct occ_handle *handle, bool enable);
+        int (*set_rx_watermark)(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
         int (*status)(struct occ_handle *handle, occ_status_t *status, occ_status_type type);
         int (*reset)(struct occ_handle *handle);
         int (*send)(struct occ_handle *handle, const void *data, size_t count);
+        int (*sendv)(struct occ_handle *handle, const struct iovec *iov, int iovcnt);
         int (*data_wait)(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
         int (*data_ack)(struct occ_handle *handle, size_t count);
+        int (*data_ack_wait)(struct occ_handle *handle, size_t ack, void **address, size_t *count, uint32_t timeout);
+        int (*data_claim)(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
+        int (*data_release)(struct occ_handle *handle, const void *address, size_t count);
+        int (*get_fd)(struct occ_handle *handle);
+        int (*set_nonblock)(struct occ_handle *handle, bool enable);
         int (*read)(struct occ_handle *handle, void *data, size_t count, uint32_t timeout);
         int (*io_read)(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count);
         int (*io_write)(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count);
         int (*report)(struct occ_handle *handle, FILE *outfile);
+        int (*get_stats)(struct occ_handle *handle, occ_stats_t *stats);
+        int (*reset_stats)(struct occ_handle *handle);
     } ops;
     void *impl_ctx;
+    bool old_packets;                       //!< Frame packets as DAS 1.0 in occ_packet_next()
+    size_t batch_len;                       //!< Number of bytes framed by last occ_packet_next()
+    uint64_t data_ns;                       //!< Time when last wait returned data, for ack latency
+    occ_stats_t stats;                      //!< Generic RX statistics, backend fields are filled in occ_get_stats()
+    bool stall_seen;                        //!< Current stall was already counted, cleared by occ_reset()
 };
 
+#define DAS1_HEADER_SIZE        24          // DAS 1.0 header, payload length in 4th dword
+#define DAS2_HEADER_SIZE        8           // DAS 2.0 header, total length in 2nd dword
+
 void occ_version(unsigned *major, unsigned *minor) {
     *major = OCC_VER_MAJ;
     *minor = OCC_VER_MIN;
 }
 
 static int _occ_open_common(const char *devfile, occ_interface_type type, struct occ_handle **handle) {
-    *handle = malloc(sizeof(struct occ_handle));
+    // Zeroed so that optional ops not provided by backend are NULL
+    *handle = calloc(1, sizeof(struct occ_handle));
     if (!(*handle)) {
         return -ENOMEM;
     }
     (*handle)->magic = OCC_HANDLE_MAGIC;
+    (*handle)->old_packets = false;
+    (*handle)->batch_len = 0;
 
     if (type == OCC_INTERFACE_LVDS || type == OCC_INTERFACE_OPTICAL) {
         (*handle)->ops.open                 = occdrv_open;
         (*handle)->ops.open_debug           = occdrv_open_debug;
+        (*handle)->ops.open_monitor         = occdrv_open_monitor;
         (*handle)->ops.close                = occdrv_close;
         (*handle)->ops.enable_rx            = occdrv_enable_rx;
         (*handle)->ops.enable_old_packets   = occdrv_enable_old_packets;
         (*handle)->ops.enable_error_packets = occdrv_enable_error_packets;
+        (*handle)->ops.set_rx_watermark     = occdrv_set_rx_watermark;
         (*handle)->ops.status               = occdrv_status;
         (*handle)->ops.reset                = occdrv_reset;
         (*handle)->ops.send                 = occdrv_send;
+        (*handle)->ops.sendv                = occdrv_sendv;
         (*handle)->ops.data_wait            = occdrv_data_wait;
         (*handle)->ops.data_ack             = occdrv_data_ack;
+        (*handle)->ops.data_ack_wait        = occdrv_data_ack_wait;
+        (*handle)->ops.data_claim           = occdrv_data_claim;
+        (*handle)->ops.data_release         = occdrv_data_release;
+        (*handle)->ops.get_fd               = occdrv_get_fd;
+        (*handle)->ops.set_nonblock         = occdrv_set_nonblock;
         (*handle)->ops.read                 = occdrv_read;
         (*handle)->ops.io_read              = occdrv_io_read;
         (*handle)->ops.io_write             = occdrv_io_write;
         (*handle)->ops.report               = occdrv_report;
+        (*handle)->ops.get_stats            = occdrv_get_stats;
+        (*handle)->ops.reset_stats          = occdrv_reset_stats;
     } else if (type == OCC_INTERFACE_SOCKET) {
         (*handle)->ops.open                 = occsock_open;
         (*handle)->ops.open_debug           = occsock_open_debug;
@@ -84,14 +120,78 @@ static int _occ_open_common(const char *devfile, occ_interface_type type, struct
         (*handle)->ops.enable_rx            = occsock_enable_rx;
         (*handle)->ops.enable_old_packets   = occsock_enable_old_packets;
         (*handle)->ops.enable_error_packets = occsock_enable_error_packets;
+        (*handle)->ops.set_rx_watermark     = occsock_set_rx_watermark;
         (*handle)->ops.status               = occsock_status;
         (*handle)->ops.reset                = occsock_reset;
         (*handle)->ops.send                 = occsock_send;
+        (*handle)->ops.sendv                = occsock_sendv;
         (*handle)->ops.data_wait            = occsock_data_wait;
         (*handle)->ops.data_ack             = occsock_data_ack;
+        (*handle)->ops.get_fd               = occsock_get_fd;
+        (*handle)->ops.set_nonblock         = occsock_set_nonblock;
         (*handle)->ops.read                 = occsock_read;
         (*handle)->ops.io_read              = occsock_io_read;
         (*handle)->ops.io_write             = occsock_io_write;
+        (*handle)->ops.report               = occsock_report;
+        (*handle)->ops.get_stats            = occsock_get_stats;
+        (*handle)->ops.reset_stats          = occsock_reset_stats;
+    } else if (type == OCC_INTERFACE_FILE) {
+        (*handle)->ops.open                 = occfile_open;
+        (*handle)->ops.open_debug           = occfile_open_debug;
+        (*handle)->ops.close                = occfile_close;
+        (*handle)->ops.enable_rx            = occfile_enable_rx;
+        (*handle)->ops.enable_old_packets   = occfile_enable_old_packets;
+        (*handle)->ops.enable_error_packets = occfile_enable_error_packets;
+        (*handle)->ops.set_rx_watermark     = occfile_set_rx_watermark;
+        (*handle)->ops.status               = occfile_status;
+        (*handle)->ops.reset                = occfile_reset;
+        (*handle)->ops.send                 = occfile_send;
+        (*handle)->ops.data_wait            = occfile_data_wait;
+        (*handle)->ops.data_ack             = occfile_data_ack;
+        (*handle)->ops.get_fd               = occfile_get_fd;
+        (*handle)->ops.set_nonblock         = occfile_set_nonblock;
+        (*handle)->ops.read                 = occfile_read;
+        (*handle)->ops.io_read              = occfile_io_read;
+        (*handle)->ops.io_write             = occfile_io_write;
+        (*handle)->ops.report               = occfile_report;
+    } else if (type == OCC_INTERFACE_SIM) {
+        (*handle)->ops.open                 = occsim_open;
+        (*handle)->ops.open_debug           = occsim_open_debug;
+        (*handle)->ops.close                = occsim_close;
+        (*handle)->ops.enable_rx            = occsim_enable_rx;
+        (*handle)->ops.enable_old_packets   = occsim_enable_old_packets;
+        (*handle)->ops.enable_error_packets = occsim_enable_error_packets;
+        (*handle)->ops.set_rx_watermark     = occsim_set_rx_watermark;
+        (*handle)->ops.status               = occsim_status;
+        (*handle)->ops.reset                = occsim_reset;
+        (*handle)->ops.send                 = occsim_send;
+        (*handle)->ops.data_wait            = occsim_data_wait;
+        (*handle)->ops.data_ack             = occsim_data_ack;
+        (*handle)->ops.get_fd               = occsim_get_fd;
+        (*handle)->ops.set_nonblock         = occsim_set_nonblock;
+        (*handle)->ops.read                 = occsim_read;
+        (*handle)->ops.io_read              = occsim_io_read;
+        (*handle)->ops.io_write             = occsim_io_write;
+        (*handle)->ops.report               = occsim_report;
+    } else if (type == OCC_INTERFACE_SHM) {
+        (*handle)->ops.open                 = occshm_open;
+        (*handle)->ops.open_debug           = occshm_open_debug;
+        (*handle)->ops.close                = occshm_close;
+        (*handle)->ops.enable_rx            = occshm_enable_rx;
+        (*handle)->ops.enable_old_packets   = occshm_enable_old_packets;
+        (*handle)->ops.enable_error_packets = occshm_enable_error_packets;
+        (*handle)->ops.set_rx_watermark     = occshm_set_rx_watermark;
+        (*handle)->ops.status               = occshm_status;
+        (*handle)->ops.reset                = occshm_reset;
+        (*handle)->ops.send                 = occshm_send;
+        (*handle)->ops.data_wait            = occshm_data_wait;
+        (*handle)->ops.data_ack             = occshm_data_ack;
+        (*handle)->ops.get_fd               = occshm_get_fd;
+        (*handle)->ops.set_nonblock         = occshm_set_nonblock;
+        (*handle)->ops.read                 = occshm_read;
+        (*handle)->ops.io_read              = occshm_io_read;
+        (*handle)->ops.io_write             = occshm_io_write;
+        (*handle)->ops.report               = occshm_report;
     } else {
         free(*handle);
         *handle = NULL;
@@ -129,6 +229,23 @@ int occ_open_debug(const char *devfile, occ_interface_type type, struct occ_hand
     return ret;
 }
 
+int occ_open_monitor(const char *devfile, occ_interface_type type, bool lossy, struct occ_handle **handle) {
+    int ret = _occ_open_common(devfile, type, handle);
+
+    if (ret == 0) {
+        if ((*handle)->ops.open_monitor == NULL)
+            ret = -ENOSYS;
+        else
+            ret = (*handle)->ops.open_monitor(devfile, type, lossy, (struct occ_handle **)&(*handle)->impl_ctx);
+        if (ret != 0) {
+            free(*handle);
+            *handle = NULL;
+        }
+    }
+
+    return ret;
+}
+
 int occ_close(struct occ_handle *handle) {
     int ret = -EINVAL;
     if (handle != NULL && handle->magic == OCC_HANDLE_MAGIC) {
@@ -149,7 +266,10 @@ int occ_enable_old_packets(struct occ_handle *handle, bool enable) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    return handle->ops.enable_old_packets(handle->impl_ctx, enable);
+    int ret = handle->ops.enable_old_packets(handle->impl_ctx, enable);
+    if (ret == 0)
+        handle->old_packets = enable;
+    return ret;
 }
 
 int occ_enable_error_packets(struct occ_handle *handle, bool enable) {
@@ -159,6 +279,13 @@ int occ_enable_error_packets(struct occ_handle *handle, bool enable) {
     return handle->ops.enable_error_packets(handle->impl_ctx, enable);
 }
 
+int occ_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    return handle->ops.set_rx_watermark(handle->impl_ctx, bytes, latency_us);
+}
+
 int occ_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || status == NULL)
         return -EINVAL;
@@ -167,10 +294,15 @@ int occ_status(struct occ_handle *handle, occ_status_t *status, occ_status_type
 }
 
 int occ_reset(struct occ_handle *handle) {
+    int ret;
+
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    return handle->ops.reset(handle->impl_ctx);
+    ret = handle->ops.reset(handle->impl_ctx);
+    if (ret == 0)
+        handle->stall_seen = false;
+    return ret;
 }
 
 int occ_send(struct occ_handle *handle, const void *data, size_t count) {
@@ -180,18 +312,242 @@ int occ_send(struct occ_handle *handle, const void *data, size_t count) {
     return handle->ops.send(handle->impl_ctx, data, count);
 }
 
+int occ_sendv(struct occ_handle *handle, const struct iovec *iov, int iovcnt) {
+    int sent = 0;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || iov == NULL || iovcnt < 0)
+        return -EINVAL;
+
+    if (handle->ops.sendv)
+        return handle->ops.sendv(handle->impl_ctx, iov, iovcnt);
+
+    // Backend can't batch, send one by one
+    for (int i = 0; i < iovcnt; i++) {
+        int ret = handle->ops.send(handle->impl_ctx, iov[i].iov_base, iov[i].iov_len);
+        if (ret < 0)
+            return (sent > 0 ? sent : ret);
+        sent += ret;
+    }
+    return sent;
+}
+
+/**
+ * Return monotonic time in nanoseconds, served from vDSO without a syscall.
+ */
+static inline uint64_t _occ_stats_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Count value in log2 histogram, bin 0 is for zeros and last bin catches overflows.
+ */
+static inline void _occ_stats_hist(uint64_t *hist, uint64_t value) {
+    unsigned bin = (value == 0 ? 0 : 64 - __builtin_clzll(value));
+    hist[bin < OCC_STATS_BINS ? bin : OCC_STATS_BINS - 1]++;
+}
+
+static inline void _occ_stats_wait(struct occ_handle *handle, uint64_t start, int ret, size_t count) {
+    uint64_t now = _occ_stats_now();
+
+    handle->stats.waits++;
+    _occ_stats_hist(handle->stats.wait_hist, now - start);
+    if (ret != 0 || count == 0) {
+        handle->stats.empty_waits++;
+        if (ret == -ENOSPC && !handle->stall_seen) {
+            handle->stall_seen = true;
+            handle->stats.stalls++;
+        }
+        return;
+    }
+    handle->stats.wait_bytes += count;
+    _occ_stats_hist(handle->stats.batch_hist, count);
+    handle->data_ns = now;
+}
+
+static inline void _occ_stats_ack(struct occ_handle *handle, uint64_t now, size_t count) {
+    if (count > 0) {
+        handle->stats.acks++;
+        handle->stats.ack_bytes += count;
+        _occ_stats_hist(handle->stats.ack_hist, now - handle->data_ns);
+    }
+}
+
+static int _occ_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    uint64_t start = _occ_stats_now();
+    int ret = handle->ops.data_wait(handle->impl_ctx, address, count, timeout);
+    _occ_stats_wait(handle, start, ret, (ret == 0 ? *count : 0));
+    return ret;
+}
+
+static int _occ_data_ack(struct occ_handle *handle, size_t count) {
+    int ret = handle->ops.data_ack(handle->impl_ctx, count);
+    if (ret == 0)
+        _occ_stats_ack(handle, _occ_stats_now(), count);
+    return ret;
+}
+
 int occ_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    return handle->ops.data_wait(handle->impl_ctx, address, count, timeout);
+    return _occ_data_wait(handle, address, count, timeout);
 }
 
 int occ_data_ack(struct occ_handle *handle, size_t count) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    return handle->ops.data_ack(handle->impl_ctx, count);
+    return _occ_data_ack(handle, count);
+}
+
+int occ_data_ack_wait(struct occ_handle *handle, size_t ack, void **address, size_t *count, uint32_t timeout) {
+    uint64_t start;
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->ops.data_ack_wait) {
+        start = _occ_stats_now();
+        ret = handle->ops.data_ack_wait(handle->impl_ctx, ack, address, count, timeout);
+        // Timeouts are only reported after ack went through
+        if (ret == 0 || ret == -ETIME || ret == -EAGAIN)
+            _occ_stats_ack(handle, start, ack);
+        _occ_stats_wait(handle, start, ret, (ret == 0 ? *count : 0));
+        return ret;
+    }
+
+    // Backend can't combine them, do it in two steps
+    ret = _occ_data_ack(handle, ack);
+    if (ret != 0)
+        return ret;
+    return _occ_data_wait(handle, address, count, timeout);
+}
+
+int occ_data_claim(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->ops.data_claim == NULL)
+        return -ENOSYS;
+
+    return handle->ops.data_claim(handle->impl_ctx, address, count, timeout);
+}
+
+int occ_data_release(struct occ_handle *handle, const void *address, size_t count) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->ops.data_release == NULL)
+        return -ENOSYS;
+
+    return handle->ops.data_release(handle->impl_ctx, address, count);
+}
+
+int occ_get_fd(struct occ_handle *handle) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->ops.get_fd == NULL)
+        return -ENOSYS;
+
+    return handle->ops.get_fd(handle->impl_ctx);
+}
+
+int occ_set_nonblock(struct occ_handle *handle, bool enable) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->ops.set_nonblock == NULL)
+        return -ENOSYS;
+
+    return handle->ops.set_nonblock(handle->impl_ctx, enable);
+}
+
+static int _occ_packet_frame(struct occ_handle *handle, const uint8_t *data, size_t avail, occ_packet_t *packets, size_t max, size_t *count) {
+    size_t offset = 0;
+
+    *count = 0;
+    while (*count < max) {
+        const uint32_t *header = (const uint32_t *)(data + offset);
+        uint32_t length;
+        uint32_t type;
+
+        if (handle->old_packets) {
+            if ((avail - offset) < DAS1_HEADER_SIZE)
+                break;
+            length = DAS1_HEADER_SIZE + header[3];
+            type = 0;
+        } else {
+            if ((avail - offset) < DAS2_HEADER_SIZE)
+                break;
+            length = header[1];
+            type = (header[0] >> 20) & 0xFF;
+        }
+        if ((length & 0x3) != 0 || length < (handle->old_packets ? DAS1_HEADER_SIZE : DAS2_HEADER_SIZE)) {
+            // Let application process good packets first, report error next time
+            if (*count == 0)
+                return -EBADMSG;
+            break;
+        }
+        if (length > (avail - offset))
+            break;
+
+        packets[*count].data = header;
+        packets[*count].length = length;
+        packets[*count].type = type;
+        (*count)++;
+        offset += length;
+    }
+
+    handle->batch_len = offset;
+    return 0;
+}
+
+int occ_packet_next(struct occ_handle *handle, occ_packet_t *packets, size_t *count, size_t *remain, uint32_t timeout) {
+    size_t max;
+    int i;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || packets == NULL || count == NULL || *count == 0)
+        return -EINVAL;
+
+    max = *count;
+    *count = 0;
+    handle->batch_len = 0;
+
+    // Second attempt only when nothing could be framed, gives the implementation
+    // a chance to merge packet split at the buffer boundary or receive more data.
+    for (i = 0; i < 2 && *count == 0; i++) {
+        void *data;
+        size_t avail;
+
+        int ret = _occ_data_wait(handle, &data, &avail, timeout);
+        if (ret != 0)
+            return ret;
+
+        ret = _occ_packet_frame(handle, data, avail, packets, max, count);
+        if (ret != 0)
+            return ret;
+
+        if (remain)
+            *remain = avail - handle->batch_len;
+    }
+
+    return (*count == 0 ? -ENODATA : 0);
+}
+
+int occ_packet_ack(struct occ_handle *handle) {
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    ret = _occ_data_ack(handle, handle->batch_len);
+    if (ret == 0)
+        handle->batch_len = 0;
+    return ret;
 }
 
 int occ_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout) {
@@ -221,3 +577,25 @@ int occ_report(struct occ_handle *handle, FILE *outfile) {
 
     return handle->ops.report(handle->impl_ctx, outfile);
 }
+
+int occ_get_stats(struct occ_handle *handle, occ_stats_t *stats) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || stats == NULL)
+        return -EINVAL;
+
+    // Snapshot without locking, counters may be slightly inconsistent
+    // when RX thread is updating them at the same time.
+    memcpy(stats, &handle->stats, sizeof(*stats));
+    if (handle->ops.get_stats)
+        return handle->ops.get_stats(handle->impl_ctx, stats);
+    return 0;
+}
+
+int occ_reset_stats(struct occ_handle *handle) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    memset(&handle->stats, 0, sizeof(handle->stats));
+    if (handle->ops.reset_stats)
+        return handle->ops.reset_stats(handle->impl_ctx);
+    return 0;
+}
@@ -22,6 +22,7 @@
 #include <stddef.h> // size_t
 #include <stdint.h> // uintX_t
 #include <stdio.h>  // FILE
+#include <sys/uio.h> // struct iovec
 
 #ifdef __cplusplus
 extern "C" {
@@ -39,6 +40,9 @@ typedef enum {
     OCC_INTERFACE_LVDS,
     OCC_INTERFACE_OPTICAL,
     OCC_INTERFACE_SOCKET,
+    OCC_INTERFACE_FILE,
+    OCC_INTERFACE_SIM,
+    OCC_INTERFACE_SHM,
 } occ_interface_type;
 
 /**
@@ -112,6 +116,38 @@ typedef struct {
     uint32_t err_frame;
 } occ_status_t;
 
+/**
+ * Single OCC packet as returned by occ_packet_next().
+ */
+typedef struct {
+    const void *data;               //!< Start of the packet, including header.
+    uint32_t length;                //!< Total packet length in bytes.
+    uint32_t type;                  //!< Packet type from DAS 2.0 header, 0 for DAS 1.0 packets.
+} occ_packet_t;
+
+#define OCC_STATS_BINS              32  //!< Number of bins in occ_stats_t histograms
+
+/**
+ * RX path statistics of a single handle, see occ_get_stats().
+ *
+ * Histograms are log2 based. Bin 0 counts zero values, bin i counts values
+ * in range [2^(i-1), 2^i) and the last bin also counts all larger values.
+ */
+typedef struct {
+    uint64_t waits;                 //!< Number of calls waiting for data, including occ_packet_next() and occ_data_ack_wait().
+    uint64_t empty_waits;           //!< Waits that returned no data, due to timeout or error.
+    uint64_t stalls;                //!< Number of times waiting returned -ENOSPC, counted once until occ_reset().
+    uint64_t wait_bytes;            //!< Total number of bytes returned by waits.
+    uint64_t acks;                  //!< Number of non-zero acknowledges.
+    uint64_t ack_bytes;             //!< Total number of bytes acknowledged.
+    uint64_t blocked;               //!< Number of times backend blocked in kernel waiting for data, OCC and socket only.
+    uint64_t blocked_ns;            //!< Total time blocked in kernel, OCC and socket only.
+    uint64_t rollovers;             //!< Packets split at the end of DMA buffer and copied to rollover buffer, OCC only.
+    uint64_t batch_hist[OCC_STATS_BINS]; //!< Number of bytes returned per wait.
+    uint64_t wait_hist[OCC_STATS_BINS];  //!< Nanoseconds spent in each wait.
+    uint64_t ack_hist[OCC_STATS_BINS];   //!< Nanoseconds from wait returning data until it was acknowledged.
+} occ_stats_t;
+
 /**
  * Return OCC library version.
  *
@@ -150,8 +186,19 @@ void occ_version(unsigned *major, unsigned *minor);
  * \param[in] devfile Full path to the device file for selected OCC board.
  * \param[in] type Device type, either LVDS or optical.
  * \param[out] handle Handle to be used with the rest of the API interfaces.
- * \note When occlib_sim is used, devfile should be a pair of RX and TX pipe
- *       names separated by single comma, ie. /tmp/occ.rx,/tmp/occ.tx
+ * \note With OCC_INTERFACE_SIM, devfile is a comma separated list of traffic
+ *       generator options, ie. type=mix,rate=100M,ring=16M or empty string
+ *       for defaults. See occlib_sim.c for details.
+ * \note With OCC_INTERFACE_FILE, devfile is a path to the file with captured
+ *       OCC data, optionally followed by comma separated options ring=<bytes>,
+ *       speed=max|orig|<factor>, loop and mirror, ie. /tmp/occ.dump,speed=orig
+ *       Data is replayed packet by packet, occ_data_wait() returns -EPIPE
+ *       when all data has been replayed and consumed. See occlib_file.c.
+ * \note With OCC_INTERFACE_SHM, devfile is a path to the unix socket where
+ *       publisher, ie. occ_proxy --shm, distributes data through shared
+ *       memory. Any number of processes can consume the same data, slowest
+ *       consumer with RX enabled sets the pace. occ_data_wait() returns
+ *       -ECONNRESET when publisher goes away. See occlib_shm.c.
  * \retval 0 on success
  * \retval -ENOENT No such device.
  * \retval -ENOMSG Driver/library version mismatch.
@@ -202,6 +249,35 @@ int occ_open(const char *devfile, occ_interface_type type, struct occ_handle **h
  */
 int occ_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle);
 
+/**
+ * Open a read-only monitor connection to RX data of OCC driver.
+ *
+ * Monitor receives the same data as the regular connection, directly from
+ * the DMA buffer and with its own consumer index, while the regular
+ * connection is in use. Any number of monitors can be opened. Data flow is
+ * controlled by the regular connection, monitor is not allowed to reset
+ * the board or change its configuration. occ_reset() only follows DMA buffer
+ * replaced by the driver, see occ_reset(). occ_enable_rx() subscribes the
+ * monitor, it starts with the next data received. occ_enable_old_packets()
+ * only selects packet format for occ_packet_next() and should match the
+ * regular connection.
+ *
+ * Lossless monitor must keep up with the data rate, board doesn't
+ * overwrite data until all lossless monitors acknowledged it, and stalls
+ * just like when regular connection doesn't keep up. Lossy monitor never
+ * slows down the regular connection, instead it skips data that it didn't
+ * process in time.
+ *
+ * \param[in] devfile Full path to the device file for selected OCC board.
+ * \param[in] type Device type, either LVDS or optical.
+ * \param[in] lossy Skip data rather than holding back the board.
+ * \param[out] handle Handle to be used with the rest of the API interfaces.
+ * \retval 0 on success
+ * \retval -ENOSYS Not supported by selected interface type.
+ * \retval -X Same as occ_open().
+ */
+int occ_open_monitor(const char *devfile, occ_interface_type type, bool lossy, struct occ_handle **handle);
+
 /**
  * Close the connection to OCC driver and release handle.
  *
@@ -227,6 +303,16 @@ int occ_close(struct occ_handle *handle);
  * may get stalled to prevent buffer overflow. When that happens no data
  * can be received or sent and driver state as well as board need to be recycled.
  *
+ * DMA buffer resize requested through dma_size sysfs file is applied by reset.
+ * When buffer size changes, library maps the new buffer and addresses returned
+ * by occ_data_wait() before reset become invalid. If the new buffer can't be
+ * mapped, reset fails and occ_data_wait() returns the same error until
+ * the next successful reset.
+ *
+ * Monitor connection doesn't reset the board. Driver unsubscribes monitors
+ * when it replaces the buffer and occ_data_wait() returns -ECONNRESET, then
+ * occ_reset() maps the new buffer and occ_enable_rx() subscribes again.
+ *
  * \param[in] handle Valid OCC API handle.
  * \retval 0 on success
  * \retval -x Return negative errno value.
@@ -289,6 +375,29 @@ int occ_enable_old_packets(struct occ_handle *handle, bool enable);
  */
 int occ_enable_error_packets(struct occ_handle *handle, bool enable);
 
+/**
+ * Set RX wakeup watermark.
+ *
+ * By default occ_data_wait() returns as soon as there's any data available,
+ * which can be just a single small packet. At high packet rates with no
+ * interrupt coalescing that means many wakeups each returning a tiny batch.
+ * Setting the watermark makes occ_data_wait() wait until at least given
+ * number of bytes is available. Maximum latency guarantees that data below
+ * watermark is still delivered when incoming rate is low. Latency is measured
+ * from the time data arrived, or from the last occ_data_ack() when some
+ * data is left in the buffer.
+ *
+ * Watermark setting is reset when connection is closed.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[in] bytes Minimum number of bytes to wait for, 0 disables watermark.
+ * \param[in] latency_us Maximum time to wait for watermark in microseconds, must be non-zero with watermark.
+ * \retval 0 on success
+ * \retval -EINVAL Watermark larger than DMA buffer or no latency.
+ * \retval -x Return negative errno value.
+ */
+int occ_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
+
 /**
  * Retrieve the OCC board and driver status.
  *
@@ -318,6 +427,23 @@ int occ_status(struct occ_handle *handle, occ_status_t *status, occ_status_type
  */
 int occ_send(struct occ_handle *handle, const void *data, size_t count);
 
+/**
+ * Send a batch of packets to OCC link.
+ *
+ * Same as calling occ_send() for each buffer in the vector, but much faster
+ * when sending many small packets, ie. configuring many detector modules.
+ * Packets are grouped together and each group is sent with a single TX
+ * transaction. Each buffer must be aligned to 4 bytes.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[in] iov Array of buffers to be transmitted.
+ * \param[in] iovcnt Number of buffers in iov array.
+ * \return Negative errno on error, number of bytes transmitted otherwise.
+ *         When error occurs after some packets were sent, number of bytes
+ *         sent is returned.
+ */
+int occ_sendv(struct occ_handle *handle, const struct iovec *iov, int iovcnt);
+
 /**
  * Wait until some data available and return DMA buffer address.
  *
@@ -342,6 +468,13 @@ int occ_send(struct occ_handle *handle, const void *data, size_t count);
  * not process the incomplete packet at the end or make an effort to merge with
  * the rest of the data when available.
  *
+ * When DMA buffer wraps around, the data is returned in two steps. First
+ * the data till the end of buffer. If application can't process any of it,
+ * likely because the packet is split, calling this function again without
+ * acknowledging any data will return the split packet merged in a rollover
+ * buffer. Library compiled with DMA_MIRROR maps DMA buffer twice back-to-back
+ * and always returns all available data in single contiguous block instead.
+ *
  * \param[in] handle Valid OCC API handle.
  * \param[out] address Pointer to buffer where incoming data is.
  * \param[out] count On success, the value is updated to the number of bytes available in the buffer.
@@ -350,7 +483,9 @@ int occ_send(struct occ_handle *handle, const void *data, size_t count);
  * \retval -ECONNRESET Device has been reset.
  * \retval -EOVERFLOW DMA buffer is full, device has stalled.
  * \retval -ENODATA No data is available, try again.
+ * \retval -EPIPE End of stream, file replay has no more data.
  * \retval -ETIME Timeout occured before any data was available.
+ * \retval -EAGAIN No data available in non-blocking mode, see occ_set_nonblock().
  */
 int occ_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
 
@@ -376,6 +511,156 @@ int occ_data_wait(struct occ_handle *handle, void **address, size_t *count, uint
  */
 int occ_data_ack(struct occ_handle *handle, size_t count);
 
+/**
+ * Acknowledge processed data and wait for more in a single call.
+ *
+ * Equivalent to calling occ_data_ack() followed by occ_data_wait(), but
+ * saves a system call per iteration with backends that support it. Steady
+ * state RX loop becomes a single call per batch of data:
+ *
+ *   size_t count = 0;
+ *   while (occ_data_ack_wait(handle, count, &address, &count, 1000) == 0)
+ *       count = process(address, count);
+ *
+ * When acknowledge fails, the function returns error without waiting.
+ * Otherwise the data is acknowledged even if waiting fails.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[in] ack Number of consumed bytes from previous call aligned to 8 bytes, can be 0.
+ * \param[out] address Pointer to buffer where incoming data is.
+ * \param[out] count On success, the value is updated to the number of bytes available in the buffer.
+ * \param[in] timeout Number of millisecond to wait for some data, 0 for infinity.
+ * \return 0 on success, negative errno on error, same as occ_data_ack() and occ_data_wait().
+ */
+int occ_data_ack_wait(struct occ_handle *handle, size_t ack, void **address, size_t *count, uint32_t timeout);
+
+/**
+ * Hand out incoming data to be processed and released out of order.
+ *
+ * Meant for applications that dispatch data to a pool of worker threads
+ * and decode it directly from DMA buffer. Unlike occ_data_wait(), each call
+ * returns only data that has not been claimed before, starting where the
+ * previous region ended. Regions must be released with occ_data_release()
+ * once processed, in any order and from any thread. Library tracks released
+ * regions and acknowledges data up to the lowest unfinished offset, the OCC
+ * board can't overwrite any region still in use.
+ *
+ * Producer index is always packet aligned, so is every returned region.
+ * A single thread should claim data, and occ_data_wait()/occ_data_ack()
+ * must not be mixed with it on the same handle. Releasing regions too
+ * slowly stalls the board just like not acknowledging data would.
+ *
+ * Regions may wrap around the end of DMA buffer, which only works when the
+ * buffer is mapped twice back-to-back. Library must be compiled with
+ * DMA_MIRROR and system must allow the mapping.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[out] address Pointer to buffer where claimed data is.
+ * \param[out] count On success, the value is updated to the number of bytes claimed.
+ * \param[in] timeout Number of millisecond to wait for some data, 0 for infinity.
+ * \retval 0 on success
+ * \retval -ENOSYS Not supported by this interface type.
+ * \retval -EOPNOTSUPP DMA buffer is not mirrored.
+ * \retval -ECONNRESET Device has been reset.
+ * \retval -ENOSPC DMA buffer is full, device has stalled.
+ * \retval -ETIME Timeout occured before any data was available.
+ */
+int occ_data_claim(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
+
+/**
+ * Release part of the data returned by occ_data_claim().
+ *
+ * Any 4-byte aligned sub-range of claimed regions can be released,
+ * typically one or more packets processed by a worker thread. Function is
+ * thread safe.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[in] address Start of processed data within claimed region.
+ * \param[in] count Number of processed bytes.
+ * \retval 0 on success
+ * \retval -EINVAL Data has been released already.
+ * \retval -ERANGE Data was not claimed.
+ * \return other negative errno on error.
+ */
+int occ_data_release(struct occ_handle *handle, const void *address, size_t count);
+
+/**
+ * Return descriptor that becomes readable when there's data to process.
+ *
+ * Lets application wait for OCC data together with other descriptors in
+ * poll(), select() or epoll, typically combined with non-blocking mode set
+ * by occ_set_nonblock(). What the descriptor is depends on interface type:
+ * - OCC_INTERFACE_LVDS, OCC_INTERFACE_OPTICAL - device file, readable when
+ *   data over RX watermark is available or device needs attention
+ * - OCC_INTERFACE_SOCKET - epoll descriptor watching listening socket or
+ *   connected client
+ * - OCC_INTERFACE_SIM - eventfd signalled by generator thread
+ * - OCC_INTERFACE_FILE - timerfd expiring when next packet is due
+ * - OCC_INTERFACE_SHM - epoll descriptor watching publisher doorbell and
+ *   connection
+ *
+ * Descriptor is owned by the library and must not be read or closed by
+ * application. It only signals data that occ_data_wait() hasn't returned
+ * yet, so application should call occ_data_wait() until it returns -EAGAIN
+ * before waiting on descriptor again.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \return Descriptor on success, negative errno on error.
+ */
+int occ_get_fd(struct occ_handle *handle);
+
+/**
+ * Enable or disable non-blocking mode.
+ *
+ * In non-blocking mode occ_data_wait(), occ_data_ack_wait(), occ_read() and
+ * occ_packet_next() return -EAGAIN right away instead of waiting for data,
+ * timeout is ignored. RX watermark latency is left to the application,
+ * interface types other than OCC_INTERFACE_LVDS, OCC_INTERFACE_OPTICAL and
+ * OCC_INTERFACE_SOCKET return data below watermark as soon as it's there.
+ * occ_data_claim() always blocks.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[in] enable Enable non-blocking mode when true.
+ * \return 0 on success, negative errno on error.
+ */
+int occ_set_nonblock(struct occ_handle *handle, bool enable);
+
+/**
+ * Wait for incoming data and return a batch of complete packets.
+ *
+ * A framing layer on top of occ_data_wait(). Incoming data is split into
+ * packets based on the length in packet header, using DAS 1.0 or DAS 2.0
+ * layout as selected by the last occ_enable_old_packets() call, DAS 2.0
+ * being the default. Only complete packets are returned, incomplete packet
+ * at the end of data is left for the next call. Packet split at the DMA
+ * buffer boundary is handled internally.
+ *
+ * Returned packets point directly to the DMA buffer and remain valid until
+ * occ_packet_ack() is called, which acknowledges the entire batch at once.
+ * Each successful call should be followed by occ_packet_ack(), calling this
+ * function again before that returns the same packets.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[out] packets Array to be populated with packets.
+ * \param[in,out] count Size of packets array on input, number of packets returned on output.
+ * \param[out] remain Number of bytes still buffered after the returned packets, can be NULL.
+ * \param[in] timeout Number of millisecond to wait for some data, 0 for infinity.
+ * \retval 0 on success
+ * \retval -EBADMSG Packet header is not valid, data can not be framed.
+ * \retval -ENODATA Only incomplete packet available, try again.
+ * \retval -EPIPE End of stream, file replay has no more data.
+ * \retval -X Any of the occ_data_wait() errors.
+ */
+int occ_packet_next(struct occ_handle *handle, occ_packet_t *packets, size_t *count, size_t *remain, uint32_t timeout);
+
+/**
+ * Acknowledge all packets returned by the last occ_packet_next() call.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \return 0 on success, negative errno on error.
+ */
+int occ_packet_ack(struct occ_handle *handle);
+
 /**
  * Copy incoming data from DMA buffer into application buffer.
  *
@@ -409,6 +694,75 @@ int occ_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeo
  */
 int occ_report(struct occ_handle *handle, FILE *outfile);
 
+/**
+ * Get RX path statistics of this handle.
+ *
+ * Statistics are collected all the time by occ_data_wait(), occ_data_ack(),
+ * occ_data_ack_wait(), occ_packet_next() and occ_packet_ack(). Counters are
+ * updated without locks or system calls, so the cost is a couple of clock
+ * reads from vDSO per call. Consequently snapshot taken from a different
+ * thread than the one receiving data may be slightly inconsistent.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \param[out] stats Structure to be filled with statistics.
+ * \return 0 on success, negative errno on error.
+ */
+int occ_get_stats(struct occ_handle *handle, occ_stats_t *stats);
+
+/**
+ * Clear all RX path statistics of this handle.
+ *
+ * \param[in] handle Valid OCC API handle.
+ * \return 0 on success, negative errno on error.
+ */
+int occ_reset_stats(struct occ_handle *handle);
+
+/**
+ * Shared memory publisher handle, see occ_shm_publisher_open().
+ */
+struct occ_shm_publisher;
+
+/**
+ * Create shared memory ring and start accepting OCC_INTERFACE_SHM consumers.
+ *
+ * Publisher listens on a unix socket at given path, any existing file at
+ * that path is removed. Consumers connect with occ_open() using the same
+ * path and OCC_INTERFACE_SHM type. New consumers are accepted from within
+ * occ_shm_publish().
+ *
+ * \param[in] path Unix socket path, ie. /tmp/occ0.shm
+ * \param[in] size Size of the shared ring buffer, rounded up to page size.
+ * \param[out] pub Publisher handle to be used with occ_shm_publish().
+ * \return 0 on success, negative errno on error.
+ */
+int occ_shm_publisher_open(const char *path, uint32_t size, struct occ_shm_publisher **pub);
+
+/**
+ * Copy data to shared ring and notify waiting consumers.
+ *
+ * Data must consist of complete packets only since consumers may start
+ * reading at any published boundary. Function blocks until all consumers
+ * with RX enabled made enough room in the ring. Publisher should call it
+ * with zero count periodically when there's no data, to accept new consumers.
+ *
+ * \param[in] pub Valid publisher handle.
+ * \param[in] data Data to be published.
+ * \param[in] count Number of bytes to publish, must be less than ring size.
+ * \param[in] timeout Number of millisecond to wait for room, 0 for infinity.
+ * \retval count on success
+ * \retval -ETIME Timeout expired before consumers made enough room.
+ * \retval -X Other POSIX errno values.
+ */
+int occ_shm_publish(struct occ_shm_publisher *pub, const void *data, size_t count, uint32_t timeout);
+
+/**
+ * Stop publishing, consumers will get -ECONNRESET once they process all data.
+ *
+ * \param[in] pub Valid publisher handle.
+ * \return 0 on success, negative errno on error.
+ */
+int occ_shm_publisher_close(struct occ_shm_publisher *pub);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * C++20 coroutine layer on top of OCC API.
+ *
+ * Lets a single thread drive any number of OCC handles together with other
+ * descriptors, ie. network sockets, without a thread per device and without
+ * polling with timeouts. Everything is driven by occ::executor, a small
+ * epoll loop. Coroutines wait for packets with occ::packet_stream:
+ *
+ *   occ::task process(occ::packet_stream &stream) {
+ *       while (true) {
+ *           occ::batch batch = co_await stream.next_batch(1000);
+ *           if (batch.status != 0)
+ *               break; // -EPIPE at end of replayed file
+ *           for (size_t i = 0; i < batch.count; i++)
+ *               handle(batch.packets[i]);
+ *       }
+ *   }
+ *
+ *   occ::executor ex;
+ *   occ::packet_stream stream(ex, handle);
+ *   process(stream);
+ *   ex.run();
+ *
+ * Waiting never allocates memory, all state lives in the coroutine frame
+ * and in the objects created up front. Handles are switched to non-blocking
+ * mode with occ_set_nonblock() and watched through occ_get_fd().
+ *
+ * Everything here must be used from the thread calling executor::run().
+ *
+ * \file occlib_async.hpp
+ */
+
+#ifndef OCCLIB_ASYNC_HPP_INCLUDED
+#define OCCLIB_ASYNC_HPP_INCLUDED
+
+#if __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "occlib_async.hpp requires C++20 coroutines"
+#endif
+
+#include <occlib.h>
+
+#include <cerrno>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <system_error>
+#include <time.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace occ {
+
+/**
+ * Coroutine started right away and destroyed when it returns.
+ *
+ * Nothing can wait for it, results should be passed through objects the
+ * coroutine was given. Exceptions escaping the coroutine terminate the
+ * program.
+ */
+struct task {
+    struct promise_type {
+        task get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+/**
+ * Suspended operation as seen by executor.
+ *
+ * Embedded in awaiters, linked into executor while suspended so that
+ * waiting doesn't allocate.
+ */
+struct waiter {
+    int fd = -1;                                //!< Descriptor to watch for input, -1 for none
+    uint64_t deadline = 0;                      //!< CLOCK_MONOTONIC time in ns, 0 for none
+    bool cancelled = false;
+    uint64_t seq = 0;                           //!< Order of suspending, set by executor
+    void (*notify)(waiter *w, uint32_t events) = nullptr; //!< Called with epoll events, 0 on timeout or cancel
+    waiter *prev = nullptr;
+    waiter *next = nullptr;
+};
+
+static inline uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint64_t deadline_after(uint32_t timeout_ms) {
+    return (timeout_ms == 0 ? 0 : monotonic_ns() + (uint64_t)timeout_ms * 1000000ULL);
+}
+
+/**
+ * Single threaded epoll loop resuming coroutines.
+ */
+class executor {
+    public:
+        executor()
+        : m_epfd(epoll_create1(EPOLL_CLOEXEC))
+        {
+            if (m_epfd == -1)
+                throw std::system_error(errno, std::generic_category(), "epoll_create1");
+        }
+
+        executor(const executor &) = delete;
+        executor &operator=(const executor &) = delete;
+
+        ~executor() {
+            ::close(m_epfd);
+        }
+
+        /**
+         * Resume coroutines as their descriptors become ready or time out.
+         *
+         * Returns when stop() is called or nothing is waiting anymore.
+         */
+        void run() {
+            m_stop = false;
+            while (!m_stop && m_waiters != nullptr) {
+                struct epoll_event events[MAX_EVENTS];
+                int timeout = -1;
+                uint64_t now = monotonic_ns();
+
+                for (waiter *w = m_waiters; w != nullptr; w = w->next) {
+                    if (w->cancelled) {
+                        timeout = 0;
+                        break;
+                    }
+                    if (w->deadline != 0) {
+                        int ms = (w->deadline > now ? (int)((w->deadline - now + 999999) / 1000000) : 0);
+                        if (timeout == -1 || ms < timeout)
+                            timeout = ms;
+                    }
+                }
+
+                uint64_t seq = m_seq;
+                int n = epoll_wait(m_epfd, events, MAX_EVENTS, timeout);
+                if (n == -1) {
+                    if (errno == EINTR)
+                        continue;
+                    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+                }
+
+                // Resumed coroutine may destroy waiters of the following
+                // events, only notify those still linked and suspended
+                // before epoll_wait(). Pointer is not dereferenced until
+                // it's found in the list.
+                waiter *ready[MAX_EVENTS];
+                for (int i = 0; i < n; i++)
+                    ready[i] = static_cast<waiter *>(events[i].data.ptr);
+                for (int i = 0; i < n; i++) {
+                    if (linked(ready[i], seq))
+                        ready[i]->notify(ready[i], events[i].events);
+                }
+
+                // Notifying may resume coroutines that add or remove waiters,
+                // start over after each one. Those suspended meanwhile wait
+                // for the next round, or a yielding coroutine would starve
+                // everybody else.
+                bool again = true;
+                while (again) {
+                    again = false;
+                    now = monotonic_ns();
+                    for (waiter *w = m_waiters; w != nullptr; w = w->next) {
+                        if (w->seq > seq)
+                            continue;
+                        if (w->cancelled || (w->deadline != 0 && now >= w->deadline)) {
+                            w->notify(w, 0);
+                            again = true;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * Make run() return, can be called from a coroutine.
+         */
+        void stop() {
+            m_stop = true;
+        }
+
+        /**
+         * Link waiter and arm its descriptor.
+         *
+         * \return 0 on success, negative errno on error.
+         */
+        int suspend(waiter *w) {
+            if (w->fd != -1) {
+                int ret = arm(w);
+                if (ret != 0)
+                    return ret;
+            }
+            w->cancelled = false;
+            w->seq = ++m_seq;
+            w->prev = nullptr;
+            w->next = m_waiters;
+            if (m_waiters != nullptr)
+                m_waiters->prev = w;
+            m_waiters = w;
+            return 0;
+        }
+
+        /**
+         * Watch descriptor of linked waiter again after spurious wakeup.
+         *
+         * Epoll reports each descriptor to a single waiter, another waiter
+         * already watching the same descriptor fails with -EBUSY.
+         */
+        int arm(waiter *w) {
+            for (waiter *other = m_waiters; other != nullptr; other = other->next) {
+                if (other != w && other->fd == w->fd)
+                    return -EBUSY;
+            }
+
+            struct epoll_event ev = {};
+            ev.events = EPOLLIN | EPOLLONESHOT;
+            ev.data.ptr = w;
+            if (epoll_ctl(m_epfd, EPOLL_CTL_MOD, w->fd, &ev) == 0)
+                return 0;
+            if (errno == ENOENT && epoll_ctl(m_epfd, EPOLL_CTL_ADD, w->fd, &ev) == 0)
+                return 0;
+            return -errno;
+        }
+
+        /**
+         * Unlink waiter and make sure its descriptor doesn't report anymore.
+         */
+        void complete(waiter *w, bool disarm) {
+            if (disarm && w->fd != -1) {
+                struct epoll_event ev = {};
+                ev.events = EPOLLONESHOT;
+                ev.data.ptr = w;
+                epoll_ctl(m_epfd, EPOLL_CTL_MOD, w->fd, &ev);
+            }
+            if (w->prev != nullptr)
+                w->prev->next = w->next;
+            else
+                m_waiters = w->next;
+            if (w->next != nullptr)
+                w->next->prev = w->prev;
+            w->prev = w->next = nullptr;
+        }
+
+        /**
+         * Stop watching descriptor, ie. before it's closed.
+         */
+        void forget(int fd) {
+            epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+
+    private:
+        /**
+         * Is waiter still suspended since before given sequence number.
+         */
+        bool linked(const waiter *w, uint64_t seq) const {
+            for (waiter *it = m_waiters; it != nullptr; it = it->next) {
+                if (it == w)
+                    return (it->seq <= seq);
+            }
+            return false;
+        }
+
+        static const int MAX_EVENTS = 16;
+        int m_epfd;
+        bool m_stop = false;
+        uint64_t m_seq = 0;
+        waiter *m_waiters = nullptr;            //!< All suspended operations
+};
+
+/**
+ * Awaitable suspending coroutine until descriptor is readable.
+ *
+ * Result is 0 when readable, -ETIME on timeout or negative errno.
+ */
+class readable : private waiter {
+    public:
+        readable(executor &ex, int fd, uint32_t timeout_ms = 0)
+        : m_ex(ex)
+        , m_timeout(timeout_ms)
+        {
+            this->fd = fd;
+            this->notify = &readable::on_notify;
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            m_coro = h;
+            deadline = deadline_after(m_timeout);
+            m_result = m_ex.suspend(this);
+            return (m_result == 0);
+        }
+
+        int await_resume() const noexcept {
+            return m_result;
+        }
+
+    private:
+        static void on_notify(waiter *w, uint32_t events) {
+            readable *self = static_cast<readable *>(w);
+            self->m_ex.complete(self, events == 0);
+            self->m_result = (events != 0 ? 0 : -ETIME);
+            self->m_coro.resume();
+        }
+
+        executor &m_ex;
+        uint32_t m_timeout;
+        int m_result = 0;
+        std::coroutine_handle<> m_coro;
+};
+
+/**
+ * Awaitable suspending coroutine for given time.
+ *
+ * Zero time lets other coroutines run first, a stream that always has
+ * data never suspends otherwise.
+ */
+class sleep_for : private waiter {
+    public:
+        sleep_for(executor &ex, uint32_t ms)
+        : m_ex(ex)
+        , m_ms(ms)
+        {
+            this->notify = &sleep_for::on_notify;
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            m_coro = h;
+            deadline = (m_ms == 0 ? 1 : deadline_after(m_ms));
+            return (m_ex.suspend(this) == 0);
+        }
+
+        void await_resume() const noexcept {}
+
+    private:
+        static void on_notify(waiter *w, uint32_t) {
+            sleep_for *self = static_cast<sleep_for *>(w);
+            self->m_ex.complete(self, false);
+            self->m_coro.resume();
+        }
+
+        executor &m_ex;
+        uint32_t m_ms;
+        std::coroutine_handle<> m_coro;
+};
+
+/**
+ * Batch of packets returned by packet_stream::next_batch().
+ *
+ * Packets point to DMA buffer and stay valid until next call to
+ * next_batch() or packet_stream::ack().
+ */
+struct batch {
+    int status = 0;                     //!< 0 on success, -ETIME, -ECANCELED, -EBUSY or any occ_packet_ack() or occ_packet_next() error
+    const occ_packet_t *packets = nullptr;
+    size_t count = 0;                   //!< Number of packets
+    size_t remain = 0;                  //!< Bytes buffered after the returned packets
+};
+
+/**
+ * Asynchronous stream of packets from an OCC handle.
+ *
+ * Stream doesn't own the handle, but switches it to non-blocking mode.
+ * Only one coroutine can wait on the stream at a time, next_batch() from
+ * another one completes with -EBUSY.
+ */
+class packet_stream {
+    private:
+        class batch_awaiter : private waiter {
+            public:
+                batch_awaiter(packet_stream &stream, uint32_t timeout_ms)
+                : m_stream(stream)
+                , m_timeout(timeout_ms)
+                {
+                    this->fd = stream.m_fd;
+                    this->notify = &batch_awaiter::on_notify;
+                }
+
+                bool await_ready() noexcept {
+                    // Batch and buffer belong to the coroutine already waiting
+                    if (m_stream.m_waiting != nullptr) {
+                        m_batch.status = -EBUSY;
+                        return true;
+                    }
+
+                    int ret = m_stream.ack();
+                    if (ret != 0) {
+                        // Don't touch the buffer when hardware didn't get the ack
+                        m_batch.status = ret;
+                        return true;
+                    }
+                    return poll();
+                }
+
+                bool await_suspend(std::coroutine_handle<> h) noexcept {
+                    m_coro = h;
+                    deadline = deadline_after(m_timeout);
+                    m_batch.status = m_stream.m_ex.suspend(this);
+                    if (m_batch.status != 0)
+                        return false;
+                    m_stream.m_waiting = this;
+                    return true;
+                }
+
+                batch await_resume() noexcept {
+                    return m_batch;
+                }
+
+            private:
+                friend class packet_stream;
+
+                /**
+                 * Try to get packets, return false when there's nothing yet.
+                 */
+                bool poll() noexcept {
+                    size_t count = m_stream.m_max;
+                    int ret = occ_packet_next(m_stream.m_handle, m_stream.m_packets.get(), &count, &m_batch.remain, 0);
+                    // Incomplete packet needs more data just like no data,
+                    // anything else including -EPIPE at end of stream is
+                    // final and resumes the coroutine
+                    if (ret == -EAGAIN || ret == -ENODATA)
+                        return false;
+                    m_batch.status = ret;
+                    m_batch.packets = m_stream.m_packets.get();
+                    m_batch.count = (ret == 0 ? count : 0);
+                    m_stream.m_unacked = (ret == 0);
+                    return true;
+                }
+
+                void resume(int status) {
+                    if (status != 0)
+                        m_batch.status = status;
+                    m_stream.m_waiting = nullptr;
+                    m_coro.resume();
+                }
+
+                static void on_notify(waiter *w, uint32_t events) {
+                    batch_awaiter *self = static_cast<batch_awaiter *>(w);
+                    executor &ex = self->m_stream.m_ex;
+
+                    if (events == 0) {
+                        ex.complete(self, true);
+                        self->resume(self->cancelled ? -ECANCELED : -ETIME);
+                    } else if (self->poll()) {
+                        ex.complete(self, false);
+                        self->resume(0);
+                    } else {
+                        // Descriptor woke us up but there's nothing complete yet
+                        int ret = ex.arm(self);
+                        if (ret != 0) {
+                            ex.complete(self, false);
+                            self->resume(ret);
+                        }
+                    }
+                }
+
+                packet_stream &m_stream;
+                uint32_t m_timeout;
+                batch m_batch;
+                std::coroutine_handle<> m_coro;
+        };
+
+    public:
+        /**
+         * Prepare handle for asynchronous use.
+         *
+         * \param[in] ex Executor driving the stream.
+         * \param[in] handle Valid OCC API handle, RX should be enabled.
+         * \param[in] max_packets Maximum number of packets in a batch.
+         * \throw std::system_error when handle can't be used asynchronously.
+         */
+        packet_stream(executor &ex, struct occ_handle *handle, size_t max_packets = 1024)
+        : m_ex(ex)
+        , m_handle(handle)
+        , m_max(max_packets)
+        , m_packets(new occ_packet_t[max_packets])
+        {
+            int ret = occ_set_nonblock(handle, true);
+            if (ret != 0)
+                throw std::system_error(-ret, std::generic_category(), "occ_set_nonblock");
+            m_fd = occ_get_fd(handle);
+            if (m_fd < 0)
+                throw std::system_error(-m_fd, std::generic_category(), "occ_get_fd");
+        }
+
+        packet_stream(const packet_stream &) = delete;
+        packet_stream &operator=(const packet_stream &) = delete;
+
+        ~packet_stream() {
+            if (m_waiting != nullptr)
+                m_ex.complete(m_waiting, true);
+            m_ex.forget(m_fd);
+        }
+
+        /**
+         * Acknowledge previous batch and wait for the next one.
+         *
+         * \param[in] timeout_ms Number of millisecond to wait, 0 for infinity.
+         * \return Awaitable resulting in occ::batch.
+         */
+        batch_awaiter next_batch(uint32_t timeout_ms = 0) {
+            return batch_awaiter(*this, timeout_ms);
+        }
+
+        /**
+         * Acknowledge current batch before asking for the next one.
+         *
+         * Lets OCC reuse the DMA buffer early when the packets have been
+         * processed and the coroutine has other things to wait for.
+         *
+         * \return 0 on success, negative errno on error.
+         */
+        int ack() {
+            if (!m_unacked)
+                return 0;
+            m_unacked = false;
+            return occ_packet_ack(m_handle);
+        }
+
+        /**
+         * Complete pending next_batch() with -ECANCELED.
+         *
+         * Waiting coroutine is resumed from executor::run(), not from here.
+         */
+        void cancel() {
+            if (m_waiting != nullptr)
+                m_waiting->cancelled = true;
+        }
+
+    private:
+        executor &m_ex;
+        struct occ_handle *m_handle;
+        int m_fd;
+        size_t m_max;
+        std::unique_ptr<occ_packet_t[]> m_packets;
+        bool m_unacked = false;                 //!< Last batch not acknowledged yet
+        batch_awaiter *m_waiting = nullptr;     //!< Suspended next_batch(), if any
+};
+
+} // namespace occ
+
+#endif // OCCLIB_ASYNC_HPP_INCLUDED
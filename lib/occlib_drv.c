@@ -8,17 +8,21 @@
 
 #include "occlib_hw.h"
 #include "occlib_drv.h"
+#include "occlib_trace.h"
 #include "i2c.h"
 #include <sns-occ.h>
 #include <stdio.h>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
@@ -45,23 +49,52 @@
 #define str(s) #s
 #define MIN(a,b) ((a)>(b)?(b):(a))
 
+#ifndef IOV_MAX
+#define IOV_MAX 1024                    // Linux UIO_MAXIOV, not exported without _XOPEN_SOURCE
+#endif
+
+#define CLAIM_POLL_US   100             // How often occ_data_claim() looks for new data while all is claimed
+
 struct occ_handle {
     uint32_t magic;
     int fd;
     void *dma_buf;
+    const volatile struct occ_ctrl *ctrl;       //<! RX ring state shared by driver, NULL if not available
     struct {
         void *addr;
         uint32_t len;
     } bars[3];;
-    uint32_t dma_buf_len;
+    size_t dma_buf_len;
     uint32_t dma_cons_off;
     uint8_t use_optic;
     uint8_t *last_addr;
     uint32_t last_count;                        //<! Number of bytes available returned by the last occ_data_wait()
     uint8_t *rollover_buf;
     uint32_t rollover_size;
+    bool dma_mirrored;                          //<! DMA buffer mapped twice back-to-back, no rollover needed
+    int dma_error;                              //<! Remapping resized DMA buffer failed, data can't be accessed until next reset
+    uint32_t rx_watermark;                      //<! Don't take shared page fast path below this many bytes
     bool debug_mode;
     bool rx_enabled;
+    bool nonblock;                              //<! occ_data_wait() returns -EAGAIN instead of waiting
+    uint32_t subscribe;                         //<! OCC_SUBSCRIBE_* for monitor connection, 0 otherwise
+    uint32_t overruns;                          //<! Number of times lossy monitor was moved forward by driver
+
+    // Backend part of occ_get_stats(), only touched by the RX thread
+    uint64_t stats_blocked;                     //<! Number of times occ_data_wait() went to driver to wait for data
+    uint64_t stats_blocked_ns;                  //<! Total time spent waiting in driver
+    uint64_t stats_rollovers;                   //<! Number of times split packet was copied to rollover buffer
+
+    // Out-of-order release, protected by claim_lock together with dma_cons_off
+    pthread_mutex_t claim_lock;
+    pthread_cond_t claim_cond;                  //<! Signalled when consumer offset moves forward
+    uint32_t claim_off;                         //<! Offset of first byte not yet handed out by occ_data_claim()
+    struct {
+        uint32_t off;
+        uint32_t len;
+    } *released;                                //<! Released regions beyond consumer offset, sorted and merged
+    uint32_t released_cnt;
+    uint32_t released_max;
 
 #ifdef TX_DUMP_PATH
     int tx_dump_fd;
@@ -95,6 +128,14 @@ int _occdrv_open_common(const char *devfile, int flags, struct occ_handle **hand
     memset(*handle, 0, sizeof(struct occ_handle));
     (*handle)->magic = OCC_HANDLE_MAGIC;
     (*handle)->dma_buf = MAP_FAILED;
+    (*handle)->ctrl = NULL;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(*handle)->claim_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&(*handle)->claim_lock, NULL);
 
     do {
         (*handle)->fd = open(devfile, flags);
@@ -114,7 +155,7 @@ int _occdrv_open_common(const char *devfile, int flags, struct occ_handle **hand
             break;
         }
 
-        if (flags & O_EXCL)
+        if (!(flags & O_EXCL))
             (*handle)->debug_mode = true;
 
         (*handle)->rollover_buf = malloc(ROLLOVER_BUF_SIZE);
@@ -131,6 +172,81 @@ int _occdrv_open_common(const char *devfile, int flags, struct occ_handle **hand
     return ret;
 }
 
+static void _occdrv_unmap_dma(struct occ_handle *handle) {
+    if (handle->dma_buf != MAP_FAILED)
+        munmap((void *)handle->dma_buf, handle->dma_buf_len * (handle->dma_mirrored ? 2 : 1));
+}
+
+/**
+ * Map DMA buffer of given size and replace the current mapping, if any.
+ *
+ * Current mapping and rollover buffer are left untouched on failure.
+ */
+static int _occdrv_map_dma(struct occ_handle *handle, size_t len) {
+    off_t offset = OCC_MMAP_RX_DMA * sysconf(_SC_PAGESIZE);
+    void *buf = MAP_FAILED;
+    bool mirrored = false;
+
+#ifdef DMA_MIRROR
+    // Reserve address space for two copies of the DMA buffer and map the
+    // same device memory into both halves. Data that wraps around the end
+    // of the buffer then continues in the second half and is always
+    // contiguous. Fall back to single mapping and rollover buffer when
+    // the system doesn't let us do that.
+    do {
+        uint8_t *base;
+
+        if (len > SIZE_MAX / 2)
+            break;
+
+        base = mmap(NULL, 2 * len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            break;
+
+        if (mmap(base, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED|MAP_POPULATE,
+                 handle->fd, offset) == MAP_FAILED ||
+            mmap(base + len, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED|MAP_POPULATE,
+                 handle->fd, offset) == MAP_FAILED) {
+            munmap(base, 2 * len);
+            break;
+        }
+
+        buf = base;
+        mirrored = true;
+    } while (0);
+#endif
+
+    if (buf == MAP_FAILED) {
+        buf = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, handle->fd, offset);
+        if (buf == MAP_FAILED)
+            return -errno;
+
+        // Previous mapping may have been mirrored and freed it
+        if (handle->rollover_buf == NULL) {
+            handle->rollover_buf = malloc(ROLLOVER_BUF_SIZE);
+            if (handle->rollover_buf == NULL) {
+                munmap(buf, len);
+                return -ENOMEM;
+            }
+            handle->rollover_size = ROLLOVER_BUF_SIZE;
+        }
+    }
+
+    _occdrv_unmap_dma(handle);
+    handle->dma_buf = buf;
+    handle->dma_buf_len = len;
+    handle->dma_mirrored = mirrored;
+    handle->last_addr = buf;
+
+    if (mirrored) {
+        // Not needed anymore
+        free(handle->rollover_buf);
+        handle->rollover_buf = NULL;
+        handle->rollover_size = 0;
+    }
+    return 0;
+}
+
 int occdrv_open(const char *devfile, occ_interface_type type, struct occ_handle **handle) {
     int ret = 0;
     struct occ_status info;
@@ -157,17 +273,17 @@ int occdrv_open(const char *devfile, occ_interface_type type, struct occ_handle
             ret = -ENOMSG;
             break;
         }
-        (*handle)->dma_buf_len = info.dq_size;
         (*handle)->use_optic = (type == OCC_INTERFACE_OPTICAL);
 
-        (*handle)->dma_buf = (void *)mmap(NULL, (*handle)->dma_buf_len,
-                                             PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
-                                             (*handle)->fd, 6*sysconf(_SC_PAGESIZE));
-        if ((*handle)->dma_buf == MAP_FAILED) {
-            ret = -errno;
+        ret = _occdrv_map_dma(*handle, info.dq_size);
+        if (ret != 0)
             break;
-        }
-        (*handle)->last_addr = (*handle)->dma_buf;
+
+        // Optional, occ_data_wait() falls back to asking driver every time
+        (*handle)->ctrl = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED,
+                               (*handle)->fd, OCC_MMAP_CTRL * sysconf(_SC_PAGESIZE));
+        if ((*handle)->ctrl == MAP_FAILED)
+            (*handle)->ctrl = NULL;
 
         /* Reset the card to select our preferred interface */
         ret = occdrv_reset(*handle);
@@ -192,8 +308,10 @@ int occdrv_open(const char *devfile, occ_interface_type type, struct occ_handle
 
     if (ret != 0 && *handle) {
 
-        if ((*handle)->dma_buf != MAP_FAILED)
-            munmap((void *)(*handle)->dma_buf, (*handle)->dma_buf_len);
+        _occdrv_unmap_dma(*handle);
+
+        if ((*handle)->ctrl)
+            munmap((void *)(*handle)->ctrl, sysconf(_SC_PAGESIZE));
 
         if ((*handle)->fd != -1)
             close((*handle)->fd);
@@ -209,6 +327,49 @@ int occdrv_open_debug(const char *devfile, occ_interface_type type, struct occ_h
     return _occdrv_open_common(devfile, O_RDWR, handle);
 }
 
+int occdrv_open_monitor(const char *devfile, occ_interface_type type, bool lossy, struct occ_handle **handle) {
+    int ret = 0;
+    struct occ_status info;
+
+    if (type != OCC_INTERFACE_OPTICAL && type != OCC_INTERFACE_LVDS)
+        return -EINVAL;
+
+    ret = _occdrv_open_common(devfile, O_RDWR, handle);
+    if (ret != 0)
+        return ret;
+
+    do {
+        ret = pread((*handle)->fd, &info, sizeof(info), OCC_CMD_GET_STATUS);
+        if (ret != sizeof(info)) {
+            if (ret < 0)
+                ret = -errno;
+            else
+                ret = -ENODATA;
+            break;
+        }
+        if (info.occ_ver != OCC_VER) {
+            ret = -ENOMSG;
+            break;
+        }
+        (*handle)->use_optic = (type == OCC_INTERFACE_OPTICAL);
+
+        // Monitor consumes data like exclusive connection but never resets
+        // the board. Shared page reflects exclusive consumer, don't use it.
+        ret = _occdrv_map_dma(*handle, info.dq_size);
+        if (ret != 0)
+            break;
+        (*handle)->debug_mode = false;
+        (*handle)->subscribe = (lossy ? OCC_SUBSCRIBE_LOSSY : OCC_SUBSCRIBE_REQUIRED);
+        return 0;
+    } while (0);
+
+    close((*handle)->fd);
+    free((*handle)->rollover_buf);
+    free(*handle);
+    *handle = NULL;
+    return ret;
+}
+
 int occdrv_close(struct occ_handle *handle) {
     int ret = 0;
 
@@ -223,15 +384,22 @@ int occdrv_close(struct occ_handle *handle) {
         close(handle->rx_dump_fd);
 #endif
 
-        if (munmap((void *)handle->dma_buf, handle->dma_buf_len) != 0)
+        if (munmap((void *)handle->dma_buf, handle->dma_buf_len * (handle->dma_mirrored ? 2 : 1)) != 0)
             ret = -1 * errno;
 
+        if (handle->ctrl && munmap((void *)handle->ctrl, sysconf(_SC_PAGESIZE)) != 0)
+            ret = -errno;
+
         if (close(handle->fd) != 0)
             ret = -errno;
 
         if (handle->rollover_buf)
             free(handle->rollover_buf);
 
+        free(handle->released);
+        pthread_mutex_destroy(&handle->claim_lock);
+        pthread_cond_destroy(&handle->claim_cond);
+
         free(handle);
     }
 
@@ -244,6 +412,17 @@ int occdrv_enable_rx(struct occ_handle *handle, bool enable) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
+    if (handle->subscribe != 0) {
+        // Subscribe to RX ring, driver starts us at the current producer index
+        val = (enable ? handle->subscribe : 0);
+        if (pwrite(handle->fd, &val, sizeof(val), OCC_CMD_SUBSCRIBE) < 0)
+            return -errno;
+
+        handle->rx_enabled = enable;
+        handle->last_count = 0;
+        return 0;
+    }
+
     if (enable != handle->rx_enabled) {
 
         if (enable) {
@@ -269,6 +448,10 @@ int occdrv_enable_old_packets(struct occ_handle *handle, bool enable) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
+    // Exclusive connection configures the board, monitor only needs to agree
+    if (handle->subscribe != 0)
+        return 0;
+
     if ((ret = occdrv_enable_rx(handle, false)) != 0)
         return ret;
 
@@ -290,6 +473,19 @@ int occdrv_enable_error_packets(struct occ_handle *handle, bool enable) {
     return 0;
 }
 
+int occdrv_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us) {
+    uint32_t val[2] = { bytes, latency_us };
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (pwrite(handle->fd, val, sizeof(val), OCC_CMD_RX_WATERMARK) < 0)
+        return -errno;
+
+    handle->rx_watermark = bytes;
+    return 0;
+}
+
 int occdrv_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type) {
     struct occ_status info;
     int ret;
@@ -403,18 +599,52 @@ int occdrv_reset(struct occ_handle *handle) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    interface = (handle->use_optic == 0) ? OCC_SELECT_LVDS : OCC_SELECT_OPTICAL;
-    if (pwrite(handle->fd, &interface, sizeof(interface), OCC_CMD_RESET) != sizeof(interface))
-        return -errno;
+    // Monitor must not disturb the exclusive connection. It only drops
+    // its subscription, which also acknowledges buffer replaced by driver,
+    // and follows new buffer size below.
+    if (handle->subscribe != 0) {
+        uint32_t val = 0;
+        if (pwrite(handle->fd, &val, sizeof(val), OCC_CMD_SUBSCRIBE) < 0) {
+            int ret = -errno;
+            OCC_TRACE1(reset, ret);
+            return ret;
+        }
+    } else {
+        interface = (handle->use_optic == 0) ? OCC_SELECT_LVDS : OCC_SELECT_OPTICAL;
+        if (pwrite(handle->fd, &interface, sizeof(interface), OCC_CMD_RESET) != sizeof(interface)) {
+            int ret = -errno;
+            OCC_TRACE1(reset, ret);
+            return ret;
+        }
+    }
 
     // Read status to clear the reset-occurred flag
-    if (pread(handle->fd, &info, sizeof(info), OCC_CMD_GET_STATUS) < 0)
-        return -errno;
+    if (pread(handle->fd, &info, sizeof(info), OCC_CMD_GET_STATUS) < 0) {
+        int ret = -errno;
+        OCC_TRACE1(reset, ret);
+        return ret;
+    }
     // XXX verify the returned status?
 
+    // Driver swaps in resized DMA buffer on reset. Old mapping is kept
+    // when the new one fails, but driver doesn't write there anymore.
+    if (info.dq_size != handle->dma_buf_len)
+        handle->dma_error = _occdrv_map_dma(handle, info.dq_size);
+    else
+        handle->dma_error = 0;
+    if (handle->dma_error != 0) {
+        OCC_TRACE1(reset, handle->dma_error);
+        return handle->dma_error;
+    }
+
+    pthread_mutex_lock(&handle->claim_lock);
     handle->dma_cons_off = 0;
+    handle->claim_off = 0;
+    handle->released_cnt = 0;
+    pthread_mutex_unlock(&handle->claim_lock);
     handle->rx_enabled = false;
 
+    OCC_TRACE1(reset, 0);
     return 0;
 }
 
@@ -429,6 +659,7 @@ int occdrv_send(struct occ_handle *handle, const void *data, size_t count) {
     int ret = pwrite(handle->fd, (const void *)data, count, OCC_CMD_TX);
     if (ret < 0)
         ret = -errno;
+    OCC_TRACE2(send, ret, count);
 
 #ifdef TX_DUMP_PATH
     write(handle->tx_dump_fd, data, count);
@@ -437,6 +668,41 @@ int occdrv_send(struct occ_handle *handle, const void *data, size_t count) {
     return ret;
 }
 
+int occdrv_sendv(struct occ_handle *handle, const struct iovec *iov, int iovcnt) {
+    int sent = 0;
+    int i = 0;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    for (int j = 0; j < iovcnt; j++) {
+        if (_occdrv_data_align(iov[j].iov_len) != iov[j].iov_len)
+            return -EINVAL;
+    }
+
+    // Driver sends all segments of a gathering write as one message,
+    // group as many packets as fit in the TX FIFO.
+    while (i < iovcnt) {
+        size_t len = iov[i].iov_len;
+        int n = 1;
+        while (i + n < iovcnt && n < IOV_MAX && len + iov[i + n].iov_len < OCC_MAX_TX_LEN)
+            len += iov[i + n++].iov_len;
+
+        int ret = pwritev(handle->fd, &iov[i], n, OCC_CMD_TX);
+        if (ret < 0)
+            return (sent > 0 ? sent : -errno);
+
+#ifdef TX_DUMP_PATH
+        writev(handle->tx_dump_fd, &iov[i], n);
+#endif
+
+        sent += ret;
+        i += n;
+    }
+
+    return sent;
+}
+
 static bool _timeout_expired(uint32_t *timeout, struct timespec *t1, struct timespec *t2) {
     if (t2->tv_sec < t1->tv_sec)
         *timeout = 0;
@@ -455,41 +721,112 @@ static bool _timeout_expired(uint32_t *timeout, struct timespec *t1, struct time
     return (*timeout == 0);
 }
 
-int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+/**
+ * Read RX ring state from the page shared by driver.
+ *
+ * Returns true when there's some data in the queue over the watermark and
+ * no reset pending, in which case info is populated just like OCC_CMD_RX
+ * read would do. Everything else is left for the driver to decide.
+ */
+static bool _occdrv_ctrl_read(struct occ_handle *handle, uint32_t info[2]) {
+    const volatile struct occ_ctrl *ctrl = handle->ctrl;
+    uint32_t generation, dq_prod, dq_cons, status;
+
+    do {
+        generation = ctrl->generation;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        dq_prod = ctrl->dq_prod;
+        dq_cons = ctrl->dq_cons;
+        status = ctrl->status;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((generation & 0x1) || generation != ctrl->generation);
+
+    if (dq_prod == dq_cons || (status & OCC_RESET_OCCURRED))
+        return false;
+
+    if (handle->rx_watermark > 0 &&
+        (handle->dma_buf_len + dq_prod - dq_cons) % handle->dma_buf_len < handle->rx_watermark)
+        return false;
+
+    info[0] = dq_prod;
+    info[1] = status | OCC_RX_MSG;
+    return true;
+}
+
+static void _occdrv_stats_blocked(struct occ_handle *handle, const struct timespec *t1) {
+    struct timespec t2;
+    clock_gettime(CLOCK_MONOTONIC, &t2);
+    int64_t ns = (int64_t)(t2.tv_sec - t1->tv_sec) * 1000000000LL + (t2.tv_nsec - t1->tv_nsec);
+    handle->stats_blocked++;
+    handle->stats_blocked_ns += ns;
+    OCC_TRACE1(data_wait_blocked, ns);
+}
+
+static int _occdrv_data_wait(struct occ_handle *handle, uint32_t ack, void **address, size_t *count, uint32_t timeout) {
     int ret;
-    uint32_t info[2];
+    uint32_t info[3];
+    size_t info_len = (handle->subscribe ? 3 : 2) * sizeof(uint32_t);
     struct timespec t1,t2;
     void *last_addr = NULL;
 
-    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
-        return -EINVAL;
-
     *address = handle->dma_buf;
     *count = 0;
 
+    if (handle->dma_error != 0)
+        return handle->dma_error;
+
     // Block until some data is available
     while (1) {
-        if (timeout > 0) {
-            struct pollfd pollfd;
-            pollfd.fd = handle->fd;
-            pollfd.events = POLLIN;
+        if (ack > 0) {
+            // Let driver advance consumer index and wait for data in one go
+            info[0] = ack;
+            info[1] = timeout;
             clock_gettime(CLOCK_MONOTONIC, &t1);
-            ret = poll(&pollfd, 1, timeout);
+            ret = pread(handle->fd, info, info_len, OCC_CMD_RX_ACK);
+            _occdrv_stats_blocked(handle, &t1);
+            if (ret < 0)
+                return -errno;
+
+            handle->dma_cons_off = (handle->dma_cons_off + ack) % handle->dma_buf_len;
+            ack = 0;
+        } else if (handle->ctrl == NULL || !_occdrv_ctrl_read(handle, info)) {
+            // Fast path above avoids system call, only go to driver when there's no data
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (timeout > 0 || handle->nonblock) {
+                struct pollfd pollfd;
+                pollfd.fd = handle->fd;
+                pollfd.events = POLLIN;
+                ret = poll(&pollfd, 1, handle->nonblock ? 0 : timeout);
+                if (!handle->nonblock)
+                    _occdrv_stats_blocked(handle, &t1);
+                if (ret < 0)
+                    return -errno;
+                else if (ret == 0)
+                    return (handle->nonblock ? -EAGAIN : -ETIME);
+                else if (pollfd.revents & POLLERR)
+                    return -ECONNRESET;
+                else if (handle->nonblock && !(pollfd.revents & (POLLIN | POLLHUP)))
+                    return -EAGAIN;
+                else if (!handle->nonblock && !(pollfd.revents & POLLIN))
+                    return -ETIME;
+                // Ignore POLLHUP, instead do a read which will give us more
+                // information about the error.
+                ret = pread(handle->fd, info, info_len, OCC_CMD_RX);
+            } else {
+                // Driver blocks until there's data
+                ret = pread(handle->fd, info, info_len, OCC_CMD_RX);
+                _occdrv_stats_blocked(handle, &t1);
+            }
             if (ret < 0)
                 return -errno;
-            else if (ret == 0)
-                return -ETIME;
-            else if (pollfd.revents & POLLERR)
-                return -ECONNRESET;
-            else if ( !(pollfd.revents & POLLIN) )
-                return -ETIME;
-            // Ignore POLLHUP, instead do a read which will give us more
-            // information about the error.
         }
 
-        ret = pread(handle->fd, info, sizeof(info), OCC_CMD_RX);
-        if (ret < 0)
-            return -errno;
+        if (handle->subscribe) {
+            // Lossy monitor may have been moved forward, follow driver
+            if (info[1] & OCC_RX_OVERRUN)
+                handle->overruns++;
+            handle->dma_cons_off = info[2];
+        }
 
         if (!(info[1] & OCC_RX_MSG)) {
             if (info[1] & OCC_RESET_OCCURRED)
@@ -498,6 +835,8 @@ int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, u
                 return -ENOSPC;
             if (info[1] & OCC_FIFO_OVERFLOW)
                 return -EOVERFLOW;
+            if (handle->nonblock)
+                return -EAGAIN;
             if (timeout > 0) {
                 clock_gettime(CLOCK_MONOTONIC, &t2);
                 if (_timeout_expired(&timeout, &t1, &t2))
@@ -529,8 +868,11 @@ int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, u
             *count = handle->dma_buf_len - handle->dma_cons_off;
             last_addr = *address;
 
-            // Client is telling us he can't process any data, probably packet is split.
-            if (handle->last_addr == *address && *count < handle->rollover_size) {
+            if (handle->dma_mirrored) {
+                // Second mapping follows the first one, data is contiguous
+                *count += dma_prod_off;
+            } else if (handle->last_addr == *address && *count < handle->rollover_size) {
+                // Client is telling us he can't process any data, probably packet is split.
                 uint32_t headlen = *count;
                 uint32_t taillen = MIN(handle->rollover_size - *count, dma_prod_off);
 
@@ -538,6 +880,8 @@ int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, u
                 memcpy(&handle->rollover_buf[headlen], handle->dma_buf, taillen);
                 *address = handle->rollover_buf;
                 *count = headlen + taillen;
+                handle->stats_rollovers++;
+                OCC_TRACE3(rollover, handle->dma_cons_off, headlen, taillen);
             }
         }
 
@@ -550,6 +894,8 @@ int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, u
         if (*count != 0)
             break;
 
+        if (handle->nonblock)
+            return -EAGAIN;
         if (timeout != 0) {
             clock_gettime(CLOCK_MONOTONIC, &t2);
             if (_timeout_expired(&timeout, &t1, &t2))
@@ -573,6 +919,18 @@ int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, u
     return 0;
 }
 
+int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    OCC_TRACE3(data_wait_enter, handle->dma_cons_off, 0, timeout);
+    ret = _occdrv_data_wait(handle, 0, address, count, timeout);
+    OCC_TRACE3(data_wait_return, ret, handle->dma_cons_off, *count);
+    return ret;
+}
+
 int occdrv_data_ack(struct occ_handle *handle, size_t count) {
 
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || _occdrv_data_align(count) != count)
@@ -585,13 +943,252 @@ int occdrv_data_ack(struct occ_handle *handle, size_t count) {
         count = handle->last_count;
 
     uint32_t length = count;
-    if (pwrite(handle->fd, &length, sizeof(length), OCC_CMD_ADVANCE_DQ) < 0)
-        return -errno;
+    if (pwrite(handle->fd, &length, sizeof(length), OCC_CMD_ADVANCE_DQ) < 0) {
+        int ret = -errno;
+        OCC_TRACE3(data_ack, ret, handle->dma_cons_off, count);
+        return ret;
+    }
 
+    OCC_TRACE3(data_ack, 0, handle->dma_cons_off, count);
     handle->dma_cons_off = (handle->dma_cons_off + count) % handle->dma_buf_len;
     return 0;
 }
 
+int occdrv_data_ack_wait(struct occ_handle *handle, size_t ack, void **address, size_t *count, uint32_t timeout) {
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || _occdrv_data_align(ack) != ack)
+        return -EINVAL;
+
+    if (ack > handle->last_count)
+        ack = handle->last_count;
+
+    // Combined call blocks in driver, acknowledge separately instead
+    if (handle->nonblock && ack > 0) {
+        ret = occdrv_data_ack(handle, ack);
+        if (ret != 0)
+            return ret;
+        ack = 0;
+    }
+
+    OCC_TRACE3(data_wait_enter, handle->dma_cons_off, ack, timeout);
+    ret = _occdrv_data_wait(handle, ack, address, count, timeout);
+    OCC_TRACE3(data_wait_return, ret, handle->dma_cons_off, *count);
+    return ret;
+}
+
+int occdrv_get_fd(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Driver signals POLLIN when data over watermark is available
+    return handle->fd;
+}
+
+int occdrv_set_nonblock(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    handle->nonblock = enable;
+    return 0;
+}
+
+int occdrv_data_claim(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    uint32_t info[2];
+    uint32_t claim_off, pending, avail;
+    uint32_t remain = timeout;
+    struct timespec t1, t2;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || handle->subscribe != 0)
+        return -EINVAL;
+
+    // Regions stay in use while later ones are handed out, a single
+    // rollover buffer can't back them. Needs mirrored DMA mapping.
+    if (!handle->dma_mirrored)
+        return -EOPNOTSUPP;
+
+    if (handle->dma_error != 0)
+        return handle->dma_error;
+
+    *address = handle->dma_buf;
+    *count = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    while (1) {
+        // Only this thread moves claim_off, but releases move consumer offset
+        pthread_mutex_lock(&handle->claim_lock);
+        claim_off = handle->claim_off;
+        pending = (handle->dma_buf_len + claim_off - handle->dma_cons_off) % handle->dma_buf_len;
+        pthread_mutex_unlock(&handle->claim_lock);
+
+        if (handle->ctrl == NULL || !_occdrv_ctrl_read(handle, info)) {
+            // Driver returns right away while anything is unacknowledged,
+            // let it block only when everything has been released.
+            if (pending == 0 && timeout > 0) {
+                struct pollfd pollfd;
+                pollfd.fd = handle->fd;
+                pollfd.events = POLLIN;
+                int ret = poll(&pollfd, 1, remain);
+                if (ret < 0)
+                    return -errno;
+                else if (ret == 0)
+                    return -ETIME;
+                else if (pollfd.revents & POLLERR)
+                    return -ECONNRESET;
+                else if ( !(pollfd.revents & POLLIN) )
+                    return -ETIME;
+            }
+
+            if (pread(handle->fd, info, sizeof(info), OCC_CMD_RX) < 0)
+                return -errno;
+        }
+
+        if (!(info[1] & OCC_RX_MSG)) {
+            if (info[1] & OCC_RESET_OCCURRED)
+                return -ECONNRESET;
+            if (info[1] & OCC_DMA_STALLED)
+                return -ENOSPC;
+            if (info[1] & OCC_FIFO_OVERFLOW)
+                return -EOVERFLOW;
+            avail = 0;
+        } else {
+            // Producer index is packet aligned, so is every region handed out
+            avail = (handle->dma_buf_len + info[0] - claim_off) % handle->dma_buf_len;
+            avail &= ~3;
+        }
+
+        if (avail > 0) {
+            pthread_mutex_lock(&handle->claim_lock);
+            handle->claim_off = (claim_off + avail) % handle->dma_buf_len;
+            pthread_mutex_unlock(&handle->claim_lock);
+
+            *address = handle->dma_buf + claim_off;
+            *count = avail;
+            return 0;
+        }
+
+        if (timeout > 0) {
+            remain = timeout;
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            if (_timeout_expired(&remain, &t1, &t2))
+                return -ETIME;
+        }
+
+        if (pending > 0) {
+            // All data handed out and driver won't block for us, wait for
+            // releases but keep an eye on the producer too.
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_nsec += CLAIM_POLL_US * 1000;
+            if (ts.tv_nsec >= 1000000000) {
+                ts.tv_sec++;
+                ts.tv_nsec -= 1000000000;
+            }
+            pthread_mutex_lock(&handle->claim_lock);
+            if (handle->dma_cons_off == (handle->dma_buf_len + claim_off - pending) % handle->dma_buf_len)
+                pthread_cond_timedwait(&handle->claim_cond, &handle->claim_lock, &ts);
+            pthread_mutex_unlock(&handle->claim_lock);
+        }
+    }
+}
+
+int occdrv_data_release(struct occ_handle *handle, const void *address, size_t count) {
+    const uint8_t *addr = address;
+    uint32_t off, start, pending, i;
+    int ret = 0;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || handle->subscribe != 0 || _occdrv_data_align(count) != count)
+        return -EINVAL;
+
+    if (!handle->dma_mirrored)
+        return -EOPNOTSUPP;
+
+    if (count == 0)
+        return 0;
+
+    if (addr < (uint8_t *)handle->dma_buf || addr >= (uint8_t *)handle->dma_buf + 2 * handle->dma_buf_len)
+        return -ERANGE;
+    off = (addr - (uint8_t *)handle->dma_buf) % handle->dma_buf_len;
+
+#define DISTANCE(o) ((handle->dma_buf_len + (o) - handle->dma_cons_off) % handle->dma_buf_len)
+
+    pthread_mutex_lock(&handle->claim_lock);
+    do {
+        // Must be within what was handed out and not yet acknowledged
+        start = DISTANCE(off);
+        pending = DISTANCE(handle->claim_off);
+        if (start + count > pending) {
+            ret = -ERANGE;
+            break;
+        }
+
+        // Find the place to keep order, reject releasing anything twice
+        for (i = 0; i < handle->released_cnt; i++) {
+            if (DISTANCE(handle->released[i].off) > start)
+                break;
+        }
+        if (i > 0 && DISTANCE(handle->released[i-1].off) + handle->released[i-1].len > start) {
+            ret = -EINVAL;
+            break;
+        }
+        if (i < handle->released_cnt && start + count > DISTANCE(handle->released[i].off)) {
+            ret = -EINVAL;
+            break;
+        }
+
+        if (i > 0 && DISTANCE(handle->released[i-1].off) + handle->released[i-1].len == start) {
+            // Extend previous region, maybe it now touches the next one too
+            i--;
+            handle->released[i].len += count;
+        } else if (i < handle->released_cnt && start + count == DISTANCE(handle->released[i].off)) {
+            handle->released[i].off = off;
+            handle->released[i].len += count;
+        } else {
+            if (handle->released_cnt == handle->released_max) {
+                uint32_t max = (handle->released_max ? 2 * handle->released_max : 64);
+                void *tmp = realloc(handle->released, max * sizeof(handle->released[0]));
+                if (tmp == NULL) {
+                    ret = -ENOMEM;
+                    break;
+                }
+                handle->released = tmp;
+                handle->released_max = max;
+            }
+            memmove(&handle->released[i+1], &handle->released[i], (handle->released_cnt - i) * sizeof(handle->released[0]));
+            handle->released[i].off = off;
+            handle->released[i].len = count;
+            handle->released_cnt++;
+        }
+        if (i + 1 < handle->released_cnt &&
+            DISTANCE(handle->released[i].off) + handle->released[i].len == DISTANCE(handle->released[i+1].off)) {
+            handle->released[i].len += handle->released[i+1].len;
+            handle->released_cnt--;
+            memmove(&handle->released[i+1], &handle->released[i+2], (handle->released_cnt - i - 1) * sizeof(handle->released[0]));
+        }
+
+        // Lowest unfinished offset moves only when the front is released
+        if (handle->released_cnt > 0 && handle->released[0].off == handle->dma_cons_off) {
+            uint32_t length = handle->released[0].len;
+            if (pwrite(handle->fd, &length, sizeof(length), OCC_CMD_ADVANCE_DQ) < 0) {
+                ret = -errno;
+                break;
+            }
+
+            handle->dma_cons_off = (handle->dma_cons_off + length) % handle->dma_buf_len;
+            handle->released_cnt--;
+            memmove(&handle->released[0], &handle->released[1], handle->released_cnt * sizeof(handle->released[0]));
+            pthread_cond_broadcast(&handle->claim_cond);
+        }
+    } while (0);
+    pthread_mutex_unlock(&handle->claim_lock);
+
+#undef DISTANCE
+
+    return ret;
+}
+
 int occdrv_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout) {
     void *address;
     size_t avail;
@@ -706,8 +1303,11 @@ int occdrv_report(struct occ_handle *handle, FILE *outfile) {
             }
         }
         FILE_WRITE("\n");
+        if (handle->subscribe == OCC_SUBSCRIBE_LOSSY) {
+            FILE_WRITE("Monitor overruns: %u\n\n", handle->overruns);
+        }
         FILE_WRITE("Last data processed:\n");
-        if (handle->last_addr == handle->rollover_buf) {
+        if (handle->rollover_buf && handle->last_addr == handle->rollover_buf) {
             FILE_WRITE("  rollover buffer\n");
         } else {
             uint32_t offset = (void*)handle->last_addr - handle->dma_buf;
@@ -726,6 +1326,10 @@ int occdrv_report(struct occ_handle *handle, FILE *outfile) {
             FILE_WRITE(" 0x%08X", ((uint32_t*)handle->dma_buf)[i/4]);
         }
         FILE_WRITE("\n\n");
+        if (handle->dma_mirrored) {
+            FILE_WRITE("DMA buffer mirrored, no rollover buffer\n");
+            break;
+        }
         FILE_WRITE("Rollover buffer:\n");
         for (i = 0; i < handle->rollover_size; i+=4) {
             if ((i%16) == 0) {
@@ -742,3 +1346,23 @@ int occdrv_report(struct occ_handle *handle, FILE *outfile) {
     return ret;
 }
 
+
+int occdrv_get_stats(struct occ_handle *handle, occ_stats_t *stats) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    stats->blocked = handle->stats_blocked;
+    stats->blocked_ns = handle->stats_blocked_ns;
+    stats->rollovers = handle->stats_rollovers;
+    return 0;
+}
+
+int occdrv_reset_stats(struct occ_handle *handle) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    handle->stats_blocked = 0;
+    handle->stats_blocked_ns = 0;
+    handle->stats_rollovers = 0;
+    return 0;
+}
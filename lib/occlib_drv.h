@@ -18,16 +18,26 @@
 
 int occdrv_open(const char *devfile, occ_interface_type type, struct occ_handle **handle);
 int occdrv_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occdrv_open_monitor(const char *devfile, occ_interface_type type, bool lossy, struct occ_handle **handle);
 int occdrv_close(struct occ_handle *handle);
 int occdrv_enable_rx(struct occ_handle *handle, bool enable);
 int occdrv_enable_old_packets(struct occ_handle *handle, bool enable);
 int occdrv_enable_error_packets(struct occ_handle *handle, bool enable);
+int occdrv_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
 int occdrv_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type);
 int occdrv_reset(struct occ_handle *handle);
 int occdrv_send(struct occ_handle *handle, const void *data, size_t count);
+int occdrv_sendv(struct occ_handle *handle, const struct iovec *iov, int iovcnt);
 int occdrv_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
 int occdrv_data_ack(struct occ_handle *handle, size_t count);
+int occdrv_data_ack_wait(struct occ_handle *handle, size_t ack, void **address, size_t *count, uint32_t timeout);
+int occdrv_data_claim(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
+int occdrv_data_release(struct occ_handle *handle, const void *address, size_t count);
+int occdrv_get_fd(struct occ_handle *handle);
+int occdrv_set_nonblock(struct occ_handle *handle, bool enable);
 int occdrv_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout);
 int occdrv_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count);
 int occdrv_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count);
 int occdrv_report(struct occ_handle *handle, FILE *outfile);
+int occdrv_get_stats(struct occ_handle *handle, occ_stats_t *stats);
+int occdrv_reset_stats(struct occ_handle *handle);
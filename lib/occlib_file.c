@@ -0,0 +1,522 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * OCC API file replay implementation.
+ *
+ * Serves previously captured raw OCC data through regular OCC API, so that
+ * applications can be tested and benchmarked without OCC hardware. Capture
+ * file is any file containing back-to-back OCC packets, ie. RX_DUMP_PATH
+ * dump or proxy output. Data is copied packet by packet into an in-process
+ * ring with the same semantics as the DMA buffer, including wrap-around and
+ * packets split at the end of the buffer.
+ *
+ * devfile parameter to occ_open() is the path to the capture file optionally
+ * followed by comma separated options:
+ * - ring=<bytes>       size of the ring buffer, default 2MB, k, M and G suffix accepted
+ * - speed=max          copy data as fast as application consumes it (default)
+ * - speed=orig         replay at original rate based on DAS data packet timestamps
+ * - speed=<N>          replay N times faster than original rate
+ * - loop               start from the beginning when end of file is reached
+ * - mirror             map ring twice to always return contiguous data
+ * Example: /tmp/occ.dump,ring=16M,speed=orig
+ *
+ * Data sent through occ_send() is discarded. occ_reset() starts replay
+ * from the beginning of file. Once all data has been replayed and
+ * consumed without loop option, occ_data_wait() returns -EPIPE.
+ */
+
+#include "occlib_hw.h"
+#include "occlib_file.h"
+#include "occlib_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#define OCC_HANDLE_MAGIC        0x0cc0cc
+#define DEFAULT_RING_SIZE       (2 * 1024 * 1024)
+#define DAS1_HEADER_SIZE        24
+#define DAS2_HEADER_SIZE        8
+#define DAS2_TYPE_DAS_DATA      0x7
+#define MAX_SLEEP_NS            10000000    // Check timeout at least every 10ms
+
+struct occ_handle {
+    uint32_t magic;
+    const uint8_t *file_buf;    //!< Capture file mapped to memory
+    size_t file_len;
+    size_t file_off;            //!< Next packet to be copied to ring
+    struct occring ring;
+    bool rx_enabled;
+    bool old_packets;
+    bool loop;
+    double speed;               //!< Replay speed relative to original, 0 for as fast as possible
+    bool paced;                 //!< Pace base below is valid
+    uint64_t pace_data_ns;      //!< Timestamp of the first packet replayed
+    uint64_t pace_wall_ns;      //!< Time when first packet was replayed
+    uint32_t rx_watermark;
+    uint32_t rx_latency_us;
+    uint64_t replayed;          //!< Total number of bytes replayed
+    bool nonblock;              //!< occfile_data_wait() returns -EAGAIN instead of sleeping
+    int timer_fd;               //!< Expires when next packet is due, -1 until requested
+};
+
+static uint64_t _occfile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int _occfile_parse_options(struct occ_handle *handle, char *options, uint32_t *ring_size, bool *mirror) {
+    char *saveptr = NULL;
+
+    for (char *opt = strtok_r(options, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr)) {
+        if (strncmp(opt, "ring=", 5) == 0) {
+            if (occring_parse_size(opt + 5, ring_size) != 0)
+                return -EINVAL;
+        } else if (strcmp(opt, "speed=max") == 0) {
+            handle->speed = 0.0;
+        } else if (strcmp(opt, "speed=orig") == 0) {
+            handle->speed = 1.0;
+        } else if (strncmp(opt, "speed=", 6) == 0) {
+            char *end;
+            handle->speed = strtod(opt + 6, &end);
+            if (end == opt + 6 || *end != '\0' || handle->speed <= 0.0)
+                return -EINVAL;
+        } else if (strcmp(opt, "loop") == 0) {
+            handle->loop = true;
+        } else if (strcmp(opt, "mirror") == 0) {
+            *mirror = true;
+        } else {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Return length of the packet at current file offset.
+ *
+ * Corrupted length fields are not fixed, but replayed the same way as the
+ * hardware would forward them. Invalid packet advances by single dword
+ * so that replay doesn't get stuck.
+ */
+static uint32_t _occfile_packet_len(struct occ_handle *handle, uint64_t *timestamp) {
+    const uint32_t *header = (const uint32_t *)(handle->file_buf + handle->file_off);
+    size_t avail = handle->file_len - handle->file_off;
+    uint32_t len;
+
+    *timestamp = 0;
+
+    if (handle->old_packets) {
+        if (avail < DAS1_HEADER_SIZE)
+            return avail & ~3;
+        len = DAS1_HEADER_SIZE + header[3];
+    } else {
+        if (avail < DAS2_HEADER_SIZE)
+            return avail & ~3;
+        len = header[1];
+        if (((header[0] >> 20) & 0xFF) == DAS2_TYPE_DAS_DATA && len >= 20 && len <= avail)
+            *timestamp = (uint64_t)header[3] * 1000000000ULL + header[4];
+    }
+
+    if (len < (handle->old_packets ? DAS1_HEADER_SIZE : DAS2_HEADER_SIZE) ||
+        len % 4 != 0 || len > avail || len >= handle->ring.size)
+        return 4;
+
+    return len;
+}
+
+/**
+ * Copy as many packets to ring as allowed by room and pacing.
+ *
+ * \return Number of nanoseconds until next packet is due, 0 when it's
+ *         either waiting for room in the ring or there's nothing left.
+ */
+static uint64_t _occfile_produce(struct occ_handle *handle) {
+    while (true) {
+        uint64_t timestamp;
+        uint32_t len;
+
+        if (handle->file_off + 4 > handle->file_len) {
+            if (!handle->loop || handle->file_len < 4)
+                return 0;
+            handle->file_off = 0;
+            handle->paced = false;
+        }
+
+        len = _occfile_packet_len(handle, &timestamp);
+        if (len == 0)
+            return 0;
+
+        if (handle->speed > 0.0 && timestamp != 0) {
+            uint64_t now = _occfile_now();
+            if (!handle->paced || timestamp < handle->pace_data_ns) {
+                handle->paced = true;
+                handle->pace_data_ns = timestamp;
+                handle->pace_wall_ns = now;
+            } else {
+                uint64_t due = handle->pace_wall_ns + (timestamp - handle->pace_data_ns) / handle->speed;
+                if (due > now)
+                    return due - now;
+            }
+        }
+
+        if (occring_push(&handle->ring, handle->file_buf + handle->file_off, len) != 0)
+            return 0;
+
+        handle->file_off += len;
+        handle->replayed += len;
+    }
+}
+
+int occfile_open(const char *devfile, occ_interface_type type, struct occ_handle **handle) {
+    uint32_t ring_size = DEFAULT_RING_SIZE;
+    bool mirror = false;
+    struct stat st;
+    char *path;
+    char *options;
+    int fd = -1;
+    int ret = 0;
+
+    if (type != OCC_INTERFACE_FILE)
+        return -EINVAL;
+
+    *handle = malloc(sizeof(struct occ_handle));
+    if (*handle == NULL)
+        return -ENOMEM;
+
+    memset(*handle, 0, sizeof(struct occ_handle));
+    (*handle)->magic = OCC_HANDLE_MAGIC;
+    (*handle)->file_buf = MAP_FAILED;
+    (*handle)->timer_fd = -1;
+
+    path = strdup(devfile);
+    if (path == NULL) {
+        free(*handle);
+        *handle = NULL;
+        return -ENOMEM;
+    }
+
+    do {
+        options = strchr(path, ',');
+        if (options != NULL) {
+            *options++ = '\0';
+            ret = _occfile_parse_options(*handle, options, &ring_size, &mirror);
+            if (ret != 0)
+                break;
+        }
+
+        fd = open(path, O_RDONLY);
+        if (fd == -1 || fstat(fd, &st) != 0) {
+            ret = -errno;
+            break;
+        }
+
+        (*handle)->file_len = st.st_size;
+        if ((*handle)->file_len > 0) {
+            (*handle)->file_buf = mmap(NULL, (*handle)->file_len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if ((*handle)->file_buf == MAP_FAILED) {
+                ret = -errno;
+                break;
+            }
+        }
+
+        ret = occring_init(&(*handle)->ring, ring_size, mirror);
+    } while (0);
+
+    if (fd != -1)
+        close(fd);
+    free(path);
+
+    if (ret != 0) {
+        if ((*handle)->file_buf != MAP_FAILED)
+            munmap((void *)(*handle)->file_buf, (*handle)->file_len);
+        free(*handle);
+        *handle = NULL;
+    }
+
+    return ret;
+}
+
+int occfile_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle) {
+    return occfile_open(devfile, type, handle);
+}
+
+int occfile_close(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->file_buf != MAP_FAILED)
+        munmap((void *)handle->file_buf, handle->file_len);
+    if (handle->timer_fd != -1)
+        close(handle->timer_fd);
+    occring_free(&handle->ring);
+    free(handle);
+
+    return 0;
+}
+
+/**
+ * Make descriptor from occfile_get_fd() readable after given time.
+ */
+static void _occfile_arm_timer(struct occ_handle *handle, uint64_t ns) {
+    struct itimerspec its;
+
+    if (handle->timer_fd == -1)
+        return;
+
+    // Zero would disarm the timer
+    if (ns == 0)
+        ns = 1;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000ULL;
+    its.it_value.tv_nsec = ns % 1000000000ULL;
+    timerfd_settime(handle->timer_fd, 0, &its, NULL);
+}
+
+int occfile_enable_rx(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    handle->rx_enabled = enable;
+    handle->paced = false;
+    if (enable)
+        _occfile_arm_timer(handle, 0);
+
+    return 0;
+}
+
+int occfile_enable_old_packets(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    handle->old_packets = enable;
+
+    return 0;
+}
+
+int occfile_enable_error_packets(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    return 0;
+}
+
+int occfile_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (bytes >= handle->ring.size || (bytes > 0 && latency_us == 0))
+        return -EINVAL;
+
+    handle->rx_watermark = bytes;
+    handle->rx_latency_us = latency_us;
+    return 0;
+}
+
+int occfile_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || status == NULL)
+        return -EINVAL;
+
+    memset(status, 0, sizeof(occ_status_t));
+
+    status->board = OCC_BOARD_NONE;
+    status->interface = OCC_INTERFACE_FILE;
+    status->dma_size = handle->ring.size;
+    status->dma_used = occring_used(&handle->ring);
+    status->optical_signal = OCC_OPT_CONNECTED;
+    status->rx_enabled = handle->rx_enabled;
+
+    return 0;
+}
+
+int occfile_reset(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    occring_reset(&handle->ring);
+    handle->file_off = 0;
+    handle->paced = false;
+    handle->rx_enabled = false;
+
+    return 0;
+}
+
+int occfile_send(struct occ_handle *handle, const void *data, size_t count) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || (count & 3) != 0)
+        return -EINVAL;
+
+    // Nobody is listening on the other side
+    return count;
+}
+
+int occfile_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    uint64_t start = _occfile_now();
+    uint64_t deadline = start + (uint64_t)timeout * 1000000ULL;
+    uint64_t latency;
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    latency = start + (uint64_t)handle->rx_latency_us * 1000ULL;
+
+    *address = handle->ring.buf;
+    *count = 0;
+
+    if (handle->nonblock && handle->timer_fd != -1) {
+        uint64_t expirations;
+        (void)!read(handle->timer_fd, &expirations, sizeof(expirations));
+    }
+
+    while (true) {
+        uint64_t next = 0;
+        uint64_t now;
+
+        if (handle->rx_enabled)
+            next = _occfile_produce(handle);
+
+        if (occring_used(&handle->ring) > 0) {
+            bool eof = (next == 0 && handle->file_off >= handle->file_len);
+            if (handle->rx_watermark == 0 || eof || handle->nonblock ||
+                occring_used(&handle->ring) >= handle->rx_watermark ||
+                _occfile_now() >= latency) {
+
+                ret = occring_peek(&handle->ring, address, count);
+                if (ret != 0)
+                    return ret;
+                if (*count > 0)
+                    return 0;
+            }
+        } else if (next == 0 && handle->rx_enabled && handle->file_off >= handle->file_len) {
+            // All data replayed and consumed, distinct from -ENODATA
+            // which tells callers to try again
+            return -EPIPE;
+        }
+
+        now = _occfile_now();
+        if (timeout > 0 && now >= deadline)
+            return -ETIME;
+
+        // Sleep until next packet is due but not past the timeout. When
+        // producer is blocked because ring is full or split packet, we
+        // wait for application to acknowledge data, which never happens
+        // while we're sleeping here, so just return an error.
+        if (next == 0) {
+            if (!handle->rx_enabled) {
+                if (handle->nonblock)
+                    return -EAGAIN;
+                next = MAX_SLEEP_NS;
+            } else if (handle->rx_watermark == 0 || occring_used(&handle->ring) == 0) {
+                return -ENOSPC;
+            } else {
+                next = (latency > now ? latency - now : 0);
+            }
+        }
+        if (handle->nonblock) {
+            _occfile_arm_timer(handle, next);
+            return -EAGAIN;
+        }
+        if (next > MAX_SLEEP_NS)
+            next = MAX_SLEEP_NS;
+        if (timeout > 0 && now + next > deadline)
+            next = deadline - now;
+
+        struct timespec ts = { .tv_sec = next / 1000000000ULL, .tv_nsec = next % 1000000000ULL };
+        nanosleep(&ts, NULL);
+    }
+}
+
+int occfile_data_ack(struct occ_handle *handle, size_t count) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    return occring_ack(&handle->ring, count);
+}
+
+int occfile_get_fd(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Data shows up as time passes, timer tells when to look again
+    if (handle->timer_fd == -1) {
+        handle->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (handle->timer_fd == -1)
+            return -errno;
+        _occfile_arm_timer(handle, 0);
+    }
+
+    return handle->timer_fd;
+}
+
+int occfile_set_nonblock(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    handle->nonblock = enable;
+    return 0;
+}
+
+int occfile_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout) {
+    void *address;
+    size_t avail;
+    int ret;
+
+    ret = occfile_data_wait(handle, &address, &avail, timeout);
+    if (ret != 0)
+        return ret;
+
+    if (count > avail)
+        count = avail;
+    count &= ~3;
+    memcpy(data, address, count);
+
+    ret = occfile_data_ack(handle, count);
+    if (ret != 0)
+        return ret;
+
+    return count;
+}
+
+int occfile_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count) {
+    return -ENOSYS;
+}
+
+int occfile_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count) {
+    return -ENOSYS;
+}
+
+int occfile_report(struct occ_handle *handle, FILE *outfile) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    fprintf(outfile, "File size: %zu\n", handle->file_len);
+    fprintf(outfile, "File offset: %zu\n", handle->file_off);
+    fprintf(outfile, "Bytes replayed: %llu\n", (unsigned long long)handle->replayed);
+    fprintf(outfile, "Speed: %g\n", handle->speed);
+    fprintf(outfile, "RX enabled: %s\n", handle->rx_enabled ? "yes" : "no");
+    occring_report(&handle->ring, outfile);
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * OCC library implementation that replays data from a capture file.
+ *
+ * All the functions herein are implementation specifics of the OCC
+ * library with a different prefix to their names but the same
+ * semantics. See occlib.h for API description.
+ *
+ * \file occlib_file.h
+ */
+
+#include "occlib_hw.h"
+
+int occfile_open(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occfile_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occfile_close(struct occ_handle *handle);
+int occfile_enable_rx(struct occ_handle *handle, bool enable);
+int occfile_enable_old_packets(struct occ_handle *handle, bool enable);
+int occfile_enable_error_packets(struct occ_handle *handle, bool enable);
+int occfile_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
+int occfile_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type);
+int occfile_reset(struct occ_handle *handle);
+int occfile_send(struct occ_handle *handle, const void *data, size_t count);
+int occfile_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
+int occfile_data_ack(struct occ_handle *handle, size_t count);
+int occfile_get_fd(struct occ_handle *handle);
+int occfile_set_nonblock(struct occ_handle *handle, bool enable);
+int occfile_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout);
+int occfile_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count);
+int occfile_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count);
+int occfile_report(struct occ_handle *handle, FILE *outfile);
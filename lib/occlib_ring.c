@@ -0,0 +1,230 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ */
+
+#define _GNU_SOURCE // memfd_create()
+
+#include "occlib_ring.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#ifndef ROLLOVER_BUF_SIZE
+#    define ROLLOVER_BUF_SIZE   8192    // Depends on maximum packet size, we need at most 2 times max packet size
+#endif
+
+#define MIN(a,b) ((a)>(b)?(b):(a))
+
+static uint32_t _occring_align(uint32_t size) {
+    return (size + 3) & ~3;
+}
+
+int occring_parse_size(const char *str, uint32_t *size) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 0);
+
+    if (end == str)
+        return -EINVAL;
+    switch (*end) {
+    case 'k': case 'K': val *= 1024ULL; end++; break;
+    case 'm': case 'M': val *= 1024ULL * 1024; end++; break;
+    case 'g': case 'G': val *= 1024ULL * 1024 * 1024; end++; break;
+    default: break;
+    }
+    if (*end != '\0' || val == 0 || val > UINT32_MAX / 2)
+        return -EINVAL;
+
+    *size = val;
+    return 0;
+}
+
+static uint8_t *_occring_map_mirrored(uint32_t size) {
+    uint8_t *base = MAP_FAILED;
+    int fd;
+
+    // Same trick as DMA_MIRROR in occlib_drv.c, but backed by anonymous file
+    fd = memfd_create("occring", 0);
+    if (fd == -1)
+        return NULL;
+
+    do {
+        if (ftruncate(fd, size) != 0)
+            break;
+
+        base = mmap(NULL, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED)
+            break;
+
+        if (mmap(base, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+            mmap(base + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(base, 2 * size);
+            base = MAP_FAILED;
+        }
+    } while (0);
+
+    // Mappings keep the memory alive
+    close(fd);
+    return (base == MAP_FAILED ? NULL : base);
+}
+
+int occring_init(struct occring *ring, uint32_t size, bool mirrored) {
+    long pagesize = sysconf(_SC_PAGESIZE);
+
+    memset(ring, 0, sizeof(struct occring));
+
+    if (size == 0)
+        return -EINVAL;
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+    ring->size = size;
+
+    if (mirrored) {
+        ring->buf = _occring_map_mirrored(size);
+        if (ring->buf != NULL) {
+            ring->mirrored = true;
+            return 0;
+        }
+    }
+
+    ring->buf = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (ring->buf == MAP_FAILED) {
+        ring->buf = NULL;
+        return -ENOMEM;
+    }
+
+    ring->rollover_size = MIN(ROLLOVER_BUF_SIZE, size);
+    ring->rollover_buf = malloc(ring->rollover_size);
+    if (ring->rollover_buf == NULL) {
+        occring_free(ring);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void occring_free(struct occring *ring) {
+    if (ring->buf)
+        munmap(ring->buf, ring->size * (ring->mirrored ? 2 : 1));
+    free(ring->rollover_buf);
+    memset(ring, 0, sizeof(struct occring));
+}
+
+void occring_reset(struct occring *ring) {
+    ring->prod = 0;
+    ring->cons = 0;
+    ring->last_addr = NULL;
+    ring->last_count = 0;
+}
+
+uint32_t occring_used(const struct occring *ring) {
+    uint32_t prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+    uint32_t cons = __atomic_load_n(&ring->cons, __ATOMIC_ACQUIRE);
+    return (ring->size + prod - cons) % ring->size;
+}
+
+uint32_t occring_room(const struct occring *ring) {
+    // Keep one dword free to tell full from empty, same as OCC hardware
+    return ring->size - occring_used(ring) - 4;
+}
+
+int occring_push(struct occring *ring, const void *data, uint32_t count) {
+    uint32_t prod = ring->prod;
+    uint32_t head;
+
+    count = _occring_align(count);
+    if (count > occring_room(ring))
+        return -ENOSPC;
+
+    head = MIN(count, ring->size - prod);
+    memcpy(ring->buf + prod, data, head);
+    memcpy(ring->buf, (const uint8_t *)data + head, count - head);
+
+    __atomic_store_n(&ring->prod, (prod + count) % ring->size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int occring_reserve(struct occring *ring, struct iovec iov[2]) {
+    uint32_t prod = ring->prod;
+    uint32_t room = occring_room(ring);
+    uint32_t head;
+
+    if (room == 0 || room > ring->size)
+        return 0;
+
+    head = MIN(room, ring->size - prod);
+    iov[0].iov_base = ring->buf + prod;
+    iov[0].iov_len = head;
+    if (head == room)
+        return 1;
+
+    iov[1].iov_base = ring->buf;
+    iov[1].iov_len = room - head;
+    return 2;
+}
+
+void occring_commit(struct occring *ring, uint32_t count) {
+    __atomic_store_n(&ring->prod, (ring->prod + count) % ring->size, __ATOMIC_RELEASE);
+}
+
+int occring_peek(struct occring *ring, void **address, size_t *count) {
+    uint32_t prod = __atomic_load_n(&ring->prod, __ATOMIC_ACQUIRE);
+    uint32_t cons = ring->cons;
+    uint8_t *last_addr;
+
+    *address = ring->buf + cons;
+    if (prod >= cons) {
+        *count = prod - cons;
+        last_addr = *address;
+    } else {
+        // Same as in occdrv_data_wait(), return data till the end of
+        // buffer first and merge split packet only when asked again
+        // without acknowledging any data.
+        if (ring->size <= cons)
+            return -ERANGE;
+
+        *count = ring->size - cons;
+        last_addr = *address;
+
+        if (ring->mirrored) {
+            *count += prod;
+        } else if (ring->last_addr == *address && *count < ring->rollover_size) {
+            uint32_t headlen = *count;
+            uint32_t taillen = MIN(ring->rollover_size - *count, prod);
+
+            memcpy(ring->rollover_buf, *address, headlen);
+            memcpy(&ring->rollover_buf[headlen], ring->buf, taillen);
+            *address = ring->rollover_buf;
+            *count = headlen + taillen;
+        }
+    }
+
+    if (*count > 0)
+        ring->last_addr = last_addr;
+    ring->last_count = *count;
+    return 0;
+}
+
+int occring_ack(struct occring *ring, size_t count) {
+    if (_occring_align(count) != count)
+        return -EINVAL;
+
+    if (count > ring->last_count)
+        count = ring->last_count;
+    ring->last_count -= count;
+
+    __atomic_store_n(&ring->cons, (ring->cons + count) % ring->size, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void occring_report(const struct occring *ring, FILE *outfile) {
+    fprintf(outfile, "Ring size: %u\n", ring->size);
+    fprintf(outfile, "Ring producer offset: %u\n", ring->prod);
+    fprintf(outfile, "Ring consumer offset: %u\n", ring->cons);
+    fprintf(outfile, "Ring used: %u\n", occring_used(ring));
+    fprintf(outfile, "Ring mirrored: %s\n", ring->mirrored ? "yes" : "no");
+    fprintf(outfile, "Ring last count: %u\n", ring->last_count);
+}
@@ -0,0 +1,135 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * In-process ring buffer with OCC DMA buffer semantics.
+ *
+ * Used by the backends that don't talk to the driver to provide the same
+ * behaviour as occlib_drv.c; fixed size buffer that wraps around, producer
+ * and consumer offsets and the two-step handling of packets split at the
+ * end of buffer. Producer offset only ever advances by complete packets,
+ * same as with OCC hardware.
+ *
+ * Ring is safe to use by single producer and single consumer running in
+ * different threads, no other locking is provided.
+ *
+ * \file occlib_ring.h
+ */
+
+#ifndef OCCLIB_RING_H_INCLUDED
+#define OCCLIB_RING_H_INCLUDED
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+struct occring {
+    uint8_t *buf;                   //!< Ring memory, mapped twice back-to-back when mirrored
+    uint32_t size;                  //!< Ring size in bytes
+    uint32_t prod;                  //!< Producer offset, written by producer only
+    uint32_t cons;                  //!< Consumer offset, written by consumer only
+    bool mirrored;                  //!< Data is always contiguous, no rollover needed
+    uint8_t *rollover_buf;          //!< Merges split packet when not mirrored
+    uint32_t rollover_size;
+    uint8_t *last_addr;             //!< Address returned by last occring_peek()
+    uint32_t last_count;            //!< Number of bytes returned by last occring_peek()
+};
+
+/**
+ * Allocate ring memory.
+ *
+ * Size is rounded up to page size. When mirrored flag is set, memory is
+ * mapped twice back-to-back so that data is always contiguous. When that
+ * fails, the ring falls back to using the rollover buffer.
+ *
+ * \return 0 on success, negative errno on error.
+ */
+int occring_init(struct occring *ring, uint32_t size, bool mirrored);
+
+/**
+ * Parse ring size from ring=<bytes> backend option.
+ *
+ * Accepts k, M and G suffix as powers of 1024, same for all backends.
+ *
+ * \return 0 on success, -EINVAL when size is malformed, zero or too big.
+ */
+int occring_parse_size(const char *str, uint32_t *size);
+
+/**
+ * Release ring memory.
+ */
+void occring_free(struct occring *ring);
+
+/**
+ * Drop all data from the ring.
+ *
+ * Must not be called while producer or consumer are active.
+ */
+void occring_reset(struct occring *ring);
+
+/**
+ * Return number of bytes in the ring, can be called by either side.
+ */
+uint32_t occring_used(const struct occring *ring);
+
+/**
+ * Return number of bytes that can be pushed to the ring.
+ */
+uint32_t occring_room(const struct occring *ring);
+
+/**
+ * Copy data to the ring and advance producer offset.
+ *
+ * Data must be a complete packet or a number of them. Data is either
+ * copied in full or not at all, count is aligned to 4 bytes.
+ *
+ * \return 0 on success, -ENOSPC when there's not enough room.
+ */
+int occring_push(struct occring *ring, const void *data, uint32_t count);
+
+/**
+ * Return free space in the ring for producer to write into directly.
+ *
+ * Free space may wrap around the end of buffer, in which case two
+ * iovec structures are populated. Suitable for readv() and alike.
+ * Data is not visible to consumer until occring_commit() is called.
+ *
+ * \return Number of iovec structures populated, 0 when ring is full.
+ */
+int occring_reserve(struct occring *ring, struct iovec iov[2]);
+
+/**
+ * Advance producer offset after writing to space from occring_reserve().
+ *
+ * Unlike occring_push(), count does not need to be aligned nor end on
+ * packet boundary. Consumer must then handle incomplete packets at the
+ * end of data, same as it would need to anyway.
+ */
+void occring_commit(struct occring *ring, uint32_t count);
+
+/**
+ * Return address and size of data available to consumer.
+ *
+ * Same semantics as occ_data_wait() except that it never blocks, count
+ * is set to 0 when there's no data.
+ *
+ * \return 0 on success, -ERANGE on internal inconsistency.
+ */
+int occring_peek(struct occring *ring, void **address, size_t *count);
+
+/**
+ * Release data consumed by application.
+ *
+ * \return 0 on success, -EINVAL when count is not aligned.
+ */
+int occring_ack(struct occring *ring, size_t count);
+
+/**
+ * Print ring state, for occ_report() implementations.
+ */
+void occring_report(const struct occring *ring, FILE *outfile);
+
+#endif // OCCLIB_RING_H_INCLUDED
@@ -0,0 +1,826 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * OCC API shared memory implementation.
+ *
+ * Distributes OCC data to any number of processes on the same host without
+ * copying it through the kernel. Publisher, typically occ_proxy, owns the
+ * OCC device and copies data into a ring buffer in shared memory. Consumers
+ * open the same path with OCC_INTERFACE_SHM and receive data through the
+ * regular occ_data_wait() and occ_data_ack() interface, pointing directly
+ * into the shared memory.
+ *
+ * Shared memory is an anonymous memfd. Publisher listens on a unix socket
+ * at given path and passes the memfd together with eventfd doorbells to
+ * each consumer that connects. Data part is mapped twice back-to-back in
+ * every process so that data is always contiguous.
+ *
+ * Each consumer has its own cursor in the shared header. Publisher never
+ * overwrites data not yet acknowledged by any consumer with RX enabled,
+ * the slowest consumer sets the pace. Consumers with RX disabled are
+ * not considered. Consumer that disconnects, including by crashing, is
+ * removed the next time publisher waits for room.
+ *
+ * Positions are 64-bit byte counters that never wrap, offset in the ring
+ * is position modulo ring size.
+ */
+
+#define _GNU_SOURCE // memfd_create()
+
+#include "occlib_hw.h"
+#include "occlib_shm.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define OCC_HANDLE_MAGIC        0x0cc0cc
+#define OCC_SHM_MAGIC           0x0cc5e3
+#define OCC_SHM_VERSION         1
+#define OCC_SHM_MAX_CONSUMERS   16
+#define OCC_SHM_HEADER_SIZE     4096
+
+/**
+ * Consumer cursor, one cache line each to avoid false sharing.
+ */
+struct occ_shm_consumer {
+    uint64_t cons;                  //!< Position of the first not acknowledged byte
+    uint32_t active;                //!< Publisher must not overwrite data past cons
+    uint32_t waiting;               //!< Consumer waits for data, ring data doorbell
+    uint8_t __pad[48];
+};
+
+/**
+ * Shared header at the beginning of shared memory.
+ */
+struct occ_shm_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;                  //!< Size of data ring in bytes
+    uint32_t closed;                //!< Publisher has gone away
+    uint64_t prod;                  //!< Position after the last published byte
+    uint32_t prod_waiting;          //!< Publisher waits for room, ring space doorbell
+    uint8_t __pad[36];
+    struct occ_shm_consumer consumers[OCC_SHM_MAX_CONSUMERS];
+};
+
+/**
+ * Message sent by publisher to consumer along with file descriptors.
+ */
+struct occ_shm_hello {
+    uint32_t magic;
+    uint32_t slot;
+};
+
+struct occ_shm_publisher {
+    uint32_t magic;
+    struct occ_shm_header *hdr;
+    uint8_t *data;
+    size_t map_len;
+    char path[108];
+    int memfd;
+    int listen_fd;
+    int space_fd;                   //!< Consumers signal room in ring
+    int client_fd[OCC_SHM_MAX_CONSUMERS];
+    int data_fd[OCC_SHM_MAX_CONSUMERS];
+};
+
+struct occ_handle {
+    uint32_t magic;
+    struct occ_shm_header *hdr;
+    struct occ_shm_consumer *cursor;
+    uint8_t *data;
+    size_t map_len;
+    int sock;                       //!< Connection to publisher, publisher cleans up when closed
+    int data_fd;
+    int space_fd;
+    uint32_t slot;
+    bool rx_enabled;
+    uint32_t last_count;            //!< Number of bytes returned by last occshm_data_wait()
+    uint32_t rx_watermark;
+    uint32_t rx_latency_us;
+    bool nonblock;                  //!< occshm_data_wait() returns -EAGAIN instead of waiting
+    int epoll_fd;                   //!< Watches data_fd and sock, -1 until requested
+};
+
+static uint64_t _occshm_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Map shared header and data twice back-to-back.
+ */
+static int _occshm_map(int fd, uint32_t size, struct occ_shm_header **hdr, uint8_t **data, size_t *map_len) {
+    uint8_t *base;
+
+    *map_len = OCC_SHM_HEADER_SIZE + 2 * (size_t)size;
+    base = mmap(NULL, *map_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -errno;
+
+    if (mmap(base, OCC_SHM_HEADER_SIZE + size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, 0) == MAP_FAILED ||
+        mmap(base + OCC_SHM_HEADER_SIZE + size, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_FIXED, fd, OCC_SHM_HEADER_SIZE) == MAP_FAILED) {
+        int ret = -errno;
+        munmap(base, *map_len);
+        return ret;
+    }
+
+    *hdr = (struct occ_shm_header *)base;
+    *data = base + OCC_SHM_HEADER_SIZE;
+    return 0;
+}
+
+static void _occshm_ring(int fd) {
+    uint64_t val = 1;
+    // Only fails when counter overflows, consumer will wake up anyway
+    (void)!write(fd, &val, sizeof(val));
+}
+
+static void _occshm_drain(int fd) {
+    uint64_t val;
+    (void)!read(fd, &val, sizeof(val));
+}
+
+/* Publisher side */
+
+static void _occshm_remove_consumer(struct occ_shm_publisher *pub, uint32_t slot) {
+    __atomic_store_n(&pub->hdr->consumers[slot].active, 0, __ATOMIC_RELEASE);
+    close(pub->client_fd[slot]);
+    close(pub->data_fd[slot]);
+    pub->client_fd[slot] = -1;
+    pub->data_fd[slot] = -1;
+}
+
+/**
+ * Accept all pending consumers and pass them shared memory and doorbells.
+ */
+static void _occshm_accept(struct occ_shm_publisher *pub) {
+    while (true) {
+        char cbuf[CMSG_SPACE(3 * sizeof(int))];
+        struct occ_shm_hello hello;
+        struct msghdr msg;
+        struct iovec iov;
+        struct cmsghdr *cmsg;
+        uint32_t slot;
+        int fd;
+
+        fd = accept(pub->listen_fd, NULL, NULL);
+        if (fd == -1)
+            return;
+
+        for (slot = 0; slot < OCC_SHM_MAX_CONSUMERS; slot++) {
+            if (pub->client_fd[slot] == -1)
+                break;
+        }
+        if (slot == OCC_SHM_MAX_CONSUMERS) {
+            close(fd);
+            continue;
+        }
+
+        pub->data_fd[slot] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (pub->data_fd[slot] == -1) {
+            close(fd);
+            continue;
+        }
+        pub->hdr->consumers[slot].active = 0;
+        pub->hdr->consumers[slot].waiting = 0;
+        pub->hdr->consumers[slot].cons = __atomic_load_n(&pub->hdr->prod, __ATOMIC_ACQUIRE);
+
+        hello.magic = OCC_SHM_MAGIC;
+        hello.slot = slot;
+        iov.iov_base = &hello;
+        iov.iov_len = sizeof(hello);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+        ((int *)CMSG_DATA(cmsg))[0] = pub->memfd;
+        ((int *)CMSG_DATA(cmsg))[1] = pub->data_fd[slot];
+        ((int *)CMSG_DATA(cmsg))[2] = pub->space_fd;
+
+        pub->client_fd[slot] = fd;
+        if (sendmsg(fd, &msg, MSG_NOSIGNAL) != sizeof(hello))
+            _occshm_remove_consumer(pub, slot);
+    }
+}
+
+/**
+ * Return number of bytes publisher can write without overwriting unread data.
+ *
+ * Consumer that is more than ring size behind has already lost data and
+ * gets -ERANGE, it doesn't hold back the others.
+ */
+static uint64_t _occshm_room(struct occ_shm_publisher *pub) {
+    uint64_t prod = pub->hdr->prod;
+    uint64_t min = prod;
+
+    for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+        struct occ_shm_consumer *c = &pub->hdr->consumers[i];
+        if (__atomic_load_n(&c->active, __ATOMIC_ACQUIRE)) {
+            uint64_t cons = __atomic_load_n(&c->cons, __ATOMIC_ACQUIRE);
+            if (cons < min && prod - cons <= pub->hdr->size)
+                min = cons;
+        }
+    }
+
+    return pub->hdr->size - (prod - min);
+}
+
+int occ_shm_publisher_open(const char *path, uint32_t size, struct occ_shm_publisher **publisher) {
+    struct occ_shm_publisher *pub;
+    struct sockaddr_un addr;
+    long pagesize = sysconf(_SC_PAGESIZE);
+    int ret = 0;
+
+    if (path == NULL || strlen(path) >= sizeof(addr.sun_path) || size == 0 || size > UINT32_MAX / 2)
+        return -EINVAL;
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    pub = malloc(sizeof(struct occ_shm_publisher));
+    if (pub == NULL)
+        return -ENOMEM;
+    memset(pub, 0, sizeof(struct occ_shm_publisher));
+    pub->magic = OCC_SHM_MAGIC;
+    pub->listen_fd = pub->space_fd = -1;
+    for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++)
+        pub->client_fd[i] = pub->data_fd[i] = -1;
+    strcpy(pub->path, path);
+
+    do {
+        pub->memfd = memfd_create("occ_shm", MFD_CLOEXEC);
+        if (pub->memfd == -1 || ftruncate(pub->memfd, OCC_SHM_HEADER_SIZE + size) != 0) {
+            ret = -errno;
+            break;
+        }
+
+        ret = _occshm_map(pub->memfd, size, &pub->hdr, &pub->data, &pub->map_len);
+        if (ret != 0)
+            break;
+        pub->hdr->size = size;
+        pub->hdr->version = OCC_SHM_VERSION;
+        pub->hdr->magic = OCC_SHM_MAGIC;
+
+        pub->space_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pub->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (pub->space_fd == -1 || pub->listen_fd == -1) {
+            ret = -errno;
+            break;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        unlink(path);
+        if (bind(pub->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+            listen(pub->listen_fd, OCC_SHM_MAX_CONSUMERS) != 0) {
+            ret = -errno;
+            break;
+        }
+    } while (0);
+
+    if (ret != 0) {
+        pub->path[0] = '\0';
+        occ_shm_publisher_close(pub);
+        return ret;
+    }
+
+    *publisher = pub;
+    return 0;
+}
+
+int occ_shm_publisher_close(struct occ_shm_publisher *pub) {
+
+    if (pub == NULL || pub->magic != OCC_SHM_MAGIC)
+        return -EINVAL;
+
+    if (pub->hdr != NULL) {
+        __atomic_store_n(&pub->hdr->closed, 1, __ATOMIC_RELEASE);
+        for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+            if (pub->data_fd[i] != -1)
+                _occshm_ring(pub->data_fd[i]);
+        }
+    }
+    for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+        if (pub->client_fd[i] != -1)
+            _occshm_remove_consumer(pub, i);
+    }
+
+    if (pub->listen_fd != -1)
+        close(pub->listen_fd);
+    if (pub->path[0] != '\0')
+        unlink(pub->path);
+    if (pub->space_fd != -1)
+        close(pub->space_fd);
+    if (pub->hdr != NULL)
+        munmap(pub->hdr, pub->map_len);
+    if (pub->memfd != -1)
+        close(pub->memfd);
+    free(pub);
+
+    return 0;
+}
+
+int occ_shm_publish(struct occ_shm_publisher *pub, const void *data, size_t count, uint32_t timeout) {
+    uint64_t deadline = _occshm_now() + (uint64_t)timeout * 1000000ULL;
+    uint64_t prod;
+
+    if (pub == NULL || pub->magic != OCC_SHM_MAGIC || count >= pub->hdr->size)
+        return -EINVAL;
+
+    _occshm_accept(pub);
+    if (count == 0)
+        return 0;
+
+    while (_occshm_room(pub) < count) {
+        struct pollfd fds[OCC_SHM_MAX_CONSUMERS + 2];
+        int nfds = 0;
+        int wait = -1;
+
+        __atomic_store_n(&pub->hdr->prod_waiting, 1, __ATOMIC_SEQ_CST);
+        if (_occshm_room(pub) >= count)
+            break;
+
+        if (timeout > 0) {
+            uint64_t now = _occshm_now();
+            if (now >= deadline) {
+                __atomic_store_n(&pub->hdr->prod_waiting, 0, __ATOMIC_RELAXED);
+                return -ETIME;
+            }
+            wait = (deadline - now + 999999) / 1000000;
+        }
+
+        // Besides room in the ring, also watch for consumers going away
+        fds[nfds].fd = pub->space_fd;
+        fds[nfds++].events = POLLIN;
+        fds[nfds].fd = pub->listen_fd;
+        fds[nfds++].events = POLLIN;
+        for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+            if (pub->client_fd[i] != -1) {
+                fds[nfds].fd = pub->client_fd[i];
+                fds[nfds++].events = POLLIN;
+            }
+        }
+
+        if (poll(fds, nfds, wait) == -1) {
+            __atomic_store_n(&pub->hdr->prod_waiting, 0, __ATOMIC_RELAXED);
+            return -errno;
+        }
+
+        if (fds[0].revents & POLLIN)
+            _occshm_drain(pub->space_fd);
+        if (fds[1].revents & POLLIN)
+            _occshm_accept(pub);
+        for (int j = 2; j < nfds; j++) {
+            if (fds[j].revents & (POLLIN | POLLHUP | POLLERR)) {
+                for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+                    if (pub->client_fd[i] == fds[j].fd)
+                        _occshm_remove_consumer(pub, i);
+                }
+            }
+        }
+    }
+    __atomic_store_n(&pub->hdr->prod_waiting, 0, __ATOMIC_RELAXED);
+
+    // Mirrored mapping takes care of the wrap-around
+    prod = pub->hdr->prod;
+    memcpy(pub->data + prod % pub->hdr->size, data, count);
+    __atomic_store_n(&pub->hdr->prod, prod + count, __ATOMIC_SEQ_CST);
+
+    for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+        if (pub->data_fd[i] != -1 && __atomic_load_n(&pub->hdr->consumers[i].waiting, __ATOMIC_SEQ_CST))
+            _occshm_ring(pub->data_fd[i]);
+    }
+
+    return count;
+}
+
+/* Consumer side */
+
+int occshm_open(const char *path, occ_interface_type type, struct occ_handle **handle) {
+    char cbuf[CMSG_SPACE(3 * sizeof(int))];
+    struct occ_shm_hello hello;
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    int memfd = -1;
+    int ret = 0;
+
+    if (type != OCC_INTERFACE_SHM || path == NULL || strlen(path) >= sizeof(addr.sun_path))
+        return -EINVAL;
+
+    *handle = malloc(sizeof(struct occ_handle));
+    if (*handle == NULL)
+        return -ENOMEM;
+    memset(*handle, 0, sizeof(struct occ_handle));
+    (*handle)->magic = OCC_HANDLE_MAGIC;
+    (*handle)->data_fd = (*handle)->space_fd = (*handle)->epoll_fd = -1;
+
+    do {
+        (*handle)->sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+        if ((*handle)->sock == -1) {
+            ret = -errno;
+            break;
+        }
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        if (connect((*handle)->sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            ret = -errno;
+            break;
+        }
+
+        // Publisher accepts from occ_shm_publish(), wait for it
+        iov.iov_base = &hello;
+        iov.iov_len = sizeof(hello);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+        if (recvmsg((*handle)->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) || hello.magic != OCC_SHM_MAGIC) {
+            ret = -ENODATA;
+            break;
+        }
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(3 * sizeof(int))) {
+            ret = -ENODATA;
+            break;
+        }
+        memfd = ((int *)CMSG_DATA(cmsg))[0];
+        (*handle)->data_fd = ((int *)CMSG_DATA(cmsg))[1];
+        (*handle)->space_fd = ((int *)CMSG_DATA(cmsg))[2];
+        (*handle)->slot = hello.slot;
+
+        // Header tells the size, map it alone first
+        struct occ_shm_header *hdr = mmap(NULL, OCC_SHM_HEADER_SIZE, PROT_READ, MAP_SHARED, memfd, 0);
+        if (hdr == MAP_FAILED) {
+            ret = -errno;
+            break;
+        }
+        uint32_t size = hdr->size;
+        bool valid = (hdr->magic == OCC_SHM_MAGIC && hdr->version == OCC_SHM_VERSION && hello.slot < OCC_SHM_MAX_CONSUMERS);
+        munmap(hdr, OCC_SHM_HEADER_SIZE);
+        if (!valid) {
+            ret = -EPROTO;
+            break;
+        }
+
+        ret = _occshm_map(memfd, size, &(*handle)->hdr, &(*handle)->data, &(*handle)->map_len);
+        if (ret == 0)
+            (*handle)->cursor = &(*handle)->hdr->consumers[hello.slot];
+    } while (0);
+
+    // Mapping keeps memory alive
+    if (memfd != -1)
+        close(memfd);
+
+    if (ret != 0) {
+        occshm_close(*handle);
+        *handle = NULL;
+    }
+    return ret;
+}
+
+int occshm_open_debug(const char *path, occ_interface_type type, struct occ_handle **handle) {
+    return occshm_open(path, type, handle);
+}
+
+int occshm_close(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (handle->cursor != NULL)
+        __atomic_store_n(&handle->cursor->active, 0, __ATOMIC_RELEASE);
+    if (handle->hdr != NULL)
+        munmap(handle->hdr, handle->map_len);
+    if (handle->data_fd != -1)
+        close(handle->data_fd);
+    if (handle->space_fd != -1)
+        close(handle->space_fd);
+    if (handle->epoll_fd != -1)
+        close(handle->epoll_fd);
+    if (handle->sock > 0)
+        close(handle->sock);
+    free(handle);
+
+    return 0;
+}
+
+int occshm_enable_rx(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (enable && !handle->rx_enabled) {
+        uint64_t seen = __atomic_load_n(&handle->hdr->prod, __ATOMIC_ACQUIRE);
+        uint64_t prod;
+
+        // Start with the next published data, publisher only writes whole packets.
+        // Publisher doesn't count this consumer until it sees it active and
+        // may publish meanwhile, move cursor forward until prod is stable.
+        do {
+            prod = seen;
+            __atomic_store_n(&handle->cursor->cons, prod, __ATOMIC_RELEASE);
+            __atomic_store_n(&handle->cursor->active, 1, __ATOMIC_SEQ_CST);
+            seen = __atomic_load_n(&handle->hdr->prod, __ATOMIC_SEQ_CST);
+        } while (seen != prod);
+        handle->last_count = 0;
+    } else if (!enable && handle->rx_enabled) {
+        __atomic_store_n(&handle->cursor->active, 0, __ATOMIC_RELEASE);
+        if (__atomic_load_n(&handle->hdr->prod_waiting, __ATOMIC_SEQ_CST))
+            _occshm_ring(handle->space_fd);
+    }
+    handle->rx_enabled = enable;
+
+    return 0;
+}
+
+int occshm_enable_old_packets(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Publisher decides packet format
+    return 0;
+}
+
+int occshm_enable_error_packets(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    return 0;
+}
+
+int occshm_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (bytes >= handle->hdr->size || (bytes > 0 && latency_us == 0))
+        return -EINVAL;
+
+    handle->rx_watermark = bytes;
+    handle->rx_latency_us = latency_us;
+    return 0;
+}
+
+int occshm_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || status == NULL)
+        return -EINVAL;
+
+    memset(status, 0, sizeof(occ_status_t));
+
+    status->board = OCC_BOARD_NONE;
+    status->interface = OCC_INTERFACE_SHM;
+    status->dma_size = handle->hdr->size;
+    if (handle->rx_enabled)
+        status->dma_used = __atomic_load_n(&handle->hdr->prod, __ATOMIC_ACQUIRE) - handle->cursor->cons;
+    status->optical_signal = (handle->hdr->closed ? OCC_OPT_NO_CABLE : OCC_OPT_CONNECTED);
+    status->rx_enabled = handle->rx_enabled;
+
+    return 0;
+}
+
+int occshm_reset(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Drop all pending data, there's nothing else to reset
+    occshm_enable_rx(handle, false);
+    handle->last_count = 0;
+
+    return 0;
+}
+
+int occshm_send(struct occ_handle *handle, const void *data, size_t count) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Only publisher talks to the device
+    return -ENOSYS;
+}
+
+int occshm_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    uint64_t start = _occshm_now();
+    uint64_t deadline = start + (uint64_t)timeout * 1000000ULL;
+    uint64_t latency;
+    bool hangup = false;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    latency = start + (uint64_t)handle->rx_latency_us * 1000ULL;
+    *address = handle->data;
+    *count = 0;
+
+    // Doorbell was left armed by previous non-blocking call
+    if (handle->nonblock) {
+        __atomic_store_n(&handle->cursor->waiting, 0, __ATOMIC_RELAXED);
+        _occshm_drain(handle->data_fd);
+    }
+
+    while (true) {
+        uint64_t cons = handle->cursor->cons;
+        uint64_t prod = __atomic_load_n(&handle->hdr->prod, __ATOMIC_ACQUIRE);
+        uint64_t wakeup;
+        uint64_t now;
+        struct pollfd fds[2];
+
+        // No more data is coming when publisher is gone, flush what's left
+        if (__atomic_load_n(&handle->hdr->closed, __ATOMIC_ACQUIRE))
+            hangup = true;
+
+        if (handle->rx_enabled && prod > cons) {
+            if (prod - cons > handle->hdr->size)
+                return -ERANGE;
+            if (prod - cons >= handle->rx_watermark || hangup || handle->nonblock || _occshm_now() >= latency) {
+                *address = handle->data + cons % handle->hdr->size;
+                *count = prod - cons;
+                handle->last_count = *count;
+                return 0;
+            }
+        }
+
+        if (hangup)
+            return -ECONNRESET;
+
+        now = _occshm_now();
+        if (timeout > 0 && now >= deadline)
+            return -ETIME;
+
+        // Let publisher know we need a doorbell, then check again
+        __atomic_store_n(&handle->cursor->waiting, 1, __ATOMIC_SEQ_CST);
+        if (handle->rx_enabled && __atomic_load_n(&handle->hdr->prod, __ATOMIC_SEQ_CST) != prod) {
+            __atomic_store_n(&handle->cursor->waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        if (handle->nonblock) {
+            // Leave doorbell armed, occshm_get_fd() descriptor becomes readable
+            fds[0].fd = handle->sock;
+            fds[0].events = POLLIN;
+            if (poll(fds, 1, 0) > 0) {
+                __atomic_store_n(&handle->cursor->waiting, 0, __ATOMIC_RELAXED);
+                hangup = true;
+                continue;
+            }
+            return -EAGAIN;
+        }
+
+        wakeup = (timeout > 0 ? deadline : 0);
+        if (handle->rx_enabled && prod > cons && (wakeup == 0 || latency < wakeup))
+            wakeup = latency;
+
+        // Publisher socket hangs up when publisher dies without closing
+        fds[0].fd = handle->data_fd;
+        fds[0].events = POLLIN;
+        fds[1].fd = handle->sock;
+        fds[1].events = POLLIN;
+        if (poll(fds, 2, wakeup == 0 ? -1 : (int)((wakeup - now + 999999) / 1000000)) == -1) {
+            __atomic_store_n(&handle->cursor->waiting, 0, __ATOMIC_RELAXED);
+            return -errno;
+        }
+        __atomic_store_n(&handle->cursor->waiting, 0, __ATOMIC_RELAXED);
+        if (fds[0].revents & POLLIN)
+            _occshm_drain(handle->data_fd);
+        if (fds[1].revents & (POLLIN | POLLHUP | POLLERR))
+            hangup = true;
+    }
+}
+
+int occshm_data_ack(struct occ_handle *handle, size_t count) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || (count & 3) != 0)
+        return -EINVAL;
+
+    if (!handle->rx_enabled)
+        return 0;
+
+    if (count > handle->last_count)
+        count = handle->last_count;
+    handle->last_count -= count;
+
+    __atomic_store_n(&handle->cursor->cons, handle->cursor->cons + count, __ATOMIC_SEQ_CST);
+    if (count > 0 && __atomic_load_n(&handle->hdr->prod_waiting, __ATOMIC_SEQ_CST))
+        _occshm_ring(handle->space_fd);
+
+    return 0;
+}
+
+int occshm_get_fd(struct occ_handle *handle) {
+    struct epoll_event ev;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Publisher rings data_fd, but only hangs up the socket when it dies
+    if (handle->epoll_fd == -1) {
+        handle->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (handle->epoll_fd == -1)
+            return -errno;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.fd = handle->data_fd;
+        int ret = epoll_ctl(handle->epoll_fd, EPOLL_CTL_ADD, handle->data_fd, &ev);
+        if (ret == 0) {
+            ev.data.fd = handle->sock;
+            ret = epoll_ctl(handle->epoll_fd, EPOLL_CTL_ADD, handle->sock, &ev);
+        }
+        if (ret == -1) {
+            ret = -errno;
+            close(handle->epoll_fd);
+            handle->epoll_fd = -1;
+            return ret;
+        }
+    }
+
+    return handle->epoll_fd;
+}
+
+int occshm_set_nonblock(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Ring the doorbell for the first data too
+    handle->nonblock = enable;
+    __atomic_store_n(&handle->cursor->waiting, enable ? 1 : 0, __ATOMIC_SEQ_CST);
+    if (enable && __atomic_load_n(&handle->hdr->prod, __ATOMIC_SEQ_CST) != handle->cursor->cons)
+        _occshm_ring(handle->data_fd);
+    return 0;
+}
+
+int occshm_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout) {
+    void *address;
+    size_t avail;
+    int ret;
+
+    ret = occshm_data_wait(handle, &address, &avail, timeout);
+    if (ret != 0)
+        return ret;
+
+    if (count > avail)
+        count = avail;
+    count &= ~3;
+    memcpy(data, address, count);
+
+    ret = occshm_data_ack(handle, count);
+    if (ret != 0)
+        return ret;
+
+    return count;
+}
+
+int occshm_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count) {
+    return -ENOSYS;
+}
+
+int occshm_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count) {
+    return -ENOSYS;
+}
+
+int occshm_report(struct occ_handle *handle, FILE *outfile) {
+    uint64_t prod;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    prod = __atomic_load_n(&handle->hdr->prod, __ATOMIC_ACQUIRE);
+    fprintf(outfile, "Consumer slot: %u\n", handle->slot);
+    fprintf(outfile, "Ring size: %u\n", handle->hdr->size);
+    fprintf(outfile, "Producer position: %llu\n", (unsigned long long)prod);
+    fprintf(outfile, "Consumer position: %llu\n", (unsigned long long)handle->cursor->cons);
+    fprintf(outfile, "Publisher closed: %s\n", handle->hdr->closed ? "yes" : "no");
+    for (uint32_t i = 0; i < OCC_SHM_MAX_CONSUMERS; i++) {
+        struct occ_shm_consumer *c = &handle->hdr->consumers[i];
+        if (c->active)
+            fprintf(outfile, "Consumer %u lag: %llu\n", i, (unsigned long long)(prod - c->cons));
+    }
+
+    return 0;
+}
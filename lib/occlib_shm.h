@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * OCC library implementation that consumes data from shared memory.
+ *
+ * All the functions herein are implementation specifics of the OCC
+ * library with a different prefix to their names but the same
+ * semantics. See occlib.h for API description.
+ *
+ * \file occlib_shm.h
+ */
+
+#include "occlib_hw.h"
+
+int occshm_open(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occshm_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occshm_close(struct occ_handle *handle);
+int occshm_enable_rx(struct occ_handle *handle, bool enable);
+int occshm_enable_old_packets(struct occ_handle *handle, bool enable);
+int occshm_enable_error_packets(struct occ_handle *handle, bool enable);
+int occshm_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
+int occshm_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type);
+int occshm_reset(struct occ_handle *handle);
+int occshm_send(struct occ_handle *handle, const void *data, size_t count);
+int occshm_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
+int occshm_data_ack(struct occ_handle *handle, size_t count);
+int occshm_get_fd(struct occ_handle *handle);
+int occshm_set_nonblock(struct occ_handle *handle, bool enable);
+int occshm_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout);
+int occshm_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count);
+int occshm_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count);
+int occshm_report(struct occ_handle *handle, FILE *outfile);
@@ -0,0 +1,1058 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * OCC API synthetic traffic implementation.
+ *
+ * Generates OCC packets from a producer thread into an in-process ring
+ * with DMA buffer semantics. Meant for load testing applications without
+ * OCC hardware. Like the real board, producer stalls when consumer falls
+ * behind and ring gets full. Application sees -ENOSPC from occ_data_wait()
+ * once it consumes all data that was received before stall and must call
+ * occ_reset() to continue.
+ *
+ * devfile parameter to occ_open() is a comma separated list of options,
+ * empty string selects all defaults:
+ * - ring=<bytes>       size of the ring buffer, default 2MB
+ * - mirror             map ring twice to always return contiguous data
+ * - type=das|rtdl|test|mix
+ *                      packets to generate, mix generates one RTDL packet
+ *                      followed by DAS data packets for each pulse, default das
+ * - size=<bytes>       DAS data or test packet size, default 4096
+ * - rate=<bytes>       data rate in bytes per second, default unlimited
+ * - pps=<packets>      data rate in packets per second, default unlimited
+ * - block              wait for room in the ring instead of stalling
+ * - fault=<type>@<when>
+ *                      inject fault, can be repeated
+ * - script=<path>      read faults from file, one '<type> <when>' per line
+ * Numbers accept k, M and G suffix, powers of 1000 for rates and powers
+ * of 1024 for sizes like in other backends. Example: type=mix,rate=100M
+ *
+ * Fault injection exercises application recovery paths. Faults trigger in
+ * the order specified, either when given number of bytes has been generated
+ * or when given time has elapsed since RX was first enabled, ie. 10M or
+ * 1500ms. Supported fault types are:
+ * - stall      DMA stall, occ_data_wait() returns -ENOSPC once ring is drained
+ * - overflow   FIFO overflow, occ_data_wait() returns -EOVERFLOW once ring is drained
+ * - reset      reset in the middle of the packet, only half of the packet is
+ *              written and occ_data_wait() returns -ECONNRESET right away
+ * - corrupt    invalid length field in the packet header
+ * - glitch     4 garbage dwords written between two packets
+ * For each fault occ_report() prints time it took the application to resume,
+ * which is when occ_data_wait() first returned data generated after the
+ * fault, and number of bytes lost. Lost bytes include data dropped by
+ * occ_reset(), invalid data and data that would have been generated while
+ * RX was stopped, latter only when rate is limited.
+ *
+ * Packet layouts follow tools/OccDiag/Packet.h. Test packets carry the
+ * continuous ramp that OccDiag verifies.
+ */
+
+#include "occlib_hw.h"
+#include "occlib_sim.h"
+#include "occlib_ring.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#define OCC_HANDLE_MAGIC        0x0cc0cc
+#define DEFAULT_RING_SIZE       (2 * 1024 * 1024)
+#define DEFAULT_PACKET_SIZE     4096
+#define MAX_PACKET_SIZE         65536
+#define PULSES_PER_SEC          60
+#define DAS_PACKETS_PER_PULSE   9       //!< Number of DAS packets following RTDL in mixed mode
+#define RATE_CHECK_PERIOD       1000000000ULL
+
+#define DAS2_VERSION            1
+#define DAS2_TYPE_TEST          0x2
+#define DAS2_TYPE_RTDL          0x6
+#define DAS2_TYPE_DAS_DATA      0x7
+#define DAS2_HEADER_SIZE        8
+#define DAS_DATA_HEADER_SIZE    20
+#define RTDL_HEADER_SIZE        12
+#define RTDL_NUM_FRAMES         32
+#define TEST_HEADER_SIZE        40
+#define EVENT_FMT_PIXEL         2
+#define MAX_FAULTS              64
+#define GLITCH_SIZE             16
+
+typedef enum {
+    SIM_TYPE_DAS,
+    SIM_TYPE_RTDL,
+    SIM_TYPE_TEST,
+    SIM_TYPE_MIX,
+} sim_packet_type;
+
+typedef enum {
+    SIM_FAULT_STALL,
+    SIM_FAULT_OVERFLOW,
+    SIM_FAULT_RESET,
+    SIM_FAULT_CORRUPT,
+    SIM_FAULT_GLITCH,
+} sim_fault_type;
+
+static const char *sim_fault_names[] = { "stall", "overflow", "reset", "corrupt", "glitch" };
+
+struct sim_fault {
+    sim_fault_type type;
+    bool by_time;                   //!< Trigger is time in ns rather than byte offset
+    uint64_t trigger;
+    bool injected;
+    bool recovered;
+    uint64_t inject_ns;
+    uint64_t end_pos;               //!< Stream position right after invalid data
+    uint64_t dropped;               //!< Bytes dropped by reset before injection
+    uint64_t bad_bytes;             //!< Invalid data written to ring
+    uint64_t recovery_ns;
+    uint64_t lost;
+};
+
+struct occ_handle {
+    uint32_t magic;
+    struct occring ring;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t prod_cond;       //!< Wakes up producer on control change or room in ring
+    pthread_cond_t cons_cond;       //!< Wakes up consumer on new data or stall
+
+    // Configuration, only changed when producer is idle
+    sim_packet_type type;
+    uint32_t packet_size;
+    uint64_t rate;                  //!< Bytes or packets per second, 0 for unlimited
+    bool rate_pps;                  //!< Rate is in packets per second
+    bool block;
+
+    // Shared state, protected by lock or accessed atomically
+    bool rx_enabled;
+    int error;                      //!< Sticky error reported after ring is drained, 0 when none
+    bool shutdown;
+    bool prod_idle;                 //!< Producer is not touching the ring
+    bool prod_waiting;              //!< Producer waits for room
+    bool cons_waiting;              //!< Consumer waits for data
+    bool nonblock;                  //!< Consumer waits on event_fd instead of cons_cond
+    int event_fd;                   //!< Rung together with cons_cond for non-blocking consumer
+    uint32_t rx_watermark;
+    uint32_t rx_latency_us;
+
+    // Producer state
+    uint8_t *das_packet;            //!< DAS data packet with static events
+    uint8_t *packet;                //!< RTDL or test packet being generated
+    uint32_t seq;
+    uint32_t ramp;                  //!< Next test pattern value
+    uint64_t pulse;
+    uint32_t pulse_packets;         //!< DAS packets sent in current pulse, mixed mode only
+    uint64_t start_ns;              //!< Time when rx was enabled, pacing base
+    uint64_t paced;                 //!< Bytes or packets generated since start_ns
+
+    // Statistics, written by producer only
+    uint64_t total_packets;
+    uint64_t total_bytes;
+    uint32_t max_used;              //!< Ring high watermark
+    uint64_t rate_ns;               //!< Start of the current rate measurement period
+    uint64_t rate_bytes;
+    uint32_t rx_rate;               //!< Measured rate in last period, B/s
+
+    // Statistics, written by consumer only
+    uint64_t stalls;                //!< Stalls reported to application
+    bool stall_seen;                //!< Current stall was already counted
+
+    // Fault injection, stream positions are cumulative across resets
+    struct sim_fault faults[MAX_FAULTS];
+    uint32_t num_faults;
+    uint32_t next_fault;            //!< Next fault to be injected, used by producer
+    uint32_t pending_faults;        //!< Injected but not yet recovered faults
+    uint64_t first_ns;              //!< Time when RX was first enabled
+    uint64_t pushed;                //!< Bytes written to ring
+    uint64_t acked;                 //!< Bytes consumed by application
+    uint64_t dropped;               //!< Bytes dropped by reset
+};
+
+static uint64_t _occsim_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void _occsim_abstime(uint64_t ns, struct timespec *ts) {
+    ts->tv_sec = ns / 1000000000ULL;
+    ts->tv_nsec = ns % 1000000000ULL;
+}
+
+/**
+ * Parse number with optional k, M or G suffix, unit is 1000 or 1024.
+ */
+static int _occsim_parse_num(const char *str, uint64_t *num, uint64_t unit) {
+    char *end;
+    unsigned long long val = strtoull(str, &end, 0);
+
+    if (end == str)
+        return -EINVAL;
+    switch (*end) {
+    case 'k': case 'K': val *= unit; end++; break;
+    case 'm': case 'M': val *= unit * unit; end++; break;
+    case 'g': case 'G': val *= unit * unit * unit; end++; break;
+    default: break;
+    }
+    if (*end != '\0')
+        return -EINVAL;
+
+    *num = val;
+    return 0;
+}
+
+/**
+ * Parse fault specification '<type>@<when>' or '<type> <when>'.
+ */
+static int _occsim_parse_fault(struct occ_handle *handle, char *spec) {
+    struct sim_fault *fault;
+    char *when;
+    char *end;
+    size_t len;
+    int type;
+
+    if (handle->num_faults >= MAX_FAULTS)
+        return -E2BIG;
+    fault = &handle->faults[handle->num_faults];
+
+    when = strpbrk(spec, "@ \t");
+    if (when == NULL)
+        return -EINVAL;
+    *when++ = '\0';
+    while (*when == ' ' || *when == '\t')
+        when++;
+
+    for (type = SIM_FAULT_GLITCH; type >= 0; type--) {
+        if (strcmp(spec, sim_fault_names[type]) == 0)
+            break;
+    }
+    if (type < 0)
+        return -EINVAL;
+    fault->type = type;
+
+    len = strlen(when);
+    while (len > 0 && (when[len-1] == '\n' || when[len-1] == ' ' || when[len-1] == '\t'))
+        when[--len] = '\0';
+
+    if (len > 2 && strcmp(&when[len - 2], "ms") == 0) {
+        fault->by_time = true;
+        fault->trigger = strtoull(when, &end, 0) * 1000000ULL;
+    } else if (len > 2 && strcmp(&when[len - 2], "us") == 0) {
+        fault->by_time = true;
+        fault->trigger = strtoull(when, &end, 0) * 1000ULL;
+    } else if (len > 1 && when[len - 1] == 's') {
+        fault->by_time = true;
+        fault->trigger = strtoull(when, &end, 0) * 1000000000ULL;
+    } else {
+        if (_occsim_parse_num(when, &fault->trigger, 1024) != 0)
+            return -EINVAL;
+        end = &when[len];
+    }
+    if (end == when || (fault->by_time && !(*end == 'm' || *end == 'u' || *end == 's')))
+        return -EINVAL;
+
+    handle->num_faults++;
+    return 0;
+}
+
+static int _occsim_parse_script(struct occ_handle *handle, const char *path) {
+    char line[256];
+    FILE *fp;
+    int ret = 0;
+
+    fp = fopen(path, "r");
+    if (fp == NULL)
+        return -errno;
+
+    while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+        char *spec = line + strspn(line, " \t");
+        if (*spec == '#' || *spec == '\n' || *spec == '\0')
+            continue;
+        ret = _occsim_parse_fault(handle, spec);
+    }
+
+    fclose(fp);
+    return ret;
+}
+
+static int _occsim_parse_options(struct occ_handle *handle, char *options, uint32_t *ring_size, bool *mirror) {
+    char *saveptr = NULL;
+    uint64_t num;
+
+    for (char *opt = strtok_r(options, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr)) {
+        if (strncmp(opt, "ring=", 5) == 0) {
+            if (occring_parse_size(opt + 5, ring_size) != 0)
+                return -EINVAL;
+        } else if (strcmp(opt, "mirror") == 0) {
+            *mirror = true;
+        } else if (strcmp(opt, "type=das") == 0) {
+            handle->type = SIM_TYPE_DAS;
+        } else if (strcmp(opt, "type=rtdl") == 0) {
+            handle->type = SIM_TYPE_RTDL;
+        } else if (strcmp(opt, "type=test") == 0) {
+            handle->type = SIM_TYPE_TEST;
+        } else if (strcmp(opt, "type=mix") == 0) {
+            handle->type = SIM_TYPE_MIX;
+        } else if (strncmp(opt, "size=", 5) == 0) {
+            if (_occsim_parse_num(opt + 5, &num, 1024) != 0 || num < TEST_HEADER_SIZE || num > MAX_PACKET_SIZE)
+                return -EINVAL;
+            handle->packet_size = num;
+        } else if (strncmp(opt, "rate=", 5) == 0) {
+            if (_occsim_parse_num(opt + 5, &handle->rate, 1000) != 0)
+                return -EINVAL;
+            handle->rate_pps = false;
+        } else if (strncmp(opt, "pps=", 4) == 0) {
+            if (_occsim_parse_num(opt + 4, &handle->rate, 1000) != 0)
+                return -EINVAL;
+            handle->rate_pps = true;
+        } else if (strcmp(opt, "block") == 0) {
+            handle->block = true;
+        } else if (strncmp(opt, "fault=", 6) == 0) {
+            if (_occsim_parse_fault(handle, opt + 6) != 0)
+                return -EINVAL;
+        } else if (strncmp(opt, "script=", 7) == 0) {
+            int ret = _occsim_parse_script(handle, opt + 7);
+            if (ret != 0)
+                return ret;
+        } else {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+static uint32_t _occsim_header(struct occ_handle *handle, uint32_t type) {
+    return (DAS2_VERSION << 28) | (type << 20) | (handle->seq++ & 0xFF);
+}
+
+static uint64_t _occsim_pulse_time(struct occ_handle *handle) {
+    // Accelerator time starts at 1990 epoch, exact value doesn't matter
+    return 1000000000ULL * 1000000000ULL + handle->pulse * (1000000000ULL / PULSES_PER_SEC);
+}
+
+static uint32_t _occsim_make_das(struct occ_handle *handle) {
+    uint32_t *words = (uint32_t *)handle->das_packet;
+    uint32_t len = handle->packet_size & ~7;
+    uint32_t nevents = (len - DAS_DATA_HEADER_SIZE) / 8;
+    uint64_t time = _occsim_pulse_time(handle);
+
+    len = DAS_DATA_HEADER_SIZE + nevents * 8;
+    words[0] = _occsim_header(handle, DAS2_TYPE_DAS_DATA);
+    words[1] = len;
+    words[2] = (EVENT_FMT_PIXEL << 16) | (nevents & 0xFFFF);
+    words[3] = time / 1000000000ULL;
+    words[4] = time % 1000000000ULL;
+    // Events are static and filled in at open time, only header changes
+
+    return len;
+}
+
+static uint32_t _occsim_make_rtdl(struct occ_handle *handle) {
+    uint32_t *words = (uint32_t *)handle->packet;
+    uint64_t time = _occsim_pulse_time(handle);
+    uint32_t len = RTDL_HEADER_SIZE + RTDL_NUM_FRAMES * 4;
+
+    words[0] = _occsim_header(handle, DAS2_TYPE_RTDL);
+    words[1] = len;
+    words[2] = RTDL_NUM_FRAMES;
+    for (uint32_t i = 0; i < RTDL_NUM_FRAMES; i++) {
+        // Frame id in the upper byte, pulse time bits as data
+        uint32_t data = (i < 2 ? (time >> (i * 24)) : handle->pulse) & 0xFFFFFF;
+        words[3 + i] = ((i + 1) << 24) | data;
+    }
+
+    return len;
+}
+
+static uint32_t _occsim_make_test(struct occ_handle *handle) {
+    uint32_t *words = (uint32_t *)handle->packet;
+    uint32_t len = handle->packet_size & ~7;
+    uint32_t data_len = len - TEST_HEADER_SIZE;
+
+    words[0] = _occsim_header(handle, DAS2_TYPE_TEST);
+    words[1] = len;
+    memset(&words[2], 0, TEST_HEADER_SIZE - DAS2_HEADER_SIZE);
+    words[3] = data_len & 0xFFFFFF;
+    for (uint32_t i = TEST_HEADER_SIZE / 4; i < len / 4; i++) {
+        words[i] = handle->ramp;
+        handle->ramp = (handle->ramp + 1) & 0xFFFFFFF;
+    }
+
+    return len;
+}
+
+/**
+ * Generate next packet and return its length, data points to the packet.
+ */
+static uint32_t _occsim_make_packet(struct occ_handle *handle, const uint8_t **data) {
+    uint32_t len;
+
+    *data = handle->packet;
+    switch (handle->type) {
+    case SIM_TYPE_RTDL:
+        len = _occsim_make_rtdl(handle);
+        handle->pulse++;
+        break;
+    case SIM_TYPE_TEST:
+        len = _occsim_make_test(handle);
+        break;
+    case SIM_TYPE_MIX:
+        if (handle->pulse_packets == 0) {
+            len = _occsim_make_rtdl(handle);
+        } else {
+            len = _occsim_make_das(handle);
+            *data = handle->das_packet;
+        }
+        if (++handle->pulse_packets > DAS_PACKETS_PER_PULSE) {
+            handle->pulse_packets = 0;
+            handle->pulse++;
+        }
+        break;
+    case SIM_TYPE_DAS:
+    default:
+        len = _occsim_make_das(handle);
+        *data = handle->das_packet;
+        handle->pulse++;
+        break;
+    }
+
+    return len;
+}
+
+static void _occsim_ring_event(struct occ_handle *handle) {
+    uint64_t val = 1;
+    (void)!write(handle->event_fd, &val, sizeof(val));
+}
+
+static void _occsim_wake_consumer(struct occ_handle *handle) {
+    if (__atomic_load_n(&handle->cons_waiting, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&handle->lock);
+        pthread_cond_signal(&handle->cons_cond);
+        pthread_mutex_unlock(&handle->lock);
+        _occsim_ring_event(handle);
+    }
+}
+
+static void _occsim_update_stats(struct occ_handle *handle, uint32_t len, uint64_t now) {
+    uint32_t used = occring_used(&handle->ring);
+
+    handle->total_packets++;
+    handle->total_bytes += len;
+    if (used > handle->max_used)
+        handle->max_used = used;
+
+    handle->rate_bytes += len;
+    if (now - handle->rate_ns >= RATE_CHECK_PERIOD) {
+        handle->rx_rate = handle->rate_bytes * 1000000000ULL / (now - handle->rate_ns);
+        handle->rate_ns = now;
+        handle->rate_bytes = 0;
+    }
+}
+
+/**
+ * Inject next fault when its trigger point is reached.
+ *
+ * Called from producer before pushing the packet. Packet may be modified.
+ *
+ * \return true when producer must stop.
+ */
+static bool _occsim_inject_fault(struct occ_handle *handle, const uint8_t **data, uint32_t len, uint64_t now) {
+    static const uint32_t garbage[GLITCH_SIZE / 4] = { 0xDEADBEEF, 0xDEADBEEF, 0xDEADBEEF, 0xDEADBEEF };
+    struct sim_fault *fault = &handle->faults[handle->next_fault];
+    bool stop = false;
+
+    if (fault->by_time ? (now - handle->first_ns < fault->trigger) : (handle->pushed < fault->trigger))
+        return false;
+
+    pthread_mutex_lock(&handle->lock);
+    fault->inject_ns = now;
+    fault->dropped = handle->dropped;
+
+    switch (fault->type) {
+    case SIM_FAULT_STALL:
+        handle->error = -ENOSPC;
+        stop = true;
+        break;
+    case SIM_FAULT_OVERFLOW:
+        handle->error = -EOVERFLOW;
+        stop = true;
+        break;
+    case SIM_FAULT_RESET:
+        // Half of the packet made it to memory before reset, best effort
+        fault->bad_bytes = (len / 2) & ~3;
+        if (occring_push(&handle->ring, *data, fault->bad_bytes) != 0)
+            fault->bad_bytes = 0;
+        handle->error = -ECONNRESET;
+        stop = true;
+        break;
+    case SIM_FAULT_CORRUPT:
+        if (*data != handle->packet) {
+            memcpy(handle->packet, *data, len);
+            *data = handle->packet;
+        }
+        ((uint32_t *)handle->packet)[1] = 0x00FFFFFE;
+        fault->bad_bytes = len;
+        break;
+    case SIM_FAULT_GLITCH:
+        if (occring_push(&handle->ring, garbage, GLITCH_SIZE) == 0)
+            fault->bad_bytes = GLITCH_SIZE;
+        break;
+    }
+
+    // Corrupted packet is accounted for when it's pushed
+    if (fault->type == SIM_FAULT_CORRUPT) {
+        fault->end_pos = handle->pushed + len;
+    } else {
+        handle->pushed += fault->bad_bytes;
+        fault->end_pos = handle->pushed;
+    }
+    fault->injected = true;
+    handle->next_fault++;
+    __atomic_add_fetch(&handle->pending_faults, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&handle->lock);
+
+    return stop;
+}
+
+/**
+ * Check whether application has recovered from injected faults.
+ *
+ * Called by consumer when it's given data, must be called with lock held.
+ */
+static void _occsim_check_recovery(struct occ_handle *handle, uint64_t now) {
+    uint64_t pos = handle->acked + handle->dropped;
+
+    for (uint32_t i = 0; i < handle->next_fault; i++) {
+        struct sim_fault *fault = &handle->faults[i];
+        if (!fault->injected || fault->recovered || pos < fault->end_pos)
+            continue;
+
+        fault->recovered = true;
+        fault->recovery_ns = now - fault->inject_ns;
+        fault->lost = handle->dropped - fault->dropped;
+        if (fault->type != SIM_FAULT_RESET)
+            fault->lost += fault->bad_bytes; // Partial packet is always dropped on reset
+        if (handle->rate > 0 && handle->start_ns > fault->inject_ns) {
+            // Data that was not generated while producer was stopped
+            uint64_t missed = (handle->start_ns - fault->inject_ns) * handle->rate / 1000000000ULL;
+            fault->lost += (handle->rate_pps ? missed * handle->packet_size : missed);
+        }
+        __atomic_sub_fetch(&handle->pending_faults, 1, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * Return time when the next packet is due, 0 when rate is not limited.
+ */
+static uint64_t _occsim_next_due(struct occ_handle *handle) {
+    if (handle->rate == 0)
+        return 0;
+    return handle->start_ns + handle->paced * 1000000000ULL / handle->rate;
+}
+
+static void *_occsim_producer(void *arg) {
+    struct occ_handle *handle = arg;
+    const uint8_t *data = NULL;
+    uint32_t len = 0;   // Length of the pending packet, 0 when none
+
+    pthread_mutex_lock(&handle->lock);
+    while (!handle->shutdown) {
+        uint64_t due;
+        uint64_t now;
+
+        if (!handle->rx_enabled || handle->error != 0) {
+            handle->prod_idle = true;
+            len = 0;
+            pthread_cond_broadcast(&handle->cons_cond);
+            if (handle->error != 0 && handle->cons_waiting)
+                _occsim_ring_event(handle);
+            pthread_cond_wait(&handle->prod_cond, &handle->lock);
+            continue;
+        }
+        if (handle->prod_idle) {
+            handle->prod_idle = false;
+            handle->start_ns = handle->rate_ns = _occsim_now();
+            handle->paced = handle->rate_bytes = 0;
+            if (handle->first_ns == 0)
+                handle->first_ns = handle->start_ns;
+        }
+        pthread_mutex_unlock(&handle->lock);
+
+        // Generate packets without holding the lock until told otherwise
+        while (__atomic_load_n(&handle->rx_enabled, __ATOMIC_ACQUIRE) && !handle->shutdown) {
+            due = _occsim_next_due(handle);
+            now = _occsim_now();
+            if (due > now)
+                break;
+
+            if (len == 0) {
+                len = _occsim_make_packet(handle, &data);
+                if (handle->next_fault < handle->num_faults && _occsim_inject_fault(handle, &data, len, now)) {
+                    len = 0;
+                    break;
+                }
+            }
+
+            if (occring_push(&handle->ring, data, len) != 0) {
+                if (handle->block)
+                    break;
+                // Same as hardware, stop until reset
+                __atomic_store_n(&handle->error, -ENOSPC, __ATOMIC_RELEASE);
+                len = 0;
+                break;
+            }
+
+            handle->pushed += len;
+            _occsim_update_stats(handle, len, now);
+            handle->paced += (handle->rate_pps ? 1 : len);
+            len = 0;
+            _occsim_wake_consumer(handle);
+        }
+
+        pthread_mutex_lock(&handle->lock);
+        if (!handle->rx_enabled || handle->error != 0 || handle->shutdown)
+            continue;
+
+        if (len > 0) {
+            // Block mode, wait for consumer to make room
+            handle->prod_waiting = true;
+            if (len > occring_room(&handle->ring))
+                pthread_cond_wait(&handle->prod_cond, &handle->lock);
+            handle->prod_waiting = false;
+        } else {
+            struct timespec ts;
+            _occsim_abstime(_occsim_next_due(handle), &ts);
+            pthread_cond_timedwait(&handle->prod_cond, &handle->lock, &ts);
+        }
+    }
+    handle->prod_idle = true;
+    pthread_cond_broadcast(&handle->cons_cond);
+    pthread_mutex_unlock(&handle->lock);
+
+    return NULL;
+}
+
+/**
+ * Stop producer and wait until it doesn't touch the ring.
+ *
+ * Must be called with lock held.
+ */
+static void _occsim_stop_producer(struct occ_handle *handle) {
+    __atomic_store_n(&handle->rx_enabled, false, __ATOMIC_RELEASE);
+    pthread_cond_signal(&handle->prod_cond);
+    while (!handle->prod_idle)
+        pthread_cond_wait(&handle->cons_cond, &handle->lock);
+}
+
+int occsim_open(const char *devfile, occ_interface_type type, struct occ_handle **handle) {
+    uint32_t ring_size = DEFAULT_RING_SIZE;
+    bool mirror = false;
+    pthread_condattr_t attr;
+    char *options;
+    int ret;
+
+    if (type != OCC_INTERFACE_SIM)
+        return -EINVAL;
+
+    *handle = malloc(sizeof(struct occ_handle));
+    if (*handle == NULL)
+        return -ENOMEM;
+
+    memset(*handle, 0, sizeof(struct occ_handle));
+    (*handle)->magic = OCC_HANDLE_MAGIC;
+    (*handle)->type = SIM_TYPE_DAS;
+    (*handle)->packet_size = DEFAULT_PACKET_SIZE;
+    (*handle)->prod_idle = true;
+
+    options = strdup(devfile ? devfile : "");
+    if (options == NULL) {
+        free(*handle);
+        *handle = NULL;
+        return -ENOMEM;
+    }
+    ret = _occsim_parse_options(*handle, options, &ring_size, &mirror);
+    free(options);
+
+    if (ret == 0 && (*handle)->packet_size >= ring_size)
+        ret = -EINVAL;
+    if (ret == 0)
+        ret = occring_init(&(*handle)->ring, ring_size, mirror);
+    if (ret != 0) {
+        free(*handle);
+        *handle = NULL;
+        return ret;
+    }
+
+    (*handle)->packet = malloc(MAX_PACKET_SIZE);
+    (*handle)->das_packet = malloc(MAX_PACKET_SIZE);
+    if ((*handle)->packet == NULL || (*handle)->das_packet == NULL) {
+        free((*handle)->das_packet);
+        free((*handle)->packet);
+        occring_free(&(*handle)->ring);
+        free(*handle);
+        *handle = NULL;
+        return -ENOMEM;
+    }
+    // Static events for DAS data packets, neutron pixel format
+    for (uint32_t i = DAS_DATA_HEADER_SIZE / 4; i + 1 < MAX_PACKET_SIZE / 4; i += 2) {
+        ((uint32_t *)(*handle)->das_packet)[i] = i & 0xFFFFFF;
+        ((uint32_t *)(*handle)->das_packet)[i + 1] = i & 0x0FFFFFFF;
+    }
+
+    (*handle)->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ((*handle)->event_fd == -1) {
+        ret = -errno;
+        free((*handle)->das_packet);
+        free((*handle)->packet);
+        occring_free(&(*handle)->ring);
+        free(*handle);
+        *handle = NULL;
+        return ret;
+    }
+
+    pthread_mutex_init(&(*handle)->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&(*handle)->prod_cond, &attr);
+    pthread_cond_init(&(*handle)->cons_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ret = pthread_create(&(*handle)->thread, NULL, _occsim_producer, *handle);
+    if (ret != 0) {
+        pthread_cond_destroy(&(*handle)->cons_cond);
+        pthread_cond_destroy(&(*handle)->prod_cond);
+        pthread_mutex_destroy(&(*handle)->lock);
+        close((*handle)->event_fd);
+        free((*handle)->das_packet);
+        free((*handle)->packet);
+        occring_free(&(*handle)->ring);
+        free(*handle);
+        *handle = NULL;
+        return -ret;
+    }
+
+    return 0;
+}
+
+int occsim_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle) {
+    // Each handle has its own generator, there's nothing to debug
+    return -EINVAL;
+}
+
+int occsim_close(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    pthread_mutex_lock(&handle->lock);
+    handle->shutdown = true;
+    _occsim_stop_producer(handle);
+    pthread_mutex_unlock(&handle->lock);
+    pthread_join(handle->thread, NULL);
+
+    pthread_cond_destroy(&handle->cons_cond);
+    pthread_cond_destroy(&handle->prod_cond);
+    pthread_mutex_destroy(&handle->lock);
+    close(handle->event_fd);
+    free(handle->das_packet);
+    free(handle->packet);
+    occring_free(&handle->ring);
+    free(handle);
+
+    return 0;
+}
+
+int occsim_enable_rx(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    pthread_mutex_lock(&handle->lock);
+    if (enable) {
+        __atomic_store_n(&handle->rx_enabled, true, __ATOMIC_RELEASE);
+        pthread_cond_signal(&handle->prod_cond);
+    } else {
+        _occsim_stop_producer(handle);
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    return 0;
+}
+
+int occsim_enable_old_packets(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Only DAS 2.0 packets are generated
+    return (enable ? -ENOSYS : 0);
+}
+
+int occsim_enable_error_packets(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    return 0;
+}
+
+int occsim_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (bytes >= handle->ring.size || (bytes > 0 && latency_us == 0))
+        return -EINVAL;
+
+    pthread_mutex_lock(&handle->lock);
+    handle->rx_watermark = bytes;
+    handle->rx_latency_us = latency_us;
+    pthread_mutex_unlock(&handle->lock);
+
+    return 0;
+}
+
+int occsim_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || status == NULL)
+        return -EINVAL;
+
+    memset(status, 0, sizeof(occ_status_t));
+
+    status->board = OCC_BOARD_NONE;
+    status->interface = OCC_INTERFACE_SIM;
+    status->dma_size = handle->ring.size;
+    status->dma_used = occring_used(&handle->ring);
+    status->rx_rate = __atomic_load_n(&handle->rx_rate, __ATOMIC_RELAXED);
+    status->stalled = (__atomic_load_n(&handle->error, __ATOMIC_ACQUIRE) == -ENOSPC);
+    status->overflowed = (__atomic_load_n(&handle->error, __ATOMIC_ACQUIRE) == -EOVERFLOW);
+    status->optical_signal = OCC_OPT_CONNECTED;
+    status->rx_enabled = __atomic_load_n(&handle->rx_enabled, __ATOMIC_ACQUIRE);
+
+    return 0;
+}
+
+int occsim_reset(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    pthread_mutex_lock(&handle->lock);
+    _occsim_stop_producer(handle);
+    handle->dropped += occring_used(&handle->ring);
+    occring_reset(&handle->ring);
+    handle->error = 0;
+    handle->stall_seen = false;
+    handle->seq = 0;
+    handle->ramp = 0;
+    handle->pulse_packets = 0;
+    handle->rx_rate = 0;
+    pthread_mutex_unlock(&handle->lock);
+
+    return 0;
+}
+
+int occsim_send(struct occ_handle *handle, const void *data, size_t count) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || (count & 3) != 0)
+        return -EINVAL;
+
+    // Commands go nowhere
+    return count;
+}
+
+int occsim_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    uint64_t start = _occsim_now();
+    uint64_t deadline = start + (uint64_t)timeout * 1000000ULL;
+    uint64_t latency;
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    latency = start + (uint64_t)handle->rx_latency_us * 1000ULL;
+    *address = handle->ring.buf;
+    *count = 0;
+
+    // Doorbell was left armed by previous non-blocking call
+    if (handle->nonblock) {
+        uint64_t val;
+        __atomic_store_n(&handle->cons_waiting, false, __ATOMIC_SEQ_CST);
+        (void)!read(handle->event_fd, &val, sizeof(val));
+    }
+
+    while (true) {
+        uint32_t used = occring_used(&handle->ring);
+        int error = __atomic_load_n(&handle->error, __ATOMIC_ACQUIRE);
+        uint64_t now;
+
+        // Data in the ring is not valid after reset
+        if (error == -ECONNRESET)
+            return error;
+
+        if (used > 0 && (used >= handle->rx_watermark || handle->nonblock || _occsim_now() >= latency)) {
+            ret = occring_peek(&handle->ring, address, count);
+            if (ret == 0 && *count > 0 && __atomic_load_n(&handle->pending_faults, __ATOMIC_ACQUIRE) > 0) {
+                pthread_mutex_lock(&handle->lock);
+                _occsim_check_recovery(handle, _occsim_now());
+                pthread_mutex_unlock(&handle->lock);
+            }
+            if (ret != 0 || *count > 0)
+                return ret;
+        }
+
+        if (used == 0 && error != 0) {
+            // Counted once per stall no matter whether ring filled up or fault was injected
+            if (error == -ENOSPC && !handle->stall_seen) {
+                handle->stall_seen = true;
+                handle->stalls++;
+            }
+            return error;
+        }
+
+        if (handle->nonblock) {
+            // Ask producer for a doorbell, then check again
+            __atomic_store_n(&handle->cons_waiting, true, __ATOMIC_SEQ_CST);
+            if (occring_used(&handle->ring) == used && __atomic_load_n(&handle->error, __ATOMIC_SEQ_CST) == error)
+                return -EAGAIN;
+            __atomic_store_n(&handle->cons_waiting, false, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        now = _occsim_now();
+        if (timeout > 0 && now >= deadline)
+            return -ETIME;
+
+        pthread_mutex_lock(&handle->lock);
+        __atomic_store_n(&handle->cons_waiting, true, __ATOMIC_SEQ_CST);
+        used = occring_used(&handle->ring);
+        if ((used == 0 || used < handle->rx_watermark) && handle->error == 0) {
+            // Wait for data till timeout, or for watermark till latency expires
+            uint64_t wakeup = (used == 0 ? 0 : latency);
+            if (timeout > 0 && (wakeup == 0 || deadline < wakeup))
+                wakeup = deadline;
+
+            if (wakeup == 0) {
+                pthread_cond_wait(&handle->cons_cond, &handle->lock);
+            } else {
+                struct timespec ts;
+                _occsim_abstime(wakeup, &ts);
+                pthread_cond_timedwait(&handle->cons_cond, &handle->lock, &ts);
+            }
+        }
+        __atomic_store_n(&handle->cons_waiting, false, __ATOMIC_SEQ_CST);
+        pthread_mutex_unlock(&handle->lock);
+    }
+}
+
+int occsim_data_ack(struct occ_handle *handle, size_t count) {
+    uint32_t avail;
+    int ret;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    avail = handle->ring.last_count;
+    ret = occring_ack(&handle->ring, count);
+    handle->acked += avail - handle->ring.last_count;
+    if (ret == 0 && count > 0 && handle->block) {
+        pthread_mutex_lock(&handle->lock);
+        if (handle->prod_waiting)
+            pthread_cond_signal(&handle->prod_cond);
+        pthread_mutex_unlock(&handle->lock);
+    }
+
+    return ret;
+}
+
+int occsim_get_fd(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    return handle->event_fd;
+}
+
+int occsim_set_nonblock(struct occ_handle *handle, bool enable) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    // Ring the doorbell for the first data too
+    handle->nonblock = enable;
+    __atomic_store_n(&handle->cons_waiting, enable, __ATOMIC_SEQ_CST);
+    if (enable && occring_used(&handle->ring) > 0)
+        _occsim_ring_event(handle);
+    return 0;
+}
+
+int occsim_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout) {
+    void *address;
+    size_t avail;
+    int ret;
+
+    ret = occsim_data_wait(handle, &address, &avail, timeout);
+    if (ret != 0)
+        return ret;
+
+    if (count > avail)
+        count = avail;
+    count &= ~3;
+    memcpy(data, address, count);
+
+    ret = occsim_data_ack(handle, count);
+    if (ret != 0)
+        return ret;
+
+    return count;
+}
+
+int occsim_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count) {
+    return -ENOSYS;
+}
+
+int occsim_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count) {
+    return -ENOSYS;
+}
+
+int occsim_report(struct occ_handle *handle, FILE *outfile) {
+    static const char *types[] = { "das", "rtdl", "test", "mix" };
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    fprintf(outfile, "Packet type: %s\n", types[handle->type]);
+    fprintf(outfile, "Packet size: %u\n", handle->packet_size);
+    fprintf(outfile, "Rate limit: %llu %s\n", (unsigned long long)handle->rate, handle->rate_pps ? "pps" : "B/s");
+    fprintf(outfile, "Packets generated: %llu\n", (unsigned long long)handle->total_packets);
+    fprintf(outfile, "Bytes generated: %llu\n", (unsigned long long)handle->total_bytes);
+    fprintf(outfile, "Measured rate: %u B/s\n", handle->rx_rate);
+    fprintf(outfile, "Stalls: %llu\n", (unsigned long long)handle->stalls);
+    fprintf(outfile, "Error: %d\n", handle->error);
+    fprintf(outfile, "Ring high watermark: %u\n", handle->max_used);
+    pthread_mutex_lock(&handle->lock);
+    for (uint32_t i = 0; i < handle->num_faults; i++) {
+        struct sim_fault *fault = &handle->faults[i];
+        fprintf(outfile, "Fault %u: %s at %llu%s", i + 1, sim_fault_names[fault->type],
+                (unsigned long long)(fault->by_time ? fault->trigger / 1000000ULL : fault->trigger),
+                fault->by_time ? "ms" : "B");
+        if (!fault->injected)
+            fprintf(outfile, ", not injected\n");
+        else if (!fault->recovered)
+            fprintf(outfile, ", injected at %.3fs, not recovered\n", (fault->inject_ns - handle->first_ns) / 1e9);
+        else
+            fprintf(outfile, ", injected at %.3fs, recovered in %.3fms, lost %llu bytes\n",
+                    (fault->inject_ns - handle->first_ns) / 1e9, fault->recovery_ns / 1e6,
+                    (unsigned long long)fault->lost);
+    }
+    pthread_mutex_unlock(&handle->lock);
+    occring_report(&handle->ring, outfile);
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * OCC library implementation that generates synthetic traffic.
+ *
+ * All the functions herein are implementation specifics of the OCC
+ * library with a different prefix to their names but the same
+ * semantics. See occlib.h for API description.
+ *
+ * \file occlib_sim.h
+ */
+
+#include "occlib_hw.h"
+
+int occsim_open(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occsim_open_debug(const char *devfile, occ_interface_type type, struct occ_handle **handle);
+int occsim_close(struct occ_handle *handle);
+int occsim_enable_rx(struct occ_handle *handle, bool enable);
+int occsim_enable_old_packets(struct occ_handle *handle, bool enable);
+int occsim_enable_error_packets(struct occ_handle *handle, bool enable);
+int occsim_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
+int occsim_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type);
+int occsim_reset(struct occ_handle *handle);
+int occsim_send(struct occ_handle *handle, const void *data, size_t count);
+int occsim_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
+int occsim_data_ack(struct occ_handle *handle, size_t count);
+int occsim_get_fd(struct occ_handle *handle);
+int occsim_set_nonblock(struct occ_handle *handle, bool enable);
+int occsim_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout);
+int occsim_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count);
+int occsim_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count);
+int occsim_report(struct occ_handle *handle, FILE *outfile);
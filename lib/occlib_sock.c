@@ -16,32 +16,53 @@
  * When initialized, the library starts listening on specified port. Incoming
  * client connection every time a function transfering data is invoked. There's
  * no asynchronous checking for client connect.
+ *
+ * Received data is read directly into a ring buffer with the same semantics
+ * as the DMA buffer, no data is moved when acknowledged. Address can be
+ * followed by comma separated options:
+ * - ring=<bytes>       size of the ring buffer, default 16MB, k, M and G suffix accepted
+ * - mirror             map ring twice to always return contiguous data
+ * Example: localhost:7654,ring=64M,mirror
  */
 
 #include "occlib_hw.h"
+#include "occlib_ring.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <netdb.h>
 #include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #define OCC_HANDLE_MAGIC        0x0cc0cc
-#define MAX_OCC_PACKET_SIZE     (1800*8)
-#define BUFFER_SIZE             (1000*MAX_OCC_PACKET_SIZE)
+#define DEFAULT_RING_SIZE       (16 * 1024 * 1024)
+
+#ifndef IOV_MAX
+#define IOV_MAX                 1024    // Linux UIO_MAXIOV, not exported without _XOPEN_SOURCE
+#endif
 
 struct occ_handle {
     uint32_t magic;
     bool rx_enabled;
     int listen_socket;
     int client_socket;
-    uint8_t buffer[BUFFER_SIZE];
-    uint32_t buffer_len;
+    struct occring ring;        //<! Received data, allocated on demand by the kernel
+    bool data_acked;            //<! Some data acknowledged since last occsock_data_wait()
+    uint32_t rx_watermark;      //<! Socket low watermark, 0 when not used
+    uint32_t rx_latency;        //<! Maximum time in ms to wait for watermark
+    bool nonblock;              //<! occsock_data_wait() returns -EAGAIN instead of waiting
+    int epoll_fd;               //<! Watches listening or client socket, -1 until requested
+    uint64_t stats_blocked;     //<! Number of times occsock_data_wait() blocked in poll()
+    uint64_t stats_blocked_ns;  //<! Total time blocked in poll()
 };
 
 static int parse_host(const char *address, struct sockaddr_in *sockaddr) {
@@ -96,7 +117,57 @@ static int open_socket(const char *address) {
     return sock;
 }
 
+static int parse_options(char *options, uint32_t *ring_size, bool *mirror) {
+    char *saveptr = NULL;
+
+    for (char *opt = strtok_r(options, ",", &saveptr); opt != NULL; opt = strtok_r(NULL, ",", &saveptr)) {
+        if (strncmp(opt, "ring=", 5) == 0) {
+            if (occring_parse_size(opt + 5, ring_size) != 0)
+                return -EINVAL;
+        } else if (strcmp(opt, "mirror") == 0) {
+            *mirror = true;
+        } else {
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Point epoll descriptor to whichever socket data comes from next.
+ */
+static void update_epoll(struct occ_handle *handle) {
+    struct epoll_event ev;
+
+    if (handle->epoll_fd < 0)
+        return;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    if (handle->client_socket >= 0) {
+        // Closed client socket is removed automatically
+        epoll_ctl(handle->epoll_fd, EPOLL_CTL_DEL, handle->listen_socket, NULL);
+        ev.data.fd = handle->client_socket;
+        epoll_ctl(handle->epoll_fd, EPOLL_CTL_ADD, handle->client_socket, &ev);
+    } else {
+        ev.data.fd = handle->listen_socket;
+        epoll_ctl(handle->epoll_fd, EPOLL_CTL_ADD, handle->listen_socket, &ev);
+    }
+}
+
+static void close_client(struct occ_handle *handle) {
+    close(handle->client_socket);
+    handle->client_socket = -1;
+    update_epoll(handle);
+}
+
 int occsock_open(const char *address, occ_interface_type type, struct occ_handle **handle) {
+    uint32_t ring_size = DEFAULT_RING_SIZE;
+    bool mirror = false;
+    char *host;
+    char *options;
+    int ret;
 
     if (type != OCC_INTERFACE_SOCKET)
         return -EINVAL;
@@ -107,17 +178,36 @@ int occsock_open(const char *address, occ_interface_type type, struct occ_handle
 
     memset(*handle, 0, sizeof(struct occ_handle));
     (*handle)->magic = OCC_HANDLE_MAGIC;
+    (*handle)->client_socket = -1;
+    (*handle)->epoll_fd = -1;
 
-    (*handle)->listen_socket = open_socket(address);
-    if ((*handle)->listen_socket < 0) {
-        int ret = (*handle)->listen_socket;
+    host = strdup(address);
+    if (host == NULL) {
         free(*handle);
         *handle = NULL;
-        return ret;
+        return -ENOMEM;
     }
-    (*handle)->client_socket = -1;
+    options = strchr(host, ',');
+    if (options != NULL)
+        *options++ = '\0';
+
+    ret = (options != NULL ? parse_options(options, &ring_size, &mirror) : 0);
+    if (ret == 0)
+        ret = occring_init(&(*handle)->ring, ring_size, mirror);
+    if (ret == 0) {
+        (*handle)->listen_socket = open_socket(host);
+        if ((*handle)->listen_socket < 0) {
+            ret = (*handle)->listen_socket;
+            occring_free(&(*handle)->ring);
+        }
+    }
+    free(host);
 
-    return 0;
+    if (ret != 0) {
+        free(*handle);
+        *handle = NULL;
+    }
+    return ret;
 }
 
 int occsock_open_debug(const char *address, occ_interface_type type, struct occ_handle **handle) {
@@ -128,9 +218,12 @@ int occsock_close(struct occ_handle *handle) {
 
     if (handle != NULL && handle->magic == OCC_HANDLE_MAGIC) {
         (void)close(handle->listen_socket);
-        if (handle->client_socket < 0)
+        if (handle->client_socket >= 0)
             (void)close(handle->client_socket);
+        if (handle->epoll_fd >= 0)
+            (void)close(handle->epoll_fd);
 
+        occring_free(&handle->ring);
         free(handle);
     }
 
@@ -167,7 +260,8 @@ int occsock_status(struct occ_handle *handle, occ_status_t *status, occ_status_t
 
     memset(status, 0, sizeof(occ_status_t));
 
-    status->dma_size = 0;
+    status->dma_size = handle->ring.size;
+    status->dma_used = occring_used(&handle->ring);
     status->board = OCC_BOARD_NONE;
     status->interface = OCC_INTERFACE_SOCKET;
     status->firmware_ver = 0x000F0001;
@@ -182,12 +276,12 @@ int occsock_reset(struct occ_handle *handle) {
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    handle->buffer_len = 0;
+    occring_reset(&handle->ring);
+    handle->data_acked = false;
 
     handle->rx_enabled = false;
-    if (handle->client_socket < 0) {
-        close(handle->client_socket);
-        handle->client_socket = -1;
+    if (handle->client_socket >= 0) {
+        close_client(handle);
     }
 
     return 0;
@@ -197,6 +291,18 @@ static size_t _occsock_data_align(size_t size) {
     return (size + 3) & ~3;
 }
 
+static int set_client_rcvlowat(struct occ_handle *handle) {
+    int lowat = (handle->rx_watermark > 0 ? handle->rx_watermark : 1);
+
+    if (handle->client_socket < 0)
+        return 0;
+
+    if (setsockopt(handle->client_socket, SOL_SOCKET, SO_RCVLOWAT, &lowat, sizeof(lowat)) != 0)
+        return -errno;
+
+    return 0;
+}
+
 static int check_client(struct occ_handle *handle, uint32_t timeout) {
     if (handle->client_socket < 0) {
         struct pollfd fds;
@@ -215,6 +321,9 @@ static int check_client(struct occ_handle *handle, uint32_t timeout) {
         handle->client_socket = accept(handle->listen_socket, &client, &len);
         if (handle->client_socket < 0)
             return -ECONNRESET;
+
+        set_client_rcvlowat(handle);
+        update_epoll(handle);
     }
 
     return 0;
@@ -230,19 +339,61 @@ int occsock_send(struct occ_handle *handle, const void *data, size_t count) {
     int ret = write(handle->client_socket, data, count);
     if (ret == -1) {
         ret = -errno;
-        close(handle->client_socket);
-        handle->client_socket = -1;
+        close_client(handle);
     }
     return ret;
 }
 
+int occsock_sendv(struct occ_handle *handle, const struct iovec *iov, int iovcnt) {
+    int sent = 0;
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    for (int i = 0; i < iovcnt; i++) {
+        if (_occsock_data_align(iov[i].iov_len) != iov[i].iov_len)
+            return -EINVAL;
+    }
+
+    if (check_client(handle, 0) != 0)
+        return -ENOTCONN;
+
+    for (int i = 0; i < iovcnt; i += IOV_MAX) {
+        int ret = writev(handle->client_socket, &iov[i], (iovcnt - i < IOV_MAX ? iovcnt - i : IOV_MAX));
+        if (ret == -1) {
+            ret = -errno;
+            close_client(handle);
+            return (sent > 0 ? sent : ret);
+        }
+        sent += ret;
+    }
+    return sent;
+}
+
+int occsock_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    if (bytes >= handle->ring.size || (bytes > 0 && latency_us == 0))
+        return -EINVAL;
+
+    handle->rx_watermark = bytes;
+    handle->rx_latency = (latency_us + 999) / 1000;
+    return set_client_rcvlowat(handle);
+}
+
 static int wait_for_ready_read(struct occ_handle *handle, uint32_t timeout) {
 
     struct pollfd pollfd;
     int ret;
 
-    if (check_client(handle, timeout) != 0)
+    if (handle->nonblock) {
+        if (check_client(handle, 0) != 0 || !handle->rx_enabled)
+            return -EAGAIN;
+    } else if (check_client(handle, timeout) != 0) {
         return -ETIME;
+    }
 
     if (!handle->rx_enabled)
         return -ETIME;
@@ -250,72 +401,178 @@ static int wait_for_ready_read(struct occ_handle *handle, uint32_t timeout) {
     // Pretend we didn't wait for client - might wait longer the first time client connects
     pollfd.fd = handle->client_socket;
     pollfd.events = POLLIN;
-    ret = poll(&pollfd, 1, timeout > 0 ? timeout : -1);
-    if (ret == -1)
-        return -errno;
-    else if (ret == 0)
-        return -ETIME;
-    else if (pollfd.revents & POLLERR)
+    while (1) {
+        int wait = (timeout > 0 ? (int)timeout : -1);
+        char byte;
+
+        if (handle->nonblock)
+            wait = 0;
+
+        // Socket low watermark delays POLLIN, don't wait for it longer than latency
+        if (handle->rx_watermark > 0 && (wait == -1 || handle->rx_latency < (uint32_t)wait))
+            wait = handle->rx_latency;
+
+        if (wait != 0) {
+            struct timespec t1, t2;
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            ret = poll(&pollfd, 1, wait);
+            clock_gettime(CLOCK_MONOTONIC, &t2);
+            handle->stats_blocked++;
+            handle->stats_blocked_ns += (int64_t)(t2.tv_sec - t1.tv_sec) * 1000000000LL + (t2.tv_nsec - t1.tv_nsec);
+        } else {
+            ret = poll(&pollfd, 1, wait);
+        }
+        if (ret == -1)
+            return -errno;
+        else if (ret > 0)
+            break;
+
+        // Watermark not reached in time, take whatever is there
+        if (handle->rx_watermark > 0 && recv(handle->client_socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) > 0)
+            return 0;
+
+        if (handle->nonblock)
+            return -EAGAIN;
+        if (timeout == 0)
+            continue;
+        if (timeout <= (uint32_t)wait)
+            return -ETIME;
+        timeout -= wait;
+    }
+
+    if (pollfd.revents & POLLERR)
         return -ECONNRESET;
 
     return 0;
 }
 
+/**
+ * Read as much data as available from socket into the ring without blocking.
+ *
+ * \return Number of bytes read, -EAGAIN when no data, -ENOSPC when ring is full.
+ */
+static int read_client(struct occ_handle *handle) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    int ret;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = occring_reserve(&handle->ring, iov);
+    if (msg.msg_iovlen == 0)
+        return -ENOSPC;
+
+    // Don't block on socket low watermark, wait_for_ready_read() does that
+    ret = recvmsg(handle->client_socket, &msg, MSG_DONTWAIT);
+    if (ret <= 0) {
+        if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return -EAGAIN;
+        ret = (ret == -1 ? -errno : -ECONNRESET);
+        close_client(handle);
+        return ret;
+    }
+
+    occring_commit(&handle->ring, ret);
+    return ret;
+}
+
 int occsock_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout) {
+    uint32_t used;
     int ret;
 
     if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    *address = handle->buffer;
+    *address = handle->ring.buf;
     *count = 0;
 
-    ret = wait_for_ready_read(handle, timeout);
-    if (ret != 0)
-        return ret;
-
-    ret = read(handle->client_socket, &handle->buffer[handle->buffer_len], sizeof(handle->buffer) - handle->buffer_len);
-    if (ret <= 0) {
-        ret = (ret == -1 ? -errno : -ECONNRESET);
-        close(handle->client_socket);
-        handle->client_socket = -1;
-        return ret;
+    // Application processed some data last time, let it process the rest
+    // before waiting for more. Same when there's data it hasn't seen yet,
+    // ie. second part of the packet split at the end of ring.
+    used = occring_used(&handle->ring);
+    if (used > 0 && (handle->data_acked || used > handle->ring.last_count)) {
+        handle->data_acked = false;
+        return occring_peek(&handle->ring, address, count);
     }
 
-    handle->buffer_len += ret;
-    *address = handle->buffer;
-    *count = handle->buffer_len;
+    // Opportunistic read avoids poll() at high rates, but not with watermark
+    ret = -EAGAIN;
+    if (handle->rx_watermark == 0 && handle->rx_enabled && handle->client_socket >= 0)
+        ret = read_client(handle);
 
-    return 0;
+    if (ret == -EAGAIN) {
+        ret = wait_for_ready_read(handle, timeout);
+        if (ret != 0)
+            return ret;
+        ret = read_client(handle);
+    }
+    // Full ring is not an error, application needs to consume data first
+    if (ret < 0 && ret != -ENOSPC && ret != -EAGAIN)
+        return ret;
+
+    handle->data_acked = false;
+    ret = occring_peek(&handle->ring, address, count);
+    if (ret == 0 && *count == 0 && handle->nonblock)
+        return -EAGAIN;
+    return ret;
 }
 
 int occsock_data_ack(struct occ_handle *handle, size_t count) {
+    int ret;
 
-    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC || _occsock_data_align(count) != count)
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    ret = occring_ack(&handle->ring, count);
+    if (ret == 0)
+        handle->data_acked = (count > 0 && occring_used(&handle->ring) > 0);
+    return ret;
+}
+
+int occsock_get_fd(struct occ_handle *handle) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
         return -EINVAL;
 
-    if (count > handle->buffer_len)
-        count = handle->buffer_len;
+    // Socket changes when clients come and go, hand out a stable descriptor
+    if (handle->epoll_fd < 0) {
+        handle->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (handle->epoll_fd < 0)
+            return -errno;
+        update_epoll(handle);
+    }
+
+    return handle->epoll_fd;
+}
+
+int occsock_set_nonblock(struct occ_handle *handle, bool enable) {
 
-    // Move not consumed data from the end of the buffer to the front, no effect if count == buffer_len
-    memmove(handle->buffer, &handle->buffer[count], handle->buffer_len - count);
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
 
-    handle->buffer_len -= count;
+    handle->nonblock = enable;
     return 0;
 }
 
 int occsock_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout) {
+    void *address;
+    size_t avail;
     int ret;
 
-    ret = wait_for_ready_read(handle, timeout);
+    ret = occsock_data_wait(handle, &address, &avail, timeout);
     if (ret != 0)
         return ret;
 
-    ret = read(handle->client_socket, data, count);
-    if (ret == -1)
-        return -errno;
+    if (count > avail)
+        count = avail;
+    count &= ~3;
+    memcpy(data, address, count);
 
-    return ret;
+    ret = occsock_data_ack(handle, count);
+    if (ret != 0)
+        return ret;
+
+    return count;
 }
 
 int occsock_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count) {
@@ -333,3 +590,33 @@ int occsock_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, co
 
     return -ENOSYS;
 }
+
+int occsock_report(struct occ_handle *handle, FILE *outfile) {
+
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    fprintf(outfile, "Client connected: %s\n", handle->client_socket >= 0 ? "yes" : "no");
+    fprintf(outfile, "RX enabled: %s\n", handle->rx_enabled ? "yes" : "no");
+    occring_report(&handle->ring, outfile);
+
+    return 0;
+}
+
+int occsock_get_stats(struct occ_handle *handle, occ_stats_t *stats) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    stats->blocked = handle->stats_blocked;
+    stats->blocked_ns = handle->stats_blocked_ns;
+    return 0;
+}
+
+int occsock_reset_stats(struct occ_handle *handle) {
+    if (handle == NULL || handle->magic != OCC_HANDLE_MAGIC)
+        return -EINVAL;
+
+    handle->stats_blocked = 0;
+    handle->stats_blocked_ns = 0;
+    return 0;
+}
@@ -22,11 +22,18 @@ int occsock_close(struct occ_handle *handle);
 int occsock_enable_rx(struct occ_handle *handle, bool enable);
 int occsock_enable_old_packets(struct occ_handle *handle, bool enable);
 int occsock_enable_error_packets(struct occ_handle *handle, bool enable);
+int occsock_set_rx_watermark(struct occ_handle *handle, uint32_t bytes, uint32_t latency_us);
 int occsock_status(struct occ_handle *handle, occ_status_t *status, occ_status_type type);
 int occsock_reset(struct occ_handle *handle);
 int occsock_send(struct occ_handle *handle, const void *data, size_t count);
+int occsock_sendv(struct occ_handle *handle, const struct iovec *iov, int iovcnt);
 int occsock_data_wait(struct occ_handle *handle, void **address, size_t *count, uint32_t timeout);
 int occsock_data_ack(struct occ_handle *handle, size_t count);
+int occsock_get_fd(struct occ_handle *handle);
+int occsock_set_nonblock(struct occ_handle *handle, bool enable);
 int occsock_read(struct occ_handle *handle, void *data, size_t count, uint32_t timeout);
 int occsock_io_read(struct occ_handle *handle, uint8_t bar, uint32_t offset, uint32_t *data, uint32_t count);
 int occsock_io_write(struct occ_handle *handle, uint8_t bar, uint32_t offset, const uint32_t *data, uint32_t count);
+int occsock_report(struct occ_handle *handle, FILE *outfile);
+int occsock_get_stats(struct occ_handle *handle, occ_stats_t *stats);
+int occsock_reset_stats(struct occ_handle *handle);
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Static tracepoints on the OCC library hot path.
+ *
+ * When library is built with -DOCC_USDT, macros expand to USDT probes
+ * from <sys/sdt.h> (systemtap-sdt-dev or systemtap-sdt-devel package)
+ * under provider "occlib". An inactive probe is a single nop instruction
+ * plus a note in the ELF file, so it's safe to ship in production builds.
+ * Tracers attach to a running process without rebuilding, ie.
+ *
+ *   bpftrace -e 'usdt:/usr/lib/libocc.so:occlib:data_wait_return
+ *                { @bytes = hist(arg2); }'
+ *
+ * Without OCC_USDT the macros expand to nothing and arguments are not
+ * evaluated.
+ *
+ * Available probes in occlib_drv.c:
+ * - data_wait_enter(cons_off, ack, timeout)
+ * - data_wait_return(ret, cons_off, count)
+ * - data_wait_blocked(ns) after returning from poll() or blocking read
+ * - data_ack(ret, cons_off, count)
+ * - rollover(cons_off, headlen, taillen)
+ * - send(ret, count)
+ * - reset(ret)
+ *
+ * \file occlib_trace.h
+ */
+
+#ifndef OCCLIB_TRACE_H_INCLUDED
+#define OCCLIB_TRACE_H_INCLUDED
+
+#ifdef OCC_USDT
+
+#include <sys/sdt.h>
+
+#define OCC_TRACE1(name, a1)                DTRACE_PROBE1(occlib, name, a1)
+#define OCC_TRACE2(name, a1, a2)            DTRACE_PROBE2(occlib, name, a1, a2)
+#define OCC_TRACE3(name, a1, a2, a3)        DTRACE_PROBE3(occlib, name, a1, a2, a3)
+
+#else
+
+#define OCC_TRACE1(name, a1)                do {} while (0)
+#define OCC_TRACE2(name, a1, a2)            do {} while (0)
+#define OCC_TRACE3(name, a1, a2, a3)        do {} while (0)
+
+#endif // OCC_USDT
+
+#endif // OCCLIB_TRACE_H_INCLUDED
@@ -19,8 +19,8 @@
 
 #define log_ratelimit(period, ...) logRateLimit(__LINE__, period, __VA_ARGS__)
 
-GuiNcurses::GuiNcurses(const char *occDevice, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters, uint32_t statsInt)
-    : m_occAdapter(occDevice, oldpkts, initRegisters)
+GuiNcurses::GuiNcurses(const char *occDevice, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters, uint32_t statsInt, bool monitor)
+    : m_occAdapter(occDevice, oldpkts, initRegisters, monitor)
     , m_runtime(0.0)
     , m_shutdown(false)
     , m_paused(false)
@@ -281,6 +281,42 @@ void GuiNcurses::resetOcc()
     }
 }
 
+/**
+ * Format time in seconds with suitable unit, ie. 12.50ms
+ */
+static std::string formatTime(double time)
+{
+    char buffer[32];
+
+    if (time >= 1.0)
+        snprintf(buffer, sizeof(buffer), "%.2fs", time);
+    else if (time >= 1e-3)
+        snprintf(buffer, sizeof(buffer), "%.2fms", time * 1e3);
+    else
+        snprintf(buffer, sizeof(buffer), "%.2fus", time * 1e6);
+    return std::string(buffer);
+}
+
+void GuiNcurses::logLibStats()
+{
+    OccAdapter::LibStats stats;
+
+    try {
+        m_occAdapter.getLibStats(stats);
+    } catch (std::runtime_error &e) {
+        log("ERROR: %s", e.what());
+        return;
+    }
+
+    log("Lib: waits=%" PRIu64 " empty=%" PRIu64 " acks=%" PRIu64 " batch p50<%" PRIu64 "B p99<%" PRIu64 "B",
+        stats.waits, stats.emptyWaits, stats.acks, stats.batchP50, stats.batchP99);
+    log("Lib: wait p50<%s p99<%s ack p50<%s p99<%s",
+        formatTime(stats.waitP50).c_str(), formatTime(stats.waitP99).c_str(),
+        formatTime(stats.ackP50).c_str(), formatTime(stats.ackP99).c_str());
+    log("Lib: blocked=%" PRIu64 " for %s rollovers=%" PRIu64 " stalls=%" PRIu64,
+        stats.blocked, formatTime(stats.blockedTime).c_str(), stats.rollovers, stats.stalls);
+}
+
 void GuiNcurses::input()
 {
     switch (wgetch(stdscr)) {
@@ -314,6 +350,10 @@ void GuiNcurses::input()
     case 'I':
         showRegistersWin();
         break;
+    case 'o':
+    case 'O':
+        logLibStats();
+        break;
     case 'l':
     case 'L':
         m_statsLogInt *= -1;
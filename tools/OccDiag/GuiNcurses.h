@@ -41,7 +41,7 @@ class GuiNcurses {
         WinRegisters m_winRegisters;
         WinStats m_winStats;
     public:
-        GuiNcurses(const char *occDevice, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters, uint32_t statsInt);
+        GuiNcurses(const char *occDevice, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters, uint32_t statsInt, bool monitor);
         ~GuiNcurses();
 
         void run();
@@ -104,6 +104,11 @@ class GuiNcurses {
          * Reset OCC, re-enable RX, make a log entry.
          */
         void resetOcc();
+
+        /**
+         * Log digest of OCC library RX path statistics.
+         */
+        void logLibStats();
 };
 
 #endif // GUI_NCURSES_H
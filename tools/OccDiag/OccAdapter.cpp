@@ -24,16 +24,23 @@
 #include <occlib_hw.h>
 #include <stdexcept>
 
-OccAdapter::OccAdapter(const std::string &devfile, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters)
+OccAdapter::OccAdapter(const std::string &devfile, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters, bool monitor)
     : m_occ(NULL)
     , m_initRegisters(initRegisters)
     , m_oldPkts(oldpkts)
+    , m_monitor(monitor)
 {
     int ret;
     occ_status_t status;
 
-    if ((ret = occ_open(devfile.c_str(), OCC_INTERFACE_OPTICAL, &m_occ)) != 0)
+    if (monitor) {
+        // Never slow down the process that owns the device
+        if ((ret = occ_open_monitor(devfile.c_str(), OCC_INTERFACE_OPTICAL, true, &m_occ)) != 0)
+            throw std::runtime_error("Failed to open OCC device monitor - " + occErrorString(ret));
+        m_initRegisters.clear();
+    } else if ((ret = occ_open(devfile.c_str(), OCC_INTERFACE_OPTICAL, &m_occ)) != 0) {
         throw std::runtime_error("Failed to open OCC device - " + occErrorString(ret));
+    }
 
     if ((ret = occ_enable_old_packets(m_occ, oldpkts)) != 0) {
         std::string enable = (oldpkts?"enable":"disable");
@@ -62,10 +69,14 @@ OccAdapter::~OccAdapter()
 
 void OccAdapter::reset()
 {
+    occ_reset_stats(m_occ);
+
+    // Board belongs to somebody else, monitor only follows replaced DMA buffer
     if (occ_reset(m_occ) != 0)
-        throw std::runtime_error("Failed to reset OCC board");
+        throw std::runtime_error(m_monitor ? "Failed to remap OCC DMA buffer" : "Failed to reset OCC board");
 
-    setupRegisters();
+    if (!m_monitor)
+        setupRegisters();
 }
 
 void OccAdapter::setupRegisters()
@@ -198,6 +209,48 @@ void OccAdapter::getOccStatus(size_t &used, bool &stalled, bool &overflowed)
     overflowed = status.overflowed;
 }
 
+/**
+ * Return value below which given fraction of log2 histogram samples are.
+ */
+static uint64_t histPercentile(const uint64_t *hist, double fraction)
+{
+    uint64_t total = 0;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < OCC_STATS_BINS; i++)
+        total += hist[i];
+    for (int i = 0; i < OCC_STATS_BINS; i++) {
+        sum += hist[i];
+        if (sum > 0 && sum >= fraction * total)
+            return (i == 0 ? 0 : (1ULL << i));
+    }
+    return 0;
+}
+
+void OccAdapter::getLibStats(LibStats &stats)
+{
+    occ_stats_t raw;
+    int ret;
+
+    if ((ret = occ_get_stats(m_occ, &raw)) != 0)
+        throw std::runtime_error("Can't get OCC library stats - " + occErrorString(ret));
+
+    stats.waits = raw.waits;
+    stats.emptyWaits = raw.empty_waits;
+    stats.stalls = raw.stalls;
+    stats.bytes = raw.wait_bytes;
+    stats.acks = raw.acks;
+    stats.blocked = raw.blocked;
+    stats.blockedTime = raw.blocked_ns / 1e9;
+    stats.rollovers = raw.rollovers;
+    stats.batchP50 = histPercentile(raw.batch_hist, 0.50);
+    stats.batchP99 = histPercentile(raw.batch_hist, 0.99);
+    stats.waitP50 = histPercentile(raw.wait_hist, 0.50) / 1e9;
+    stats.waitP99 = histPercentile(raw.wait_hist, 0.99) / 1e9;
+    stats.ackP50 = histPercentile(raw.ack_hist, 0.50) / 1e9;
+    stats.ackP99 = histPercentile(raw.ack_hist, 0.99) / 1e9;
+}
+
 std::map<uint32_t, uint32_t> OccAdapter::getRegisters()
 {
     std::map<uint32_t, uint32_t> registers;
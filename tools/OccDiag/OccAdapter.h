@@ -46,7 +46,32 @@ class OccAdapter {
             }
         };
 
-        OccAdapter(const std::string &devfile, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters);
+        /**
+         * Digest of OCC library RX path statistics.
+         *
+         * Percentiles are upper bounds of log2 histogram bins.
+         */
+        struct LibStats {
+            uint64_t waits;
+            uint64_t emptyWaits;
+            uint64_t stalls;
+            uint64_t bytes;
+            uint64_t acks;
+            uint64_t blocked;
+            double blockedTime;         //!< Total time blocked in kernel in seconds
+            uint64_t rollovers;
+            uint64_t batchP50;          //!< Bytes per wait
+            uint64_t batchP99;
+            double waitP50;             //!< Time spent in wait in seconds
+            double waitP99;
+            double ackP50;              //!< Time from data to ack in seconds
+            double ackP99;
+        };
+
+        /**
+         * Open OCC device, in monitor mode only watch data of another process.
+         */
+        OccAdapter(const std::string &devfile, bool oldpkts, const std::map<uint32_t, uint32_t> &initRegisters, bool monitor);
         ~OccAdapter();
 
         void reset();
@@ -73,6 +98,11 @@ class OccAdapter {
          */
         std::map<uint32_t, uint32_t> getRegisters();
 
+        /**
+         * Retrieve OCC library RX path statistics, throws on error.
+         */
+        void getLibStats(LibStats &stats);
+
         /**
          * Take as much data as available in DMA and process it.
          *
@@ -97,6 +127,7 @@ class OccAdapter {
         std::map<uint32_t, uint32_t> m_initRegisters;
         bool m_isPcie;
         bool m_oldPkts;
+        bool m_monitor;
 
         void *m_dmaAddr;
         size_t m_dmaSize;
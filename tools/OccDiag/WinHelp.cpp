@@ -16,7 +16,7 @@ WinHelp::WinHelp()
 void WinHelp::show()
 {
     if (!m_window) {
-        int rows = 9; // Number of lines of text in redraw()
+        int rows = 10; // Number of lines of text in redraw()
         int cols = 50; // Max length of any line
         int width, height;
         getmaxyx(stdscr, height, width);
@@ -42,11 +42,12 @@ void WinHelp::redraw(bool frame)
     mvwprintw(m_window,  2, 1, "d - show data");
     mvwprintw(m_window,  3, 1, "i - show registers");
     mvwprintw(m_window,  4, 1, "l - toggle statistics log lines (%s)    ", statsLogEn);
-    mvwprintw(m_window,  5, 1, "c - show console");
-    mvwprintw(m_window,  6, 1, "p - pause/unpause processing");
-    mvwprintw(m_window,  7, 1, "s - stop/continue processing, toggles RX");
-    mvwprintw(m_window,  8, 1, "r - restart, clear all counters, reset OCC");
-    mvwprintw(m_window,  9, 1, "q - quit");
+    mvwprintw(m_window,  5, 1, "o - log OCC library RX statistics");
+    mvwprintw(m_window,  6, 1, "c - show console");
+    mvwprintw(m_window,  7, 1, "p - pause/unpause processing");
+    mvwprintw(m_window,  8, 1, "s - stop/continue processing, toggles RX");
+    mvwprintw(m_window,  9, 1, "r - restart, clear all counters, reset OCC");
+    mvwprintw(m_window, 10, 1, "q - quit");
 
     Window::redraw(frame);
 }
@@ -36,6 +36,8 @@ static void usage(const char *progname) {
     std::cout << std::endl;
     std::cout << "Options:" << std::endl;
     std::cout << "  -l <interval>   Periodically print statistics log, interval in seconds" << std::endl;
+    std::cout << "  -m              Monitor data of another process using the device, skip data" << std::endl;
+    std::cout << "                  when falling behind. Reset and registers are disabled." << std::endl;
     std::cout << "  -o              Enable DAS 1.0 style packets" << std::endl;
     std::cout << "  -r <addr> <val> Set register value on startup and on reset." << std::endl;
     std::cout << "  -t <rate>       Enable test pattern at specified rate MB/s " << std::endl;
@@ -66,6 +68,7 @@ int main(int argc, char **argv)
     std::map<uint32_t, uint32_t> registers;
     uint32_t statsInt = 0;
     bool oldpkts = false;
+    bool monitor = false;
 
     sigact.sa_handler = &sighandler;
     sigact.sa_flags = 0;
@@ -109,6 +112,9 @@ int main(int argc, char **argv)
         if (key == "-o") {
             oldpkts = true;
         }
+        if (key == "-m") {
+            monitor = true;
+        }
         if (key == "-t") {
             if ((i + 1) >= argc) {
                 usage(argv[0]);
@@ -146,7 +152,7 @@ int main(int argc, char **argv)
     }
 
     try {
-        analyzer = new GuiNcurses(devfile, oldpkts, registers, statsInt);
+        analyzer = new GuiNcurses(devfile, oldpkts, registers, statsInt, monitor);
         analyzer->run();
         delete analyzer;
     } catch (std::exception &e) {
@@ -0,0 +1,167 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Receives OCC data with the C++20 coroutine layer from occlib_async.hpp.
+ *
+ * One coroutine consumes packets from the stream while another one prints
+ * progress every second, both driven by a single occ::executor thread.
+ * Third coroutine checks that a second waiter on the same stream is turned
+ * away with -EBUSY instead of stealing the batch. Defaults to the traffic
+ * simulator so that it runs without hardware, which makes it usable as a
+ * build check.
+ */
+
+#include <occlib_async.hpp>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strerror
+#include <unistd.h>
+
+using namespace std;
+
+struct rx_context {
+    uint64_t target;
+    uint32_t timeout;
+    bool quiet;
+    bool done;
+    int status;
+    int busy_status;
+    uint64_t packets;
+    uint64_t bytes;
+
+    rx_context() :
+        target(100000),
+        timeout(1000),
+        quiet(false),
+        done(false),
+        status(0),
+        busy_status(0),
+        packets(0),
+        bytes(0)
+    {}
+};
+
+static void usage(const char *progname) {
+    printf("Usage: %s [OPTION]\n", progname);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -d, --device FILE        Receive from OCC device instead of simulator\n");
+    printf("  -s, --sim OPTIONS        Simulator options (defaults to type=test,rate=20M)\n");
+    printf("  -n, --packets NUM        Number of packets to receive (defaults to 100000)\n");
+    printf("  -t, --timeout MS         Time to wait for each batch (defaults to 1000)\n");
+    printf("  -q, --quiet              Don't print progress\n");
+    printf("\n");
+}
+
+static occ::task consume(occ::packet_stream &stream, rx_context &ctx) {
+    while (ctx.packets < ctx.target) {
+        occ::batch batch = co_await stream.next_batch(ctx.timeout);
+        if (batch.status != 0) {
+            ctx.status = batch.status;
+            break;
+        }
+        for (size_t i = 0; i < batch.count; i++)
+            ctx.bytes += batch.packets[i].length;
+        ctx.packets += batch.count;
+    }
+    ctx.done = true;
+}
+
+static occ::task intrude(occ::executor &ex, occ::packet_stream &stream, rx_context &ctx) {
+    // Consumer is suspended in next_batch() whenever this one runs, let
+    // data pile up so that there's something to steal
+    co_await occ::sleep_for(ex, 10);
+    usleep(20000);
+    occ::batch batch = co_await stream.next_batch(ctx.timeout);
+    ctx.busy_status = batch.status;
+}
+
+static occ::task progress(occ::executor &ex, rx_context &ctx) {
+    uint64_t last = 0;
+    while (!ctx.done) {
+        co_await occ::sleep_for(ex, 1000);
+        if (!ctx.quiet)
+            printf("%llu packets, %llu packets/s\n", (unsigned long long)ctx.packets, (unsigned long long)(ctx.packets - last));
+        last = ctx.packets;
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *devfile = "type=test,rate=20M";
+    occ_interface_type type = OCC_INTERFACE_SIM;
+    struct occ_handle *handle;
+    rx_context ctx;
+    int ret;
+
+    for (int i = 1; i < argc; i++) {
+        const char *key = argv[i];
+
+        if (strncmp(key, "-h", 2) == 0 || strncmp(key, "--help", 6) == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(key, "-d", 2) == 0 || strncmp(key, "--device", 8) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            devfile = argv[++i];
+            type = OCC_INTERFACE_OPTICAL;
+        }
+        if (strncmp(key, "-s", 2) == 0 || strncmp(key, "--sim", 5) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            devfile = argv[++i];
+            type = OCC_INTERFACE_SIM;
+        }
+        if (strncmp(key, "-n", 2) == 0 || strncmp(key, "--packets", 9) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            ctx.target = strtoull(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-t", 2) == 0 || strncmp(key, "--timeout", 9) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            ctx.timeout = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-q", 2) == 0 || strncmp(key, "--quiet", 7) == 0)
+            ctx.quiet = true;
+    }
+
+    ret = occ_open(devfile, type, &handle);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: cannot open OCC: %s\n", strerror(-ret));
+        return 3;
+    }
+    ret = occ_enable_rx(handle, true);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: cannot enable RX: %s\n", strerror(-ret));
+        occ_close(handle);
+        return 3;
+    }
+
+    {
+        occ::executor ex;
+        occ::packet_stream stream(ex, handle);
+
+        consume(stream, ctx);
+        intrude(ex, stream, ctx);
+        progress(ex, ctx);
+        ex.run();
+    }
+    occ_close(handle);
+
+    printf("Received %llu packets, %llu bytes\n", (unsigned long long)ctx.packets, (unsigned long long)ctx.bytes);
+    if (ctx.status != 0) {
+        fprintf(stderr, "ERROR: stream failed: %s\n", strerror(-ctx.status));
+        return 2;
+    }
+    if (ctx.busy_status != -EBUSY) {
+        fprintf(stderr, "ERROR: second waiter got %d instead of -EBUSY\n", ctx.busy_status);
+        return 2;
+    }
+    return 0;
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Replays recorded RX rate trace through the driver's adaptive interrupt
+ * coalescing controller and reports how well it kept both budgets.
+ *
+ * Trace has one line per second with RX rate in B/s, number of packets
+ * and optionally number of end-of-train interrupts the firmware raises
+ * regardless of coalescing. Lines starting with # are ignored.
+ * Simulated interrupt count for each second is packets divided by the
+ * coalescing value selected in the previous second plus end-of-train
+ * interrupts, but never more than packets.
+ *
+ * Controller only learns about a rate change at the end of the period,
+ * so the first period after packet count changes by more than 25% is a
+ * transient. Exits with error when any other period exceeds a budget.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strerror
+
+#include <sns-occ-coalesce.h>
+
+using namespace std;
+
+static void usage(const char *progname) {
+    printf("Usage: %s [OPTION]\n", progname);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -f, --file FILE          Trace file (defaults to stdin)\n");
+    printf("  -l, --latency US         Latency budget in microseconds (defaults to 1000)\n");
+    printf("  -m, --max-irqs RATE      CPU budget in interrupts per second (defaults to 5000)\n");
+    printf("  -c, --check PERCENT      Also exit with error when more than PERCENT of\n");
+    printf("                           periods exceed any budget, transients included\n");
+    printf("  -q, --quiet              Only print summary\n");
+    printf("\n");
+}
+
+int main(int argc, char **argv) {
+    const char *path = NULL;
+    uint32_t latency_us = 1000;
+    uint32_t max_irqs = 5000;
+    double check = -1.0;
+    bool quiet = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *key = argv[i];
+
+        if (strncmp(key, "-h", 2) == 0 || strncmp(key, "--help", 6) == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(key, "-f", 2) == 0 || strncmp(key, "--file", 6) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            path = argv[++i];
+        }
+        if (strncmp(key, "-l", 2) == 0 || strncmp(key, "--latency", 9) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            latency_us = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-m", 2) == 0 || strncmp(key, "--max-irqs", 10) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            max_irqs = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-c", 2) == 0 || strncmp(key, "--check", 7) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            check = strtod(argv[++i], NULL);
+        }
+        if (strncmp(key, "-q", 2) == 0 || strncmp(key, "--quiet", 7) == 0)
+            quiet = true;
+    }
+    if (max_irqs == 0) {
+        fprintf(stderr, "ERROR: CPU budget must be positive\n");
+        return 1;
+    }
+
+    FILE *f = (path ? fopen(path, "r") : stdin);
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: cannot open %s (%s)\n", path, strerror(errno));
+        return 3;
+    }
+
+    struct occ_coalesce c;
+    occ_coalesce_init(&c, latency_us, max_irqs);
+
+    char line[256];
+    unsigned periods = 0;
+    unsigned over_cpu = 0;
+    unsigned over_latency = 0;
+    unsigned settled_bad = 0;
+    unsigned long prev_packets = 0;
+
+    if (!quiet)
+        printf("%6s %12s %10s %10s %8s %12s\n", "time", "rx_rate", "packets", "irqs", "value", "latency [us]");
+    while (fgets(line, sizeof(line), f)) {
+        unsigned long rate, packets, eop = 0;
+
+        if (line[0] == '#' || sscanf(line, "%lu %lu %lu", &rate, &packets, &eop) < 2)
+            continue;
+
+        // Interrupts raised in this period with the value selected in previous one
+        uint64_t irqs = (packets + c.value - 1) / c.value + eop;
+        if (irqs > packets)
+            irqs = packets;
+
+        // Worst case time between interrupts, no data means no added latency
+        double latency = (irqs > 0 ? 1e6 / irqs : 0.0);
+        bool cpu_bad = (irqs > max_irqs);
+        bool latency_bad = (latency_us > 0 && latency > latency_us && packets > irqs);
+
+        // Controller had a period to react unless packet count jumped
+        bool transient = (periods == 0 || packets * 4 > prev_packets * 5 || packets * 5 < prev_packets * 4);
+        prev_packets = packets;
+
+        periods++;
+        if (cpu_bad)
+            over_cpu++;
+        if (latency_bad)
+            over_latency++;
+        if ((cpu_bad || latency_bad) && !transient)
+            settled_bad++;
+
+        if (!quiet || ((cpu_bad || latency_bad) && !transient))
+            printf("%6u %12lu %10lu %10llu %8u %12.0f%s%s%s\n", periods - 1, rate, packets,
+                   (unsigned long long)irqs, c.value, latency, cpu_bad ? " CPU" : "", latency_bad ? " LATENCY" : "",
+                   (cpu_bad || latency_bad) && transient ? " (transient)" : "");
+
+        occ_coalesce_update(&c, rate, irqs, 1000);
+    }
+    if (path)
+        fclose(f);
+
+    if (periods == 0) {
+        fprintf(stderr, "ERROR: no samples in trace\n");
+        return 3;
+    }
+
+    double bad = 100.0 * (over_cpu + over_latency) / periods;
+    printf("%u periods, %u over CPU budget, %u over latency budget (%.1f%%), %u not transient\n",
+           periods, over_cpu, over_latency, bad, settled_bad);
+
+    return (settled_bad > 0 || (check >= 0.0 && bad > check) ? 2 : 0);
+}
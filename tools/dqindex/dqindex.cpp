@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Exercises DMA queue consumer index logic shared by the driver and
+ * user space. Hand picked corner cases are followed by an exhaustive
+ * comparison against a straightforward model of the ring on a small
+ * queue. Exits with non-zero status on first mismatch.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <sns-occ.h>
+
+using namespace std;
+
+static unsigned failed = 0;
+
+static void expect(const char *name, uint32_t size, uint32_t prod, uint32_t cons, uint32_t len, int ok, uint32_t new_cons) {
+    uint32_t out = 0xDEADBEEF;
+    int ret = occ_dq_advance(size, prod, cons, len, &out);
+
+    if (ret != ok || (ok && out != new_cons)) {
+        fprintf(stderr, "FAIL: %s: size=%u prod=%u cons=%u len=%u => ret=%d cons=%u, expected ret=%d cons=%u\n",
+                name, size, prod, cons, len, ret, out, ok, new_cons);
+        failed++;
+    }
+}
+
+/**
+ * Reference model, consumer can advance by any non-zero multiple of 4
+ * bytes that doesn't exceed data currently in the queue.
+ */
+static int model(uint32_t size, uint32_t prod, uint32_t cons, uint32_t len, uint32_t *new_cons) {
+    uint64_t used = (prod + size - cons) % size;
+    uint64_t aligned = ((uint64_t)len + 3) / 4 * 4;
+
+    if (aligned == 0 || aligned > used)
+        return 0;
+    *new_cons = (cons + aligned) % size;
+    return 1;
+}
+
+int main() {
+    // Plain advance
+    expect("advance", 64, 32, 0, 16, 1, 16);
+    expect("advance to prod", 64, 32, 0, 32, 1, 32);
+
+    // Wrap-around, data from 56 to the end and from the start to 8
+    expect("wrap inside tail", 64, 8, 56, 4, 1, 60);
+    expect("wrap to start", 64, 8, 56, 8, 1, 0);
+    expect("wrap past start", 64, 8, 56, 12, 1, 4);
+    expect("wrap to prod", 64, 8, 56, 16, 1, 8);
+    expect("wrap past prod", 64, 8, 56, 20, 0, 0);
+
+    // Zero length
+    expect("zero", 64, 32, 0, 0, 0, 0);
+    expect("zero empty", 64, 0, 0, 0, 0, 0);
+
+    // Lengths not aligned to 4 bytes are rounded up
+    expect("unaligned", 64, 32, 0, 13, 1, 16);
+    expect("unaligned 1", 64, 32, 0, 1, 1, 4);
+    expect("unaligned past prod", 64, 16, 0, 13, 1, 16);
+    expect("unaligned round past prod", 64, 16, 0, 17, 0, 0);
+    expect("unaligned overflow", 64, 32, 0, 0xFFFFFFFD, 0, 0);
+
+    // Lengths of the queue size or larger
+    expect("queue size", 64, 60, 0, 64, 0, 0);
+    expect("larger than queue", 64, 60, 0, 100, 0, 0);
+    expect("larger than queue wrap", 64, 8, 56, 128 + 4, 0, 0);
+
+    // Lengths larger than data in the queue
+    expect("past used", 64, 16, 0, 20, 0, 0);
+    expect("empty", 64, 16, 16, 4, 0, 0);
+    expect("past used wrap", 64, 4, 60, 12, 0, 0);
+
+    // Compare against the model for every state of a small queue
+    const uint32_t size = 64;
+    for (uint32_t prod = 0; prod < size; prod += 4) {
+        for (uint32_t cons = 0; cons < size; cons += 4) {
+            for (uint32_t len = 0; len <= 2 * size; len++) {
+                uint32_t expected = 0;
+                int ok = model(size, prod, cons, len, &expected);
+                expect("model", size, prod, cons, len, ok, expected);
+            }
+        }
+    }
+
+    if (failed > 0) {
+        fprintf(stderr, "%u checks failed\n", failed);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Decodes interrupt latency histograms exported by the driver through
+ * debugfs and prints percentiles for each interrupt cause.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strerror
+
+#include <sns-occ.h>
+
+using namespace std;
+
+static const char *cause_names[OCC_IRQ_CAUSES] = { "rx", "stall", "overflow" };
+
+static void usage(const char *progname) {
+    printf("Usage: %s [OPTION]\n", progname);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -f, --file FILE          Histogram file (defaults to /sys/kernel/debug/snsocc0/irq_hist)\n");
+    printf("  -v, --verbose            Print all non-empty histogram bins\n");
+    printf("  -c, --clear              Clear histograms after reading them\n");
+    printf("\n");
+}
+
+/**
+ * Return upper bound in ticks of the bin where given fraction of samples is reached.
+ */
+static uint64_t percentile(const uint64_t *hist, uint64_t count, uint32_t max, double fraction) {
+    uint64_t sum = 0;
+
+    for (unsigned i = 0; i < OCC_IRQ_HIST_BINS; i++) {
+        sum += hist[i];
+        if (sum > 0 && sum >= fraction * count) {
+            uint64_t bound = (i == 0 ? 0 : (1ULL << i) - 1);
+            return (bound < max ? bound : max);
+        }
+    }
+    return max;
+}
+
+static void print_row(const char *name, const char *what, const uint64_t *hist, uint64_t count, uint32_t max, uint32_t tick_ns) {
+    printf("%-9s %-9s %12llu %10.2f %10.2f %10.2f %10.2f\n", name, what, (unsigned long long)count,
+           percentile(hist, count, max, 0.50) * tick_ns / 1e3,
+           percentile(hist, count, max, 0.99) * tick_ns / 1e3,
+           percentile(hist, count, max, 0.999) * tick_ns / 1e3,
+           max * tick_ns / 1e3);
+}
+
+static void print_bins(const char *what, const uint64_t *hist, uint32_t tick_ns) {
+    printf("  %s:\n", what);
+    for (unsigned i = 0; i < OCC_IRQ_HIST_BINS; i++) {
+        if (hist[i] == 0)
+            continue;
+        double low = (i == 0 ? 0 : (1ULL << (i - 1))) * tick_ns / 1e3;
+        double high = (i == 0 ? 0 : (1ULL << i)) * tick_ns / 1e3;
+        printf("    %10.2f - %10.2f us %12llu%s\n", low, high, (unsigned long long)hist[i],
+               (i == OCC_IRQ_HIST_BINS - 1 ? " (and more)" : ""));
+    }
+}
+
+int main(int argc, char **argv) {
+    const char *path = "/sys/kernel/debug/snsocc0/irq_hist";
+    bool verbose = false;
+    bool clear = false;
+    struct occ_irq_hist hist;
+
+    for (int i = 1; i < argc; i++) {
+        const char *key = argv[i];
+
+        if (strncmp(key, "-h", 2) == 0 || strncmp(key, "--help", 6) == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(key, "-f", 2) == 0 || strncmp(key, "--file", 6) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            path = argv[++i];
+        }
+        if (strncmp(key, "-v", 2) == 0 || strncmp(key, "--verbose", 9) == 0)
+            verbose = true;
+        if (strncmp(key, "-c", 2) == 0 || strncmp(key, "--clear", 7) == 0)
+            clear = true;
+    }
+
+    FILE *f = fopen(path, clear ? "r+" : "r");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: cannot open %s (%s)\n", path, strerror(errno));
+        return 3;
+    }
+    size_t len = fread(&hist, 1, sizeof(hist), f);
+    if (len != sizeof(hist) || hist.version != OCC_IRQ_HIST_VERSION ||
+        hist.bins != OCC_IRQ_HIST_BINS || hist.causes != OCC_IRQ_CAUSES) {
+        fprintf(stderr, "ERROR: unsupported histogram format in %s\n", path);
+        fclose(f);
+        return 3;
+    }
+    if (clear && (fseek(f, 0, SEEK_SET) != 0 || fputc('1', f) == EOF || fflush(f) != 0))
+        fprintf(stderr, "WARNING: failed to clear histograms (%s)\n", strerror(errno));
+    fclose(f);
+
+    printf("%-9s %-9s %12s %10s %10s %10s %10s\n", "cause", "", "count", "p50 [us]", "p99 [us]", "p99.9 [us]", "max [us]");
+    for (unsigned c = 0; c < OCC_IRQ_CAUSES; c++) {
+        if (hist.cause[c].count == 0)
+            continue;
+        print_row(cause_names[c], "delay", hist.cause[c].delay, hist.cause[c].count, hist.cause[c].delay_max, hist.tick_ns);
+        print_row(cause_names[c], "proctime", hist.cause[c].proctime, hist.cause[c].count, hist.cause[c].proctime_max, hist.tick_ns);
+        if (verbose) {
+            print_bins("delay", hist.cause[c].delay, hist.tick_ns);
+            print_bins("proctime", hist.cause[c].proctime, hist.tick_ns);
+        }
+    }
+
+    return 0;
+}
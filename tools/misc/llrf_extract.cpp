@@ -1,3 +1,4 @@
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -32,29 +33,34 @@ int main(int argc, char **argv) {
     // Skip adding new line, samples below will do it
 
     while (remain_samples > 0) {
-        uint32_t *data = nullptr;
-        size_t size;
-        ret = occ_data_wait(occ, reinterpret_cast<void**>(&data), &size, 0);
+        occ_packet_t packets[32];
+        size_t count = sizeof(packets) / sizeof(packets[0]);
+        ret = occ_packet_next(occ, packets, &count, nullptr, 0);
+        if (ret == -ENODATA)
+            continue;
         if (ret != 0) {
             fprintf(stderr, "ERROR: Failed to receive data from OCC: %s\n", strerror(-ret));
             break;
         }
 
-        if (size < 16 || data[1] < 16) {
-            fprintf(stderr, "ERROR: Inbound packet too short, must be at least 16 bytes\n");
-            break;
-        }
+        for (size_t n = 0; n < count && remain_samples > 0; n++) {
+            if (packets[n].length < 16) {
+                fprintf(stderr, "ERROR: Inbound packet too short, must be at least 16 bytes\n");
+                remain_samples = 0;
+                break;
+            }
 
-        uint32_t length = data[1] - 16;
-        data += 4;
-        for (uint32_t i = 0; i < length/4; i++) {
-            printf("%c%u", (i%16)==0 ? '\n' : '\t', data[i]);
+            const uint32_t *data = static_cast<const uint32_t *>(packets[n].data) + 4;
+            uint32_t length = packets[n].length - 16;
+            for (uint32_t i = 0; i < length/4; i++) {
+                printf("%c%u", (i%16)==0 ? '\n' : '\t', data[i]);
 
-            if ((i%16) == 0 && --remain_samples == 0)
-                break;
+                if ((i%16) == 0 && --remain_samples == 0)
+                    break;
+            }
         }
 
-        occ_data_ack(occ, 16+length);
+        occ_packet_ack(occ);
     }
 
     occ_close(occ);
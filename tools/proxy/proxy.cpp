@@ -37,7 +37,7 @@
 #include <unistd.h>
 #include <vector>
 
-static const int TIMEOUT = 10;  // Timeout for OCC and stdin
+static const int TIMEOUT = 10;  // Idle tick and timeout for stdin/stdout
 static bool running = true;     // SigHandler will flip it to false
 
 static void usage(const char *progname) {
@@ -54,17 +54,21 @@ static void usage(const char *progname) {
     cout << "Options:" << endl;
     cout << "  -o, --old-packets    Force SNS DAS 1.0 packets" << endl;
     cout << "  -p, --port <PORT>    Establish TCP server and push data through socket instead" << endl;
+    cout << "  -s, --shm <PATH>     Publish data through shared memory to local OCC_INTERFACE_SHM" << endl;
+    cout << "                       consumers connecting to PATH, data from stdin is ignored" << endl;
     cout << endl;
     cout << "Examples:" << endl;
     cout << "  * save OCC output to file: " << progname << " /dev/occ1 > /tmp/occ.raw" << endl;
     cout << "  * create TCP proxy on port 2000: " << progname << " -p 2000 /dev/occ1" << endl;
+    cout << "  * share data with local processes: " << progname << " -s /tmp/occ1.shm /dev/occ1" << endl;
     cout << endl;
 }
 
-bool parseArgs(int argc, char **argv, std::string &devFile, bool &oldPackets, uint16_t &port) {
+bool parseArgs(int argc, char **argv, std::string &devFile, bool &oldPackets, uint16_t &port, std::string &shmPath) {
     oldPackets = false;
     devFile.clear();
     port = 0;
+    shmPath.clear();
 
     for (int i = 1; i < argc; i++) {
         std::string key(argv[i]);
@@ -84,6 +88,12 @@ bool parseArgs(int argc, char **argv, std::string &devFile, bool &oldPackets, ui
             }
             port = port_;
         }
+        else if (key == "-s" || key == "--shm") {
+            if (++i >= argc) {
+                return false;
+            }
+            shmPath = argv[i];
+        }
         else if (key[0] != '-') {
             devFile = argv[i];
         }
@@ -120,6 +130,7 @@ class FileIO {
         , m_eof(false)
         {}
 
+        virtual ~FileIO() {}
 
         virtual void handleError() {
             throw std::runtime_error("Can't recover from stdout/stdin error");
@@ -133,7 +144,19 @@ class FileIO {
             return m_eof;
         }
 
-        virtual void write(const char *data, size_t size) {
+        /**
+         * Descriptor that becomes readable when there's data for OCC, -1 if none.
+         */
+        virtual int pollFd() {
+            return m_readFile;
+        }
+
+        /**
+         * Write data and return number of bytes consumed.
+         */
+        virtual size_t write(const char *data, size_t size) {
+            size_t total = size;
+
             while (size > 0) {
                 // Use poll() to avoid busy waiting
                 struct pollfd pollfd;
@@ -160,6 +183,7 @@ class FileIO {
                     break;
                 }
             }
+            return total;
         }
 
         virtual bool read(char *data, size_t size) {
@@ -278,6 +302,11 @@ class TcpSocket : public FileIO {
             return false;
         }
 
+        int pollFd() {
+            // New client connects in read()
+            return (m_readFile != -1 ? m_readFile : m_listenSock);
+        }
+
         void listen(uint16_t port) {
             struct sockaddr_in address;
             address.sin_family = AF_INET;
@@ -324,12 +353,13 @@ class TcpSocket : public FileIO {
             return (m_readFile != -1 && m_writeFile != -1);
         }
 
-        void write(const char *data, size_t size) {
+        size_t write(const char *data, size_t size) {
             if (m_readFile == -1 || m_writeFile == -1) {
+                // Nobody listening, throw data away
                 if (!connectClient(0))
-                    return;
+                    return size;
             }
-            FileIO::write(data, size);
+            return FileIO::write(data, size);
         }
 
         bool read(char *data, size_t size) {
@@ -341,6 +371,84 @@ class TcpSocket : public FileIO {
         }
 };
 
+class ShmPublisher : public FileIO {
+    private:
+        struct occ_shm_publisher *m_publisher;
+        size_t m_maxChunk;
+    public:
+        static const uint32_t SHM_SIZE = 64 * 1024 * 1024;
+
+        ShmPublisher(const std::string &path)
+        : m_publisher(NULL)
+        , m_maxChunk(SHM_SIZE / 4)
+        {
+            m_readFile = m_writeFile = -1;
+            int ret = occ_shm_publisher_open(path.c_str(), SHM_SIZE, &m_publisher);
+            if (ret != 0) {
+                throw std::runtime_error(std::string("Failed to create shared memory: ") + strerror(-ret));
+            }
+        }
+
+        ~ShmPublisher() {
+            occ_shm_publisher_close(m_publisher);
+        }
+
+        bool eof() {
+            return false;
+        }
+
+        int pollFd() {
+            return -1;
+        }
+
+        /**
+         * Publish complete packets only, the rest stays in OCC buffer.
+         *
+         * Consumers join at any publish boundary and must start with
+         * a packet header.
+         */
+        size_t write(const char *data, size_t size) {
+            size_t len = 0;
+
+            while (len < size && len < m_maxChunk) {
+                const uint32_t *header = reinterpret_cast<const uint32_t *>(data + len);
+                size_t packetLen;
+
+                if (m_oldPackets) {
+                    if (size - len < 24)
+                        break;
+                    packetLen = header[3] + 24;
+                } else {
+                    if (size - len < 8)
+                        break;
+                    packetLen = header[1];
+                }
+                if (packetLen < 8 || packetLen > m_maxChunk) {
+                    throw std::runtime_error("Invalid packet based on length");
+                }
+                if (len + packetLen > size)
+                    break;
+                len += packetLen;
+            }
+            if (len == 0)
+                return 0;
+
+            // Slow consumers apply back-pressure all the way to OCC
+            int ret = occ_shm_publish(m_publisher, data, len, TIMEOUT);
+            if (ret == -ETIME || ret == -EINTR)
+                return 0;
+            if (ret < 0) {
+                throw std::runtime_error(std::string("Failed to publish data: ") + strerror(-ret));
+            }
+            return len;
+        }
+
+        bool read(char *data, size_t size) {
+            // Nothing to send to OCC, use the time to accept new consumers
+            occ_shm_publish(m_publisher, NULL, 0, 0);
+            return false;
+        }
+};
 
 class OccHandler {
     private:
@@ -371,25 +479,41 @@ class OccHandler {
                 m_occ.reset();
                 throw std::runtime_error(std::string("Failed to enable RX: ") + strerror(-ret));
             }
+            if ((ret = occ_set_nonblock(m_occ.get(), true)) != 0) {
+                m_occ.reset();
+                throw std::runtime_error(std::string("Failed to enable non-blocking mode: ") + strerror(-ret));
+            }
 
             m_buffer.reserve(BUFFER_SIZE);
             if (oldPackets)
                 m_fileIO->enableOldPackets();
         }
 
+        int fd() {
+            int ret = occ_get_fd(m_occ.get());
+            if (ret < 0) {
+                throw std::runtime_error(std::string("Failed to get OCC descriptor: ") + strerror(-ret));
+            }
+            return ret;
+        }
+
         void transferFromOcc() {
             void *addr;
             size_t count;
 
-            // Poll OCC for some data and write it to stdout
-            int ret = occ_data_wait(m_occ.get(), &addr, &count, TIMEOUT);
-            if (ret == 0) {
-                m_fileIO->write(reinterpret_cast<char *>(addr), count);
-                occ_data_ack(m_occ.get(), count);
-            } else {
-                if (ret != -ENODATA && ret != -ETIME && ret != -EINTR) {
-                    throw std::runtime_error(std::string("Can not read from OCC: ") + strerror(-ret));
+            // Move everything OCC has to stdout, descriptor only signals new data
+            while (running) {
+                int ret = occ_data_wait(m_occ.get(), &addr, &count, 0);
+                if (ret != 0) {
+                    if (ret != -EAGAIN && ret != -ENODATA && ret != -EINTR) {
+                        throw std::runtime_error(std::string("Can not read from OCC: ") + strerror(-ret));
+                    }
+                    break;
                 }
+                count = m_fileIO->write(reinterpret_cast<char *>(addr), count);
+                occ_data_ack(m_occ.get(), count);
+                if (count == 0)
+                    break;
             }
         }
 
@@ -411,9 +535,10 @@ int main(int argc, char **argv) {
     bool oldPackets = false;
     std::string devFile;
     uint16_t port = 0;
+    std::string shmPath;
     FileIO *fileIO;
 
-    if (!parseArgs(argc, argv, devFile, oldPackets, port)) {
+    if (!parseArgs(argc, argv, devFile, oldPackets, port, shmPath)) {
         usage(argv[0]);
         return 1;
     }
@@ -427,6 +552,13 @@ int main(int argc, char **argv) {
             std::cerr << "ERROR: " << e.what() << std::endl;
             return 1;
         }
+    } else if (!shmPath.empty()) {
+        try {
+            fileIO = new ShmPublisher(shmPath);
+        } catch (std::runtime_error &e) {
+            std::cerr << "ERROR: " << e.what() << std::endl;
+            return 1;
+        }
     } else {
         fileIO = new FileIO;
     }
@@ -440,21 +572,35 @@ int main(int argc, char **argv) {
     sigaction(SIGINT, &sigact, NULL);
 
     try {
-        unsigned dice = 0;
         OccHandler occ(devFile, oldPackets, fileIO);
+        struct pollfd fds[2];
+        fds[0].fd = occ.fd();
+        fds[0].events = POLLIN;
         while (running) {
-            if ((dice++ % 2) == 0) {
+            fds[1].fd = fileIO->pollFd();
+            fds[1].events = POLLIN;
+            fds[0].revents = fds[1].revents = 0;
+
+            int ret = ::poll(fds, 2, TIMEOUT);
+            if (ret == -1 && errno != EINTR) {
+                throw std::runtime_error(std::string("Failed to poll: ") + strerror(errno));
+            }
+            if (fds[0].revents != 0) {
                 occ.transferFromOcc();
-            } else {
+            }
+            // Idle timeout lets shared memory publisher accept new consumers
+            if (fds[1].revents != 0 || ret == 0) {
                 occ.transferToOcc();
             }
         }
     } catch (std::runtime_error &e) {
         if (!fileIO->eof()) {
             std::cerr << "ERROR: " << e.what() << std::endl;
+            delete fileIO;
             return 1;
         }
     }
 
+    delete fileIO;
     return 0;
 }
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Benchmarks the driver's unified DQ emulation in user space.
+ *
+ * Queues have the same sizes as in the driver. Each round fills IMQ
+ * with up to batch size packets, their payload is already in hardware
+ * queues. The emulation then copies them to unified DQ and consumer
+ * immediately frees the space again. Only the copying is timed.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strerror
+#include <time.h>
+
+#include <sns-occ-rxemu.h>
+
+#define DQ_SIZE         (2 * 1024 * 1024)   // OCC_DQ_SIZE in driver
+#define CQ_SIZE         (64 * 1024)         // OCC_CQ_SIZE in driver
+#define IMQ_SIZE        4096                // SW_IMQ_RING_SIZE in driver
+
+using namespace std;
+
+static void usage(const char *progname) {
+    printf("Usage: %s [OPTION]\n", progname);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -s, --size BYTES         Packet payload size (defaults to 1800)\n");
+    printf("  -b, --batch NUM          Packets copied per batch (defaults to 64)\n");
+    printf("  -c, --commands PERCENT   Percentage of command packets (defaults to 0)\n");
+    printf("  -n, --packets NUM        Total number of packets (defaults to 10000000)\n");
+    printf("  -v, --verify             Verify copied data\n");
+    printf("\n");
+}
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void fill(struct occ_rxemu_ring *ring, uint8_t seed) {
+    for (uint32_t i = 0; i < ring->size; i++)
+        ring->base[i] = (uint8_t)(i * 7 + seed);
+}
+
+static void read_ring(const struct occ_rxemu_ring *ring, uint32_t offset, void *dst, uint32_t len) {
+    for (uint32_t i = 0; i < len; i++)
+        ((char *)dst)[i] = ring->base[(offset + i) % ring->size];
+}
+
+/**
+ * Check packets in unified DQ from offset on, source location of each
+ * payload was saved in the IMQ info fields.
+ */
+static bool verify(struct occ_rxemu *e, uint32_t offset, int packets) {
+    for (int n = 0; n < packets; n++) {
+        struct sw_imq imq;
+        read_ring(&e->dq, offset, &imq, sizeof(imq));
+        offset = (offset + sizeof(imq)) % e->dq.size;
+
+        struct occ_rxemu_ring *src = (imq.type & IMQ_TYPE_COMMAND ? &e->hwcq : &e->hwdq);
+        uint32_t length = (imq.length + 3) & ~3;
+        for (uint32_t i = 0; i < length; i++) {
+            if (e->dq.base[(offset + i) % e->dq.size] != src->base[(imq.info[0] + i) % src->size]) {
+                fprintf(stderr, "ERROR: packet %u payload mismatch at byte %u\n", imq.info[1], i);
+                return false;
+            }
+        }
+        offset = (offset + length) % e->dq.size;
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    uint32_t size = 1800;
+    uint32_t batch = 64;
+    uint32_t commands = 0;
+    uint64_t total = 10000000;
+    bool check = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *key = argv[i];
+
+        if (strncmp(key, "-h", 2) == 0 || strncmp(key, "--help", 6) == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(key, "-s", 2) == 0 || strncmp(key, "--size", 6) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            size = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-b", 2) == 0 || strncmp(key, "--batch", 7) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            batch = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-c", 2) == 0 || strncmp(key, "--commands", 10) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            commands = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-n", 2) == 0 || strncmp(key, "--packets", 9) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            total = strtoull(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-v", 2) == 0 || strncmp(key, "--verify", 8) == 0)
+            check = true;
+    }
+    if (batch == 0 || batch >= IMQ_SIZE) {
+        fprintf(stderr, "ERROR: batch must be between 1 and %u\n", IMQ_SIZE - 1);
+        return 1;
+    }
+    if (((size + 3) & ~3) >= CQ_SIZE / 2) {
+        fprintf(stderr, "ERROR: packet size must be less than %u\n", CQ_SIZE / 2);
+        return 1;
+    }
+    if (commands > 100) {
+        fprintf(stderr, "ERROR: invalid commands percentage\n");
+        return 1;
+    }
+
+    struct occ_rxemu e;
+    memset(&e, 0, sizeof(e));
+    e.imq = new struct sw_imq[IMQ_SIZE];
+    e.imq_size = IMQ_SIZE;
+    e.hwdq.base = new char[DQ_SIZE];
+    e.hwdq.size = DQ_SIZE;
+    e.hwcq.base = new char[CQ_SIZE];
+    e.hwcq.size = CQ_SIZE;
+    e.dq.base = new char[DQ_SIZE];
+    e.dq.size = DQ_SIZE;
+    fill(&e.hwdq, 1);
+    fill(&e.hwcq, 3);
+    memset(e.dq.base, 0, DQ_SIZE);
+
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t batches = 0;
+    uint64_t elapsed = 0;
+    uint32_t length = (size + 3) & ~3;
+
+    while (packets < total) {
+        // Hardware received packets, firmware published their IMQ entries
+        for (uint32_t i = 0; i < batch && packets + i < total; i++) {
+            bool cmd = ((packets + i) % 100 < commands);
+            struct occ_rxemu_ring *src = (cmd ? &e.hwcq : &e.hwdq);
+            if (occ_rxemu_used(src) + length >= src->size)
+                break;
+
+            struct sw_imq *imq = &e.imq[e.imq_prod];
+            imq->dest = 0;
+            imq->src = 0;
+            imq->type = (cmd ? IMQ_TYPE_COMMAND : 0);
+            imq->length = size;
+            imq->info[0] = src->prod;
+            imq->info[1] = (uint32_t)(packets + i);
+            src->prod = (src->prod + length) % src->size;
+            e.imq_prod = (e.imq_prod + 1) % e.imq_size;
+        }
+
+        // Consumer keeps up with the data
+        e.dq_room = e.dq.size - 1;
+        uint32_t offset = e.dq.prod;
+
+        uint64_t t0 = now_ns();
+        int ret = occ_rxemu_batch(&e, batch);
+        elapsed += now_ns() - t0;
+
+        if (ret <= 0) {
+            fprintf(stderr, "ERROR: batch failed (%s)\n", ret < 0 ? strerror(-ret) : "no packets");
+            return 3;
+        }
+        if (check && !verify(&e, offset, ret))
+            return 2;
+
+        packets += ret;
+        bytes += ret * (sizeof(struct sw_imq) + length);
+        batches++;
+    }
+
+    double secs = elapsed / 1e9;
+    printf("%llu packets in %llu batches, %.1f ns/packet, %.2f Mpackets/s, %.1f MB/s\n",
+           (unsigned long long)packets, (unsigned long long)batches,
+           (double)elapsed / packets, packets / secs / 1e6, bytes / secs / 1e6);
+
+    delete [] e.imq;
+    delete [] e.hwdq.base;
+    delete [] e.hwcq.base;
+    delete [] e.dq.base;
+    return 0;
+}
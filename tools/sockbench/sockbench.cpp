@@ -0,0 +1,285 @@
+/*
+ * Copyright (c) 2018 Oak Ridge National Laboratory.
+ * All rights reserved.
+ * See file LICENSE that is included with this distribution.
+ *
+ * Measures OCC socket backend receive throughput against plain TCP loopback.
+ *
+ * Sender thread streams DAS data packets over localhost as fast as it can.
+ * First run receives them with plain recv() into a buffer, which is the
+ * upper limit of the link. Second run receives them through the OCC API
+ * socket backend, parsing packets and acknowledging them the way real
+ * consumers do.
+ */
+
+#include <occlib.h>
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h> // strerror
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+struct bench_context {
+    unsigned port;
+    unsigned packet_size;
+    double duration;
+    const char *options;
+
+    bench_context() :
+        port(7660),
+        packet_size(4096),
+        duration(5.0),
+        options("")
+    {}
+};
+
+struct bench_result {
+    uint64_t bytes;
+    uint64_t packets;
+    double elapsed;
+
+    bench_result() :
+        bytes(0),
+        packets(0),
+        elapsed(0.0)
+    {}
+};
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *progname) {
+    printf("Usage: %s [OPTION]\n", progname);
+    printf("\n");
+    printf("Options:\n");
+    printf("  -p, --port PORT          Local TCP port to use (defaults to 7660)\n");
+    printf("  -s, --size BYTES         Packet size (defaults to 4096)\n");
+    printf("  -t, --time SECONDS       Duration of each run (defaults to 5)\n");
+    printf("  -o, --options OPTIONS    Socket backend options, ie. ring=64M,mirror\n");
+    printf("\n");
+}
+
+static int connect_local(unsigned port) {
+    struct sockaddr_in addr;
+    int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sock < 0)
+        return -errno;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    for (int i = 0; i < 100; i++) {
+        if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            return sock;
+        usleep(10000);
+    }
+
+    int ret = -errno;
+    close(sock);
+    return ret;
+}
+
+/**
+ * Send DAS data packets until time runs out or receiver goes away.
+ */
+static void sender(const bench_context *ctx) {
+    vector<uint32_t> buffer(1024 * 1024 / 4);
+    size_t len = 0;
+    uint32_t seq = 0;
+
+    // Fill buffer with as many packets as fit, events don't matter
+    while (len + ctx->packet_size <= buffer.size() * 4) {
+        uint32_t *packet = &buffer[len / 4];
+        packet[0] = (1 << 28) | (0x7 << 20) | (seq++ & 0xFF);
+        packet[1] = ctx->packet_size;
+        len += ctx->packet_size;
+    }
+
+    int sock = connect_local(ctx->port);
+    if (sock < 0) {
+        fprintf(stderr, "ERROR: cannot connect to port %u (%s)\n", ctx->port, strerror(-sock));
+        return;
+    }
+
+    double end = now() + ctx->duration;
+    while (now() < end) {
+        const uint8_t *data = reinterpret_cast<const uint8_t *>(&buffer[0]);
+        size_t remain = len;
+        while (remain > 0) {
+            ssize_t ret = write(sock, data, remain);
+            if (ret <= 0) {
+                close(sock);
+                return;
+            }
+            data += ret;
+            remain -= ret;
+        }
+    }
+    close(sock);
+}
+
+static int run_plain(const bench_context *ctx, bench_result *result) {
+    struct sockaddr_in addr;
+    int opt = 1;
+    int lsock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (lsock < 0)
+        return -errno;
+
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(ctx->port);
+    if (bind(lsock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(lsock, 1) != 0) {
+        int ret = -errno;
+        close(lsock);
+        return ret;
+    }
+
+    thread t(sender, ctx);
+    int sock = accept(lsock, NULL, NULL);
+    close(lsock);
+    if (sock < 0) {
+        t.join();
+        return -errno;
+    }
+
+    vector<uint8_t> buffer(16 * 1024 * 1024);
+    double start = now();
+    while (true) {
+        ssize_t ret = recv(sock, &buffer[0], buffer.size(), 0);
+        if (ret <= 0)
+            break;
+        result->bytes += ret;
+    }
+    result->elapsed = now() - start;
+    result->packets = result->bytes / ctx->packet_size;
+
+    close(sock);
+    t.join();
+    return 0;
+}
+
+static int run_occ(const bench_context *ctx, bench_result *result) {
+    struct occ_handle *occ;
+    char devfile[256];
+    int ret;
+
+    snprintf(devfile, sizeof(devfile), "localhost:%u%s%s", ctx->port + 1, ctx->options[0] ? "," : "", ctx->options);
+    ret = occ_open(devfile, OCC_INTERFACE_SOCKET, &occ);
+    if (ret != 0)
+        return ret;
+    occ_enable_rx(occ, true);
+
+    bench_context octx = *ctx;
+    octx.port = ctx->port + 1;
+    thread t(sender, &octx);
+
+    double start = 0.0;
+    while (true) {
+        void *data;
+        size_t count;
+        size_t consumed = 0;
+
+        ret = occ_data_wait(occ, &data, &count, 1000);
+        if (ret != 0)
+            break;
+        if (start == 0.0)
+            start = now();
+
+        // Walk complete packets like a real consumer would
+        while (consumed + 8 <= count) {
+            const uint32_t *packet = reinterpret_cast<const uint32_t *>(static_cast<uint8_t *>(data) + consumed);
+            if (packet[1] < 8 || consumed + packet[1] > count)
+                break;
+            consumed += packet[1];
+            result->packets++;
+        }
+        result->bytes += consumed;
+
+        ret = occ_data_ack(occ, consumed);
+        if (ret != 0)
+            break;
+    }
+    result->elapsed = now() - start;
+
+    t.join();
+    occ_close(occ);
+    return (ret == -ECONNRESET || ret == -ETIME ? 0 : ret);
+}
+
+static void print_result(const char *name, const bench_result *result) {
+    printf("%-12s %12.1f MB/s %12.0f packets/s %10.3f s\n", name,
+           result->bytes / result->elapsed / 1e6, result->packets / result->elapsed, result->elapsed);
+}
+
+int main(int argc, char **argv) {
+    bench_context ctx;
+    bench_result plain;
+    bench_result occ;
+    int ret;
+
+    for (int i = 1; i < argc; i++) {
+        const char *key = argv[i];
+
+        if (strncmp(key, "-h", 2) == 0 || strncmp(key, "--help", 6) == 0) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (strncmp(key, "-p", 2) == 0 || strncmp(key, "--port", 6) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            ctx.port = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-s", 2) == 0 || strncmp(key, "--size", 6) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            ctx.packet_size = strtoul(argv[++i], NULL, 0);
+        }
+        if (strncmp(key, "-t", 2) == 0 || strncmp(key, "--time", 6) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            ctx.duration = strtod(argv[++i], NULL);
+        }
+        if (strncmp(key, "-o", 2) == 0 || strncmp(key, "--options", 9) == 0) {
+            if ((i + 1) >= argc)
+                break;
+            ctx.options = argv[++i];
+        }
+    }
+    if (ctx.packet_size < 8 || ctx.packet_size % 4 != 0 || ctx.packet_size > 65536) {
+        fprintf(stderr, "ERROR: packet size must be multiple of 4 between 8 and 65536\n");
+        return 1;
+    }
+
+    ret = run_plain(&ctx, &plain);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: plain TCP run failed (%s)\n", strerror(-ret));
+        return 3;
+    }
+    print_result("TCP loopback", &plain);
+
+    ret = run_occ(&ctx, &occ);
+    if (ret != 0) {
+        fprintf(stderr, "ERROR: OCC socket run failed (%s)\n", strerror(-ret));
+        return 3;
+    }
+    print_result("OCC socket", &occ);
+
+    printf("OCC socket achieved %.1f%% of TCP loopback throughput\n", 100.0 * occ.bytes / occ.elapsed / (plain.bytes / plain.elapsed));
+
+    return 0;
+}